@@ -0,0 +1,330 @@
+#pragma once
+
+/** Counting allocator
+ *
+ * BigInt limbs are allocated through CountingAllocator, which keeps
+ * process-wide counters of the bytes currently allocated, the peak, and the
+ * bytes and number of allocations over time. Counters are relaxed atomics,
+ * so pool threads count too. Each allocation is also counted in the calling
+ * thread's current Allocations::Account, if any, which ThreadPool jobs
+ * inherit from the forking thread. Calc makes its own account current while
+ * evaluating, so concurrent sessions of a server keep apart. Besides the
+ * lifetime peak, accounts have a window peak, restarted by mark(), which
+ * Calc uses to find the peak of each command.
+ *
+ * Allocations of at least MappedStorage::threshold() bytes (when set) are
+ * instead memory-mapped views of unlinked temporary files, so values larger
+ * than RAM are paged to disk by the kernel rather than failing. The kernels
+ * need no changes: additions and comparisons already stream through their
+ * limbs, and Karatsuba multiplication splits large operands into halves
+ * whose products work on ever smaller contiguous blocks.
+ *
+ * Example usage:
+ * ```
+ * std::vector<uint32_t, mesa::CountingAllocator<uint32_t>> v(1000);
+ * mesa::Allocations::stats().current; // At least 4000
+ *
+ * mesa::Allocations::Account account;
+ * {
+ *   mesa::Allocations::Account::Scope scope{&account};
+ *   v.resize(2000);
+ * }
+ * account.stats().total; // At least 8000
+ * mesa::MappedStorage::threshold(size_t{1} << 30); // Map from 1 GiB on
+ * ```
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace mesa
+{
+  //! Allocation counters
+  struct AllocStats
+  {
+    size_t current     = 0; // Bytes allocated now
+    size_t peak        = 0; // Most bytes allocated at once
+    size_t total       = 0; // Bytes allocated over time
+    size_t allocations = 0; // Number of allocations over time
+  };
+
+  //! Counters of the allocations of CountingAllocator
+  class Allocations
+  {
+    public:
+      //! Counters of the allocations of some threads
+      // Frees of bytes allocated elsewhere (say, before the account was
+      // made current) count too, so the bytes allocated now may be negative
+      // and are reported as 0.
+      class Account
+      {
+        public:
+          Account() = default;
+
+          Account(const Account&) = delete;
+          void operator=(const Account&) = delete;
+
+          //! Get counters since the account was created
+          AllocStats stats() const
+          {
+            AllocStats stats;
+            stats.current     = size_t(std::max<std::ptrdiff_t>(
+                  m_current.load(std::memory_order_relaxed), 0));
+            stats.peak        = m_peak.load(std::memory_order_relaxed);
+            stats.total       = m_total.load(std::memory_order_relaxed);
+            stats.allocations = m_allocations.load(std::memory_order_relaxed);
+            return stats;
+          }
+
+          //! Restart the window peak at the bytes allocated now
+          void mark()
+          { m_windowPeak.store(stats().current, std::memory_order_relaxed); }
+
+          //! Get most bytes allocated at once since the last mark()
+          size_t windowPeak() const
+          { return m_windowPeak.load(std::memory_order_relaxed); }
+
+          //! Current account of the calling thread (nullptr if none)
+          static Account*& current()
+          {
+            static thread_local Account* account = nullptr;
+            return account;
+          }
+
+          //! Make an account current for the lifetime of the scope
+          class Scope
+          {
+            public:
+              explicit Scope(Account* account):
+                m_previous{current()}
+              { current() = account; }
+
+              Scope(const Scope&) = delete;
+              void operator=(const Scope&) = delete;
+
+              ~Scope()
+              { current() = m_previous; }
+
+            private:
+              Account* m_previous;
+          };
+
+        private:
+          friend class Allocations;
+
+          void allocated(size_t bytes)
+          {
+            const std::ptrdiff_t current = m_current.fetch_add(
+                std::ptrdiff_t(bytes), std::memory_order_relaxed) +
+              std::ptrdiff_t(bytes);
+            m_total.fetch_add(bytes, std::memory_order_relaxed);
+            m_allocations.fetch_add(1, std::memory_order_relaxed);
+            if (current > 0) {
+              raise(m_peak, size_t(current));
+              raise(m_windowPeak, size_t(current));
+            }
+          }
+
+          void deallocated(size_t bytes)
+          {
+            m_current.fetch_sub(std::ptrdiff_t(bytes),
+                std::memory_order_relaxed);
+          }
+
+          std::atomic<std::ptrdiff_t> m_current{0};
+          std::atomic<size_t> m_peak{0}, m_windowPeak{0};
+          std::atomic<size_t> m_total{0}, m_allocations{0};
+      };
+
+      //! Count an allocation
+      static void allocated(size_t bytes)
+      {
+        process().allocated(bytes);
+        if (Account* account = Account::current())
+          account->allocated(bytes);
+      }
+
+      //! Count a deallocation
+      static void deallocated(size_t bytes)
+      {
+        process().deallocated(bytes);
+        if (Account* account = Account::current())
+          account->deallocated(bytes);
+      }
+
+      //! Get counters since the start of the process
+      static AllocStats stats()
+      { return process().stats(); }
+
+    private:
+      static Account& process()
+      {
+        static Account account;
+        return account;
+      }
+
+      //! Raise a maximum to at least a value
+      static void raise(std::atomic<size_t>& max, size_t value)
+      {
+        size_t seen = max.load(std::memory_order_relaxed);
+        while (seen < value &&
+            !max.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+        {}
+      }
+  };
+
+  //! Memory-mapped temporary files backing large allocations
+  class MappedStorage
+  {
+    public:
+      //! Get smallest allocation in bytes that is mapped (0 if disabled)
+      static size_t threshold()
+      { return state().threshold.load(std::memory_order_relaxed); }
+
+      //! Set smallest allocation in bytes that is mapped (0 disables)
+      static void threshold(size_t bytes)
+      { state().threshold.store(bytes, std::memory_order_relaxed); }
+
+      //! Get directory of the temporary files ($TMPDIR, else /tmp)
+      static std::string directory()
+      {
+        std::lock_guard<std::mutex> lock{state().mutex};
+        return state().directory;
+      }
+
+      //! Set directory of the temporary files
+      static void directory(const std::string& path)
+      {
+        std::lock_guard<std::mutex> lock{state().mutex};
+        state().directory = path;
+      }
+
+      //! Get bytes currently mapped
+      static size_t mapped()
+      { return state().mapped.load(std::memory_order_relaxed); }
+
+      //! Map a new temporary file of a size, if at least the threshold
+      // The file is unlinked at once and its blocks are reserved up front,
+      // so a full disk fails here rather than when the pages are written.
+      // @return nullptr if below the threshold or the file could not be
+      // created, reserved or mapped
+      static void* map(size_t bytes)
+      {
+        State& s = state();
+        const size_t min = s.threshold.load(std::memory_order_relaxed);
+        if (min == 0 || bytes < min)
+          return nullptr;
+        std::string path = directory() + "/mesa-limbs-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        const int fd = mkstemp(name.data());
+        if (fd < 0)
+          return nullptr;
+        unlink(name.data());
+        void* p = MAP_FAILED;
+        if (posix_fallocate(fd, 0, off_t(bytes)) == 0)
+          p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd); // The mapping keeps the file
+        if (p == MAP_FAILED)
+          return nullptr;
+        {
+          std::lock_guard<std::mutex> lock{s.mutex};
+          s.mappings.insert(p);
+        }
+        s.mapped.fetch_add(bytes, std::memory_order_relaxed);
+        size_t smallest = s.smallest.load(std::memory_order_relaxed);
+        while (bytes < smallest && !s.smallest.compare_exchange_weak(
+              smallest, bytes, std::memory_order_relaxed))
+          {}
+        return p;
+      }
+
+      //! Unmap if mapped by map()
+      // @return false if not mapped (so allocated otherwise)
+      static bool unmap(void* p, size_t bytes)
+      {
+        State& s = state();
+        // Nothing this small was ever mapped, so skip the lock
+        if (bytes < s.smallest.load(std::memory_order_relaxed))
+          return false;
+        {
+          std::lock_guard<std::mutex> lock{s.mutex};
+          if (s.mappings.erase(p) == 0)
+            return false;
+        }
+        munmap(p, bytes);
+        s.mapped.fetch_sub(bytes, std::memory_order_relaxed);
+        return true;
+      }
+
+    private:
+      struct State
+      {
+        std::atomic<size_t> threshold{0}, mapped{0}, smallest{SIZE_MAX};
+        std::mutex mutex; // Guards the rest
+        std::unordered_set<void*> mappings;
+        std::string directory;
+
+        State()
+        {
+          const char* tmp = std::getenv("TMPDIR");
+          directory = (tmp != nullptr && *tmp != '\0' ? tmp : "/tmp");
+        }
+      };
+
+      static State& state()
+      {
+        static State s;
+        return s;
+      }
+  };
+
+  //! std::allocator that counts in Allocations
+  // Allocations of at least MappedStorage::threshold() bytes are mapped.
+  template<class T> class CountingAllocator
+  {
+    public:
+      using value_type = T;
+
+      CountingAllocator() = default;
+
+      template<class U>
+      CountingAllocator(const CountingAllocator<U>&) noexcept
+      {}
+
+      T* allocate(size_t n)
+      {
+        T* p = static_cast<T*>(MappedStorage::map(n * sizeof(T)));
+        if (p == nullptr)
+          p = std::allocator<T>{}.allocate(n);
+        Allocations::allocated(n * sizeof(T));
+        return p;
+      }
+
+      void deallocate(T* p, size_t n) noexcept
+      {
+        Allocations::deallocated(n * sizeof(T));
+        if (!MappedStorage::unmap(p, n * sizeof(T)))
+          std::allocator<T>{}.deallocate(p, n);
+      }
+
+      template<class U>
+      bool operator==(const CountingAllocator<U>&) const noexcept
+      { return true; }
+
+      template<class U>
+      bool operator!=(const CountingAllocator<U>&) const noexcept
+      { return false; }
+  };
+}
@@ -3,133 +3,1061 @@
  *
  * Note that binary arithmetic operators call helper functions and *then*
  * resize the output numbers. This way a numbers are not resized until a full
- * operator is complete. e.g. Subtraction calls addition, but I don't want to
- * resize the number after addition but until after all operations in
- * subtraction are finished.
+ * operator is complete. e.g. Subtraction may leave leading zero limbs behind,
+ * but I don't want to trim them until all operations in subtraction are
+ * finished.
+ *
+ * Numbers are stored as base 10^9 limbs, least significant limb first, so
+ * decimal conversion stays linear.
  */
 
+#include <cmath>
+#include <cstring>
 #include <iomanip>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "BigInt.h"
+#include "CancelToken.h"
+#include "ThreadPool.h"
+#include "util.h"
+
+using mesa::BigInt;
+
+constexpr BigInt::DigitT BigInt::s_BASE;
+constexpr size_t BigInt::s_BASE_DIGITS;
+constexpr size_t BigInt::s_KARATSUBA_THRESHOLD;
+constexpr size_t BigInt::s_CHUNK_BITS;
+constexpr size_t BigInt::s_BLOCK_CHUNKS;
+constexpr size_t BigInt::s_BLOCK_WORDS;
+constexpr uint8_t BigInt::s_FORMAT_VERSION;
+size_t BigInt::s_parallelThreshold = 256;
+
+// -----------------------------------------------------------------------------
+// Limb kernels
+//
+// Add-with-carry and subtract-with-borrow in a single pass, using compares
+// instead of division. The AVX2 kernels add 8 limbs at once and resolve the
+// carry chain between lanes with scalar bit tricks: lane i generates a carry
+// when its sum is >= s_BASE and propagates an incoming one when its sum is
+// exactly s_BASE - 1. With G and P as lane bit masks, the carries into each
+// lane are the carry bits of the binary addition (G | P) + G + carry_in.
+// -----------------------------------------------------------------------------
+
+namespace
+{
+  using DigitT = BigInt::DigitT;
+  constexpr DigitT BASE = BigInt::s_BASE;
+
+  DigitT add_n_scalar(
+      DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT carry)
+  {
+    for (size_t i = 0; i < n; ++i) {
+      DigitT t = a[i] + b[i] + carry;
+      carry = (t >= BASE);
+      r[i] = t - carry * BASE;
+    }
+    return carry;
+  }
+
+  DigitT sub_n_scalar(
+      DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT borrow)
+  {
+    for (size_t i = 0; i < n; ++i) {
+      DigitT t = b[i] + borrow;
+      borrow = (a[i] < t);
+      r[i] = a[i] + borrow * BASE - t;
+    }
+    return borrow;
+  }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MESA_HAVE_AVX2_KERNELS
+
+  // Per-lane carry vector from the low 8 bits of a mask
+  __attribute__((target("avx2")))
+  inline __m256i lane_bits(unsigned mask)
+  {
+    return _mm256_and_si256(
+        _mm256_srlv_epi32(_mm256_set1_epi32(mask),
+          _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)),
+        _mm256_set1_epi32(1));
+  }
+
+  __attribute__((target("avx2")))
+  inline unsigned lane_mask(__m256i v)
+  {
+    return _mm256_movemask_ps(_mm256_castsi256_ps(v));
+  }
+
+  // Limbs are < 2^30, so signed 32-bit compares are safe throughout
+  __attribute__((target("avx2")))
+  DigitT add_n_avx2(
+      DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT carry)
+  {
+    const __m256i base = _mm256_set1_epi32(BASE);
+    const __m256i top  = _mm256_set1_epi32(BASE - 1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i sum = _mm256_add_epi32(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+      unsigned g = lane_mask(_mm256_cmpgt_epi32(sum, top));
+      unsigned p = lane_mask(_mm256_cmpeq_epi32(sum, top));
+      unsigned chain = (g | p) + g + carry;
+      unsigned in = chain ^ (g | p) ^ g;
+      carry = (chain >> 8) & 1;
+      sum = _mm256_add_epi32(sum, lane_bits(in));
+      sum = _mm256_sub_epi32(sum,
+          _mm256_and_si256(_mm256_cmpgt_epi32(sum, top), base));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), sum);
+    }
+    return add_n_scalar(r + i, a + i, b + i, n - i, carry);
+  }
+
+  __attribute__((target("avx2")))
+  DigitT sub_n_avx2(
+      DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT borrow)
+  {
+    const __m256i base = _mm256_set1_epi32(BASE);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      __m256i diff = _mm256_sub_epi32(
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)));
+      unsigned g = lane_mask(_mm256_cmpgt_epi32(zero, diff));
+      unsigned p = lane_mask(_mm256_cmpeq_epi32(diff, zero));
+      unsigned chain = (g | p) + g + borrow;
+      unsigned in = chain ^ (g | p) ^ g;
+      borrow = (chain >> 8) & 1;
+      diff = _mm256_sub_epi32(diff, lane_bits(in));
+      diff = _mm256_add_epi32(diff,
+          _mm256_and_si256(_mm256_cmpgt_epi32(zero, diff), base));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), diff);
+    }
+    return sub_n_scalar(r + i, a + i, b + i, n - i, borrow);
+  }
+#endif
+
+  using KernelT = DigitT (*)(
+      DigitT*, const DigitT*, const DigitT*, size_t, DigitT);
+
+  //! Select kernel once, based on the running CPU
+  KernelT dispatch(KernelT scalar, KernelT avx2)
+  {
+#ifdef MESA_HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return avx2;
+#endif
+    (void)avx2;
+    return scalar;
+  }
+
+#ifdef MESA_HAVE_AVX2_KERNELS
+  const KernelT s_addN = dispatch(add_n_scalar, add_n_avx2);
+  const KernelT s_subN = dispatch(sub_n_scalar, sub_n_avx2);
+#else
+  const KernelT s_addN = add_n_scalar;
+  const KernelT s_subN = sub_n_scalar;
+#endif
+}
+
+BigInt::DigitT BigInt::add_n(
+    DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT carry)
+{
+  return s_addN(r, a, b, n, carry);
+}
+
+BigInt::DigitT BigInt::sub_n(
+    DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT borrow)
+{
+  return s_subN(r, a, b, n, borrow);
+}
+
+// -----------------------------------------------------------------------------
+// Montgomery arithmetic
+//
+// Modular arithmetic for the primality tests runs on base 2^64 words rather
+// than decimal limbs, so that reduction needs shifts instead of divisions.
+// Values are kept in Montgomery form (x * 2^(64k) mod n) throughout.
+// https://en.wikipedia.org/wiki/Montgomery_modular_multiplication
+// -----------------------------------------------------------------------------
+
+namespace
+{
+  using WordT  = uint64_t;
+  using WordsT = std::vector<WordT>;
+  __extension__ typedef unsigned __int128 DWordT;
+
+  //! 10^n (n < 9)
+  BigInt::DigitT pow10(size_t n)
+  {
+    BigInt::DigitT p = 1;
+    while (n-- > 0)
+      p *= 10;
+    return p;
+  }
+
+  //! Limbs modulo a small number (m < 2^32)
+  uint64_t mod_small(const BigInt::DataT& limbs, uint64_t m)
+  {
+    uint64_t r = 0;
+    for (size_t i = limbs.size(); i-- > 0;)
+      r = (r * BigInt::s_BASE + limbs[i]) % m;
+    return r;
+  }
+
+  //! Primes below 2^14, sieved once
+  const std::vector<uint32_t>& small_primes()
+  {
+    static const std::vector<uint32_t> primes = []{
+      const size_t LIMIT = 1 << 14;
+      std::vector<bool> sieve(LIMIT, true);
+      std::vector<uint32_t> result;
+      for (size_t i = 2; i < LIMIT; ++i) {
+        if (!sieve[i])
+          continue;
+        result.push_back(i);
+        for (size_t j = i * i; j < LIMIT; j += i)
+          sieve[j] = false;
+      }
+      return result;
+    }();
+    return primes;
+  }
+
+  //! Convert limbs to base 2^64 words
+  WordsT to_words(const BigInt::DataT& limbs)
+  {
+    WordsT words{0};
+    for (size_t i = limbs.size(); i-- > 0;) {
+      DWordT c = limbs[i];
+      for (auto& word: words) {
+        c += DWordT(word) * BigInt::s_BASE;
+        word = WordT(c);
+        c >>= 64;
+      }
+      if (c)
+        words.push_back(WordT(c));
+    }
+    return words;
+  }
+
+  class Montgomery
+  {
+    public:
+      //! Constructor
+      // @param n Odd modulus, base 2^64 words (least significant first)
+      explicit Montgomery(WordsT n):
+        m_n{std::move(n)},
+        m_k{m_n.size()}
+      {
+        // -n^-1 mod 2^64 by Newton iteration (each step doubles the bits)
+        WordT inv = m_n[0];
+        for (int i = 0; i < 5; ++i)
+          inv *= 2 - m_n[0] * inv;
+        m_nInv = -inv;
+        // R mod n, then R^2 mod n by doubling
+        m_one.assign(m_k, 0);
+        m_one[0] = 1;
+        for (size_t i = 0; i < 64 * m_k; ++i)
+          add(m_one, m_one, m_one);
+        m_r2 = m_one;
+        for (size_t i = 0; i < 64 * m_k; ++i)
+          add(m_r2, m_r2, m_r2);
+      }
+
+      //! r = a * b / R mod n (CIOS)
+      void mul(WordsT& r, const WordsT& a, const WordsT& b) const
+      {
+        m_scratch.assign(m_k + 2, 0);
+        WordT* t = m_scratch.data();
+        const WordT* x = a.data();
+        const WordT* y = b.data();
+        const WordT* n = m_n.data();
+        for (size_t i = 0; i < m_k; ++i) {
+          WordT c = 0;
+          for (size_t j = 0; j < m_k; ++j) {
+            DWordT s = t[j] + DWordT(x[j]) * y[i] + c;
+            t[j] = WordT(s);
+            c = WordT(s >> 64);
+          }
+          DWordT s = DWordT(t[m_k]) + c;
+          t[m_k] = WordT(s);
+          t[m_k + 1] = WordT(s >> 64);
+          const WordT m = t[0] * m_nInv;
+          c = WordT((t[0] + DWordT(m) * n[0]) >> 64);
+          for (size_t j = 1; j < m_k; ++j) {
+            s = t[j] + DWordT(m) * n[j] + c;
+            t[j - 1] = WordT(s);
+            c = WordT(s >> 64);
+          }
+          s = DWordT(t[m_k]) + c;
+          t[m_k - 1] = WordT(s);
+          t[m_k] = t[m_k + 1] + WordT(s >> 64);
+        }
+        r.assign(t, t + m_k);
+        if (t[m_k] != 0 || !less(r, m_n))
+          sub(r, r, m_n);
+      }
+
+      //! r = a + b mod n
+      void add(WordsT& r, const WordsT& a, const WordsT& b) const
+      {
+        DWordT c = 0;
+        for (size_t i = 0; i < m_k; ++i) {
+          c += DWordT(a[i]) + b[i];
+          r[i] = WordT(c);
+          c >>= 64;
+        }
+        if (c != 0 || !less(r, m_n))
+          sub(r, r, m_n);
+      }
+
+      //! r = a - b mod n
+      void subtract(WordsT& r, const WordsT& a, const WordsT& b) const
+      {
+        if (sub(r, a, b)) {
+          DWordT c = 0;
+          for (size_t i = 0; i < m_k; ++i) {
+            c += DWordT(r[i]) + m_n[i];
+            r[i] = WordT(c);
+            c >>= 64;
+          }
+        }
+      }
+
+      //! r = r / 2 mod n
+      void halve(WordsT& r) const
+      {
+        DWordT c = 0;
+        if (r[0] & 1) {
+          for (size_t i = 0; i < m_k; ++i) {
+            c += DWordT(r[i]) + m_n[i];
+            r[i] = WordT(c);
+            c >>= 64;
+          }
+        }
+        for (size_t i = 0; i < m_k; ++i) {
+          WordT high = (i + 1 < m_k ? r[i + 1] : WordT(c));
+          r[i] = (r[i] >> 1) | (high << 63);
+        }
+      }
+
+      //! Montgomery form of a small signed integer
+      WordsT from(long x) const
+      {
+        WordsT r(m_k, 0);
+        r[0] = (x < 0 ? 0ul - x : x);
+        mul(r, r, m_r2);
+        if (x < 0)
+          subtract(r, WordsT(m_k, 0), r);
+        return r;
+      }
+
+      bool isZero(const WordsT& a) const
+      {
+        return std::all_of(a.begin(), a.end(),
+            [](const WordT& w) { return w == 0; });
+      }
+
+      //! Strong probable prime test to base a (Miller-Rabin round)
+      bool strongProbablePrime(long a) const
+      {
+        // n - 1 = d * 2^s with d odd
+        WordsT d = m_n;
+        d[0] -= 1;
+        const size_t s = trailing_zeros(d);
+        shift_right(d, s);
+        const WordsT one = m_one;
+        WordsT minusOne;
+        subtract(minusOne, WordsT(m_k, 0), one);
+        WordsT x = pow(from(a), d);
+        if (x == one || x == minusOne)
+          return true;
+        for (size_t i = 1; i < s; ++i) {
+          mul(x, x, x);
+          if (x == minusOne)
+            return true;
+          if (x == one)
+            return false;
+        }
+        return false;
+      }
+
+      //! Strong Lucas probable prime test with P = 1
+      bool strongLucasProbablePrime(long D, long Q) const
+      {
+        // n + 1 = d * 2^s with d odd
+        WordsT d = m_n;
+        DWordT c = 1;
+        for (size_t i = 0; c && i < m_k; ++i) {
+          c += d[i];
+          d[i] = WordT(c);
+          c >>= 64;
+        }
+        if (c)
+          d.push_back(WordT(c));
+        const size_t s = trailing_zeros(d);
+        shift_right(d, s);
+        const WordsT dm = from(D), qm = from(Q);
+        // Binary ladder over the bits of d, starting from index 1
+        WordsT U = m_one, V = m_one, Qk = qm, t(m_k), u(m_k);
+        for (size_t bit = bit_length(d) - 1; bit-- > 0;) {
+          // Double the index
+          mul(U, U, V);
+          mul(V, V, V);
+          subtract(V, V, Qk);
+          subtract(V, V, Qk);
+          mul(Qk, Qk, Qk);
+          if ((d[bit / 64] >> (bit % 64)) & 1) {
+            // Increment the index
+            add(t, U, V);
+            halve(t);
+            mul(u, dm, U);
+            add(V, u, V);
+            halve(V);
+            U.swap(t);
+            mul(Qk, Qk, qm);
+          }
+        }
+        if (isZero(U) || isZero(V))
+          return true;
+        for (size_t r = 1; r < s; ++r) {
+          mul(V, V, V);
+          subtract(V, V, Qk);
+          subtract(V, V, Qk);
+          if (isZero(V))
+            return true;
+          mul(Qk, Qk, Qk);
+        }
+        return false;
+      }
+
+    private:
+      //! base^e in Montgomery form, 4-bit fixed window
+      WordsT pow(const WordsT& base, const WordsT& e) const
+      {
+        std::vector<WordsT> table(16, m_one);
+        for (size_t i = 1; i < 16; ++i)
+          mul(table[i], table[i - 1], base);
+        WordsT r = m_one;
+        const size_t bits = bit_length(e);
+        for (size_t window = (bits + 3) / 4; window-- > 0;) {
+          mesa::cancellation_point();
+          for (int i = 0; i < 4; ++i)
+            mul(r, r, r);
+          WordT w = (e[window * 4 / 64] >> (window * 4 % 64)) & 0xf;
+          if (w)
+            mul(r, r, table[w]);
+        }
+        return r;
+      }
+
+      //! a < b (same length)
+      bool less(const WordsT& a, const WordsT& b) const
+      {
+        for (size_t i = m_k; i-- > 0;) {
+          if (a[i] != b[i])
+            return a[i] < b[i];
+        }
+        return false;
+      }
+
+      //! r = a - b, returning the borrow
+      bool sub(WordsT& r, const WordsT& a, const WordsT& b) const
+      {
+        r.resize(m_k);
+        WordT borrow = 0;
+        for (size_t i = 0; i < m_k; ++i) {
+          WordT t = b[i] + borrow;
+          WordT next = (t < borrow) || (a[i] < t);
+          r[i] = a[i] - t;
+          borrow = next;
+        }
+        return borrow;
+      }
+
+      static size_t trailing_zeros(const WordsT& a)
+      {
+        size_t i = 0;
+        while (a[i] == 0)
+          ++i;
+        return 64 * i + __builtin_ctzll(a[i]);
+      }
+
+      static size_t bit_length(const WordsT& a)
+      {
+        size_t i = a.size();
+        while (i > 0 && a[i - 1] == 0)
+          --i;
+        return (i == 0 ? 0 : 64 * i - __builtin_clzll(a[i - 1]));
+      }
+
+      static void shift_right(WordsT& a, size_t bits)
+      {
+        a.erase(a.begin(), a.begin() + bits / 64);
+        bits %= 64;
+        if (bits == 0)
+          return;
+        for (size_t i = 0; i < a.size(); ++i) {
+          WordT high = (i + 1 < a.size() ? a[i + 1] : 0);
+          a[i] = (a[i] >> bits) | (high << (64 - bits));
+        }
+      }
+
+      WordsT m_n;
+      size_t m_k;
+      WordT m_nInv;
+      WordsT m_one; // R mod n (Montgomery form of 1)
+      WordsT m_r2;  // R^2 mod n
+      mutable WordsT m_scratch;
+  };
+
+  //! Jacobi symbol (a/n) for small a and odd n > |a|
+  // https://en.wikipedia.org/wiki/Jacobi_symbol
+  int jacobi(long a, const BigInt::DataT& n)
+  {
+    int result = 1;
+    const uint64_t n8 = mod_small(n, 8);
+    if (a < 0) {
+      a = -a;
+      if (n8 % 4 == 3)
+        result = -result;
+    }
+    uint64_t x = a;
+    while (x % 2 == 0) {
+      x /= 2;
+      if (n8 == 3 || n8 == 5)
+        result = -result;
+    }
+    if (x == 1)
+      return result;
+    // Quadratic reciprocity, then finish with machine words
+    if (x % 4 == 3 && n8 % 4 == 3)
+      result = -result;
+    uint64_t u = mod_small(n, x), v = x;
+    while (u != 0) {
+      while (u % 2 == 0) {
+        u /= 2;
+        if (v % 8 == 3 || v % 8 == 5)
+          result = -result;
+      }
+      std::swap(u, v);
+      if (u % 4 == 3 && v % 4 == 3)
+        result = -result;
+      u %= v;
+    }
+    return (v == 1 ? result : 0);
+  }
+
+  //! Call f(p) for each prime p <= n, in order
+  // Sieves the odd numbers, one bit each.
+  template<class F>
+  void for_each_prime(uint64_t n, F f)
+  {
+    if (n < 2)
+      return;
+    f(2);
+    std::vector<bool> composite(n / 2 + 1); // 2i + 1
+    for (uint64_t p = 3; p <= n; p += 2) {
+      if (composite[p / 2])
+        continue;
+      if (p * p <= n) {
+        mesa::cancellation_point();
+        for (uint64_t q = p * p; q <= n; q += 2 * p)
+          composite[q / 2] = true;
+      }
+      f(p);
+    }
+  }
+
+  //! Product of values[lo, hi), as a balanced tree of products
+  BigInt product(const std::vector<BigInt>& values, size_t lo, size_t hi)
+  {
+    if (hi - lo < 2)
+      return (hi == lo ? BigInt{1} : values[lo]);
+    const size_t mid = lo + (hi - lo) / 2;
+    return product(values, lo, mid) * product(values, mid, hi);
+  }
+
+  //! Packs factors below 2^32 into 64-bit leaves of a product tree
+  class Leaves
+  {
+    public:
+      void push(uint64_t factor)
+      {
+        if (m_leaf > UINT64_MAX / factor) {
+          m_values.emplace_back(m_leaf);
+          m_leaf = 1;
+        }
+        m_leaf *= factor;
+      }
+
+      //! Product of all factors pushed
+      BigInt product()
+      {
+        m_values.emplace_back(m_leaf);
+        m_leaf = 1;
+        return ::product(m_values, 0, m_values.size());
+      }
+
+    private:
+      std::vector<BigInt> m_values;
+      uint64_t m_leaf = 1;
+  };
+}
 
 // -----------------------------------------------------------------------------
 // BigInt
 // Private non-static member definitions
 // -----------------------------------------------------------------------------
 
-using mesa::BigInt;
+void BigInt::assign(unsigned long long n, bool negative)
+{
+  // Don't have to remove trailing zeroes (not a thing for numbers)
+  // Inserts limbs in reverse order
+  DataT data;
+  do {
+    data.push_back(n % s_BASE);
+    n /= s_BASE;
+  } while (n != 0);
+  m_data = std::move(data);
+  m_negative = negative && !is_zero();
+}
 
 void BigInt::resize()
 {
-  m_data.erase(
-      std::find_if_not(m_data.rbegin(), --m_data.rend(), [](const DigitT& a)
-        { return (a == 0); }).base(), m_data.end());
+  const DataT& data = *m_data;
+  const size_t n = std::find_if_not(data.rbegin(), --data.rend(),
+      [](const DigitT& a) { return (a == 0); }).base() - data.begin();
+  if (n < data.size())
+    m_data.mut().resize(n);
+  if (is_zero())
+    m_negative = false;
+  m_hash = 0;
 }
 
 void BigInt::resize(const size_t& n)
 {
-  m_data.resize(n);
+  m_data.mut().resize(n);
+}
+
+int BigInt::compare_magnitude(const DataT& lhs, const DataT& rhs)
+{
+  if (lhs.size() != rhs.size())
+    return (lhs.size() < rhs.size() ? -1 : 1);
+  for (size_t i = lhs.size(); i-- > 0;) {
+    if (lhs[i] != rhs[i])
+      return (lhs[i] < rhs[i] ? -1 : 1);
+  }
+  return 0;
+}
+
+void BigInt::add_magnitude(const DataT& other)
+{
+  auto& lhs = m_data.mut();
+  auto& rhs = other;
+  const size_t n = rhs.size();
+  if (lhs.size() < n)
+    resize(n);
+  DigitT carry = add_n(lhs.data(), lhs.data(), rhs.data(), n, 0);
+  for (size_t i = n; carry && i < lhs.size(); ++i) {
+    carry = (++lhs[i] == s_BASE);
+    lhs[i] -= carry * s_BASE;
+  }
+  if (carry)
+    lhs.push_back(carry);
 }
 
-void BigInt::to_nines_comp(BigInt::DataT& data)
+bool BigInt::sub_magnitude(const DataT& other)
 {
-  std::transform(data.begin(), data.end(), data.begin(),
-      [](const DigitT& a){ return (9 - a); });
+  auto& lhs = m_data.mut();
+  auto& rhs = other;
+  const int cmp = compare_magnitude(lhs, rhs);
+  if (cmp == 0) {
+    lhs.assign(1, 0);
+    return false;
+  }
+  // Subtract the smaller magnitude from the larger one, in place
+  const bool flip = (cmp < 0);
+  const size_t n = std::min(lhs.size(), rhs.size());
+  DigitT borrow;
+  if (flip) {
+    borrow = sub_n(lhs.data(), rhs.data(), lhs.data(), n, 0);
+    lhs.insert(lhs.end(), rhs.begin() + n, rhs.end());
+  } else {
+    borrow = sub_n(lhs.data(), lhs.data(), rhs.data(), n, 0);
+  }
+  for (size_t i = n; borrow && i < lhs.size(); ++i) {
+    borrow = (lhs[i] == 0);
+    lhs[i] = lhs[i] + borrow * s_BASE - 1;
+  }
+  return flip;
 }
 
-void BigInt::carry(BigInt::DataT& data)
+void BigInt::add(const BigInt& other, bool negate)
 {
-  BigInt::DigitT temp = 0, carry = 0;
-  std::transform(data.begin(), data.end(), data.begin(),
-      [&temp, &carry](const BigInt::DigitT& digit)
-      { temp = digit + carry; carry = temp / 10; return temp % 10; });
+  // Same effective signs add magnitudes, otherwise the magnitudes subtract
+  // and the sign follows the larger one
+  if (m_negative == (other.m_negative != negate))
+    add_magnitude(*other.m_data);
+  else if (sub_magnitude(*other.m_data))
+    m_negative = !m_negative;
 }
 
-void BigInt::add(const BigInt& other)
+void BigInt::add_to(DigitT* r, size_t nr, const DigitT* x, size_t nx)
 {
-  auto& lhs = m_data;
-  auto& rhs = other.m_data;
-  // Add digit padding
-  resize(std::max(lhs.size(), rhs.size()) + 1);
-  // Add phase
-  std::transform(rhs.begin(), rhs.end(), lhs.begin(), lhs.begin(),
-      [](const DigitT& lhsDigit, const DigitT& rhsDigit)
-      { return lhsDigit + rhsDigit; });
-  // Carry phase
-  carry(m_data);
+  // Ignore leading zeroes of x (sub-products may be over-allocated)
+  while (nx > 0 && x[nx - 1] == 0)
+    --nx;
+  assert(nx <= nr);
+  DigitT carry = add_n(r, r, x, nx, 0);
+  for (size_t i = nx; carry && i < nr; ++i) {
+    carry = (++r[i] == s_BASE);
+    r[i] -= carry * s_BASE;
+  }
+  assert(carry == 0);
 }
 
-void BigInt::subtract(const BigInt& other)
+void BigInt::sub_from(DigitT* r, size_t nr, const DigitT* x, size_t nx)
 {
-  if (other > (*this))
-    throw std::range_error(
-        "Negative results unsupported '" +
-        std::string{*this} + " - " + std::string{other} + "'");
-  to_nines_comp(m_data);
-  add(other);
-  to_nines_comp(m_data);
-  m_data.pop_back();
+  while (nx > 0 && x[nx - 1] == 0)
+    --nx;
+  assert(nx <= nr);
+  DigitT borrow = sub_n(r, r, x, nx, 0);
+  for (size_t i = nx; borrow && i < nr; ++i) {
+    borrow = (r[i] == 0);
+    r[i] = r[i] + borrow * s_BASE - 1;
+  }
+  assert(borrow == 0);
 }
 
-// TODO:
-// Implement FFT in another life
-void BigInt::multiply(const BigInt& other)
+void BigInt::mul_basecase(
+    const DigitT* a, size_t na, const DigitT* b, size_t nb, DigitT* r)
+{
+  for (size_t i = 0; i < nb; ++i) {
+    mesa::cancellation_point();
+    const uint64_t digit = b[i];
+    if (digit == 0)
+      continue;
+    uint64_t carry = 0;
+    for (size_t j = 0; j < na; ++j) {
+      uint64_t t = r[i + j] + a[j] * digit + carry;
+      r[i + j] = t % s_BASE;
+      carry = t / s_BASE;
+    }
+    // Nothing has been written past r[i + na - 1] yet
+    r[i + na] = carry;
+  }
+}
+
+BigInt::DigitT BigInt::addmul_basecase(const DigitT* a, size_t na,
+    const DigitT* b, size_t nb, DigitT* r, size_t nr)
+{
+  DigitT out = 0;
+  for (size_t i = 0; i < nb; ++i) {
+    mesa::cancellation_point();
+    const uint64_t digit = b[i];
+    if (digit == 0)
+      continue;
+    uint64_t carry = 0;
+    for (size_t j = 0; j < na; ++j) {
+      uint64_t t = r[i + j] + a[j] * digit + carry;
+      r[i + j] = t % s_BASE;
+      carry = t / s_BASE;
+    }
+    // Unlike mul_basecase, the limbs above the row already hold digits
+    size_t k = i + na;
+    if (k == nr) {
+      out += DigitT(carry);
+      continue;
+    }
+    carry += r[k];
+    r[k] = DigitT(carry % s_BASE);
+    carry /= s_BASE;
+    for (++k; carry && k < nr; ++k) {
+      carry = (++r[k] == s_BASE);
+      r[k] -= DigitT(carry) * s_BASE;
+    }
+    out += DigitT(carry);
+  }
+  return out;
+}
+
+void BigInt::mul_karatsuba(
+    const DigitT* a, size_t na, const DigitT* b, size_t nb, DigitT* r)
+{
+  // https://en.wikipedia.org/wiki/Karatsuba_algorithm
+  if (na < nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  if (nb < s_KARATSUBA_THRESHOLD) {
+    mul_basecase(a, na, b, nb, r);
+    return;
+  }
+  if (na >= 2 * nb) {
+    // Unbalanced operands: multiply b by nb-digit slices of a
+    DataT t(2 * nb);
+    for (size_t i = 0; i < na; i += nb) {
+      size_t n = std::min(nb, na - i);
+      std::fill(t.begin(), t.end(), 0);
+      mul_karatsuba(a + i, n, b, nb, t.data());
+      add_to(r + i, na + nb - i, t.data(), n + nb);
+    }
+    return;
+  }
+  // Split both operands at m digits (nb > m because nb > na / 2)
+  //   a*b = z2*B^2m + (z1 - z2 - z0)*B^m + z0
+  const size_t m = na / 2;
+  const DigitT *a0 = a, *a1 = a + m, *b0 = b, *b1 = b + m;
+  const size_t na1 = na - m, nb1 = nb - m;
+  DataT sa(std::max(m, na1) + 1), sb(std::max(m, nb1) + 1);
+  std::copy(a0, a0 + m, sa.begin());
+  add_to(sa.data(), sa.size(), a1, na1);
+  std::copy(b0, b0 + m, sb.begin());
+  add_to(sb.data(), sb.size(), b1, nb1);
+  DataT z1(sa.size() + sb.size());
+  // z0 and z2 land in disjoint halves of r, so all three products are
+  // independent
+  auto z0 = [&]{ mul_karatsuba(a0, m, b0, m, r); };
+  auto z2 = [&]{ mul_karatsuba(a1, na1, b1, nb1, r + 2 * m); };
+  auto mid = [&]{
+    mul_karatsuba(sa.data(), sa.size(), sb.data(), sb.size(), z1.data());
+  };
+  if (nb >= s_parallelThreshold) {
+    auto& pool = ThreadPool::instance();
+    pool.invoke(mid, [&]{ pool.invoke(z0, z2); });
+  } else {
+    z0();
+    z2();
+    mid();
+  }
+  sub_from(z1.data(), z1.size(), r, 2 * m);
+  sub_from(z1.data(), z1.size(), r + 2 * m, na1 + nb1);
+  add_to(r + m, na + nb - m, z1.data(), z1.size());
+}
+
+void BigInt::sqr_basecase(const DigitT* a, size_t n, DigitT* r)
+{
+  // Cross products a_i*a_j (i < j), each once
+  for (size_t i = 0; i + 1 < n; ++i) {
+    mesa::cancellation_point();
+    const uint64_t digit = a[i];
+    uint64_t carry = 0;
+    for (size_t j = i + 1; j < n; ++j) {
+      uint64_t t = r[i + j] + a[j] * digit + carry;
+      r[i + j] = t % s_BASE;
+      carry = t / s_BASE;
+    }
+    r[i + n] = carry;
+  }
+  // Double them and add the squares a_i^2 in one carry pass
+  uint64_t carry = 0;
+  for (size_t k = 0; k < 2 * n; ++k) {
+    uint64_t t = 2 * uint64_t(r[k]) + carry;
+    if (k % 2 == 0)
+      t += uint64_t(a[k / 2]) * a[k / 2];
+    r[k] = t % s_BASE;
+    carry = t / s_BASE;
+  }
+}
+
+void BigInt::sqr_karatsuba(const DigitT* a, size_t n, DigitT* r)
 {
-  // Using acyclic convolution
-  // https://en.wikipedia.org/wiki/Sch%C3%B6nhage%E2%80%93Strassen_algorithm
-  // https://en.wikipedia.org/wiki/Circular_convolution
+  if (n < s_KARATSUBA_THRESHOLD) {
+    sqr_basecase(a, n, r);
+    return;
+  }
+  // Split at m digits
+  //   a^2 = z2*B^2m + (z1 - z2 - z0)*B^m + z0, with z1 = (a0 + a1)^2
+  const size_t m = n / 2, n1 = n - m;
+  const DigitT *a0 = a, *a1 = a + m;
+  DataT sa(n1 + 1);
+  std::copy(a0, a0 + m, sa.begin());
+  add_to(sa.data(), sa.size(), a1, n1);
+  DataT z1(2 * sa.size());
+  auto z0 = [&]{ sqr_karatsuba(a0, m, r); };
+  auto z2 = [&]{ sqr_karatsuba(a1, n1, r + 2 * m); };
+  auto mid = [&]{ sqr_karatsuba(sa.data(), sa.size(), z1.data()); };
+  if (n >= s_parallelThreshold) {
+    auto& pool = ThreadPool::instance();
+    pool.invoke(mid, [&]{ pool.invoke(z0, z2); });
+  } else {
+    z0();
+    z2();
+    mid();
+  }
+  sub_from(z1.data(), z1.size(), r, 2 * m);
+  sub_from(z1.data(), z1.size(), r + 2 * m, 2 * n1);
+  add_to(r + m, 2 * n - m, z1.data(), z1.size());
+}
 
+void BigInt::multiply(const BigInt& other)
+{
+  // Squaring (e.g. x *= x) takes the cheaper path
+  if (&other == this) {
+    *this = square();
+    return;
+  }
   // Special cases
-  if ((*this) == 0 || other == 0) {
-    m_data = DataT{0};
+  m_negative = (m_negative != other.m_negative);
+  if (is_zero() || other.is_zero()) {
+    m_data = Limbs{};
+    m_negative = false;
     return;
-  } else if (other == 1) {
+  } else if (other.size() == 1 && other.data()[0] == 1) {
     return;
-  } else if ((*this) == 1) {
-    m_data = other.m_data;
+  } else if (size() == 1 && data()[0] == 1) {
+    m_data = other.m_data; // Shared
     return;
   }
   // lhs:multiplicand, rhs:multiplier
-  auto& lhs = m_data;
-  auto& rhs = other.m_data;
-  DataT res(std::max(lhs.size(), rhs.size()) * 2);
-  // Multiplication phase
-  BigInt m = 0;
-  std::for_each(rhs.begin(), rhs.end(),
-      [&m, &lhs, &res](const DigitT& rhsDigit) {
-      std::transform(lhs.begin(), lhs.end(),
-        res.begin()+(unsigned long)(m), res.begin()+(unsigned long)(m),
-        [&rhsDigit](const DigitT& lhsDigit, const DigitT& resDigit)
-        { return resDigit + lhsDigit * rhsDigit; });
-      carry(res);
-      ++m;
-      });
-  // Carry phase
-  m_data.swap(res);
+  const auto& lhs = *m_data;
+  const auto& rhs = *other.m_data;
+  DataT res(lhs.size() + rhs.size());
+  mul_karatsuba(lhs.data(), lhs.size(), rhs.data(), rhs.size(), res.data());
+  m_data = std::move(res);
 }
 
-void BigInt::divide(const BigInt& other)
+void BigInt::divmod(const DataT& u, const DataT& v, DataT* q, DataT* r)
 {
   // https://en.wikipedia.org/wiki/Division_algorithm
-  // TODO: Replace literal number 0 with static BigInt with '0' to reduce
-  // on new BigInt's created
-  if ((*this) == 0)
+  // Knuth, TAOCP Vol. 2, 4.3.1, Algorithm D
+  const size_t n = v.size();
+  if (compare_magnitude(u, v) < 0) {
+    if (q)
+      *q = DataT{0};
+    if (r)
+      *r = u;
     return;
-  if (other == 0)
+  }
+  // Single limb divisor
+  if (n == 1) {
+    DataT quot(u.size());
+    uint64_t rem = 0;
+    for (size_t i = u.size(); i-- > 0;) {
+      uint64_t t = rem * s_BASE + u[i];
+      quot[i] = t / v[0];
+      rem = t % v[0];
+    }
+    if (q)
+      q->swap(quot);
+    if (r)
+      *r = DataT{DigitT(rem)};
+    return;
+  }
+  // Normalize so that the divisor's top limb is at least s_BASE / 2, which
+  // keeps each quotient limb estimate within two of the true value
+  const uint64_t f = s_BASE / (uint64_t(v.back()) + 1);
+  DataT un(u.size() + 1), vn(n);
+  uint64_t carry = 0;
+  for (size_t i = 0; i < u.size(); ++i) {
+    uint64_t t = u[i] * f + carry;
+    un[i] = t % s_BASE;
+    carry = t / s_BASE;
+  }
+  un[u.size()] = carry;
+  carry = 0;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t t = v[i] * f + carry;
+    vn[i] = t % s_BASE;
+    carry = t / s_BASE;
+  }
+  const size_t m = u.size() - n;
+  const uint64_t vtop = vn[n - 1], vnext = vn[n - 2];
+  DataT quot(m + 1);
+  for (size_t j = m + 1; j-- > 0;) {
+    mesa::cancellation_point();
+    // Estimate quotient limb from the top two limbs
+    uint64_t t = uint64_t(un[j + n]) * s_BASE + un[j + n - 1];
+    uint64_t qhat = t / vtop, rhat = t % vtop;
+    while (qhat >= s_BASE || qhat * vnext > rhat * s_BASE + un[j + n - 2]) {
+      --qhat;
+      rhat += vtop;
+      if (rhat >= s_BASE)
+        break;
+    }
+    // Multiply and subtract
+    uint64_t mulCarry = 0;
+    DigitT borrow = 0;
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t p = qhat * vn[i] + mulCarry;
+      mulCarry = p / s_BASE;
+      DigitT sub = DigitT(p % s_BASE) + borrow;
+      borrow = (un[i + j] < sub);
+      un[i + j] = un[i + j] + borrow * s_BASE - sub;
+    }
+    DigitT sub = DigitT(mulCarry) + borrow;
+    borrow = (un[j + n] < sub);
+    un[j + n] = un[j + n] + borrow * s_BASE - sub;
+    // Estimate was one too large, add back
+    if (borrow) {
+      --qhat;
+      DigitT c = add_n(&un[j], &un[j], vn.data(), n, 0);
+      un[j + n] = (un[j + n] + c) % s_BASE;
+    }
+    quot[j] = qhat;
+  }
+  if (q)
+    q->swap(quot);
+  if (r) {
+    // Undo normalization
+    un.resize(n);
+    uint64_t rem = 0;
+    for (size_t i = n; i-- > 0;) {
+      uint64_t t = rem * s_BASE + un[i];
+      un[i] = t / f;
+      rem = t % f;
+    }
+    r->swap(un);
+  }
+}
+
+void BigInt::divide(const BigInt& other, bool modulus)
+{
+  if (other.is_zero())
     throw std::invalid_argument(
         "Division by zero");
-  auto& N = (*this);
-  auto& D = other;
-  BigInt Q;
-  while (N >= D) {
-    N -= D;
-    ++Q;
+  // Large powers of two divide as a shift, which is a product instead of
+  // a quadratic long division; 2^bits * 5^bits == 10^bits confirms one
+  size_t bits;
+  if (!modulus && other.size() >= s_KARATSUBA_THRESHOLD &&
+      compare_magnitude(*m_data, *other.m_data) >= 0 &&
+      maybe_pow2(*other.m_data, bits)) {
+    const BigInt five = power_small(5, bits);
+    BigInt divisor{other};
+    divisor.m_negative = false;
+    if (divisor * five == power_small(10, bits)) {
+      const bool negative = (m_negative != other.m_negative);
+      shift_right_magnitude(bits, five);
+      m_negative = negative && !is_zero();
+      return;
+    }
+  }
+  DataT res;
+  if (modulus) {
+    divmod(*m_data, *other.m_data, nullptr, &res);
+  } else {
+    divmod(*m_data, *other.m_data, &res, nullptr);
+    m_negative = (m_negative != other.m_negative);
   }
-  m_data.swap(Q.m_data);
+  m_data = std::move(res);
 }
 
 void BigInt::exponentiate(const BigInt& other)
 {
+  // Including 0 to a negative power, a division by zero
+  if (other.m_negative)
+    throw std::domain_error(
+        "Negative exponent unsupported '" + std::string{*this} + "^" +
+        std::string{other} + "'");
   // Something is zero...
   if (((*this) == 0) || (other == 0)) {
     if (((*this) == 0) && (other == 0)) {
@@ -146,23 +1074,263 @@ void BigInt::exponentiate(const BigInt& other)
   }
   // https://en.wikipedia.org/wiki/Exponentiation_by_squaring
 
+  // Odd powers keep the sign of the base
+  const bool negative = m_negative && (other.m_data->front() % 2 == 1);
+  m_negative = false;
+  // Single limb bases (2 n ^, 10 n ^) need no general products
+  if (size() == 1 && other.size() <= 2) {
+    *this = power_small(data()[0],
+        static_cast<unsigned long>(other));
+    m_negative = negative;
+    return;
+  }
   // lhs:base, rhs:exponent
   auto& X = (*this);
-  auto& x = X.m_data;
   auto N = other;
-  auto& n = N.m_data;
   BigInt R{1};
-  R.resize((unsigned long)(x.size() * N));
-  auto& r = R.m_data;
   while (N != 0) {
-    if (n.front() % 2 == 1) {
+    mesa::cancellation_point();
+    if (N.m_data->front() % 2 == 1) {
       R *= X;
       --N;
     }
     X *= X;
     N /= 2;
   }
-  x.swap(r);
+  m_data.swap(R.m_data);
+  m_negative = negative;
+}
+
+BigInt BigInt::power_small(DigitT base, size_t n)
+{
+  if (n == 0)
+    return 1;
+  // Powers of ten: shift 10^(digits % 9) by digits / 9 limbs
+  size_t digits = 0;
+  DigitT p = 1;
+  for (; p < base; p *= 10)
+    ++digits;
+  if (p == base) {
+    digits *= n;
+    BigInt r{pow10(digits % s_BASE_DIGITS)};
+    r.shift_limbs(long(digits / s_BASE_DIGITS));
+    return r;
+  }
+  const BigInt b{base};
+  BigInt r{b};
+  for (size_t i = 63 - __builtin_clzll(n); i-- > 0;) {
+    mesa::cancellation_point();
+    r = r.square();
+    if ((n >> i) & 1)
+      r *= b;
+  }
+  return r;
+}
+
+bool BigInt::maybe_pow2(const DataT& x, size_t& bits)
+{
+  bits = 0;
+  if (x.size() == 1 && x[0] == 1)
+    return true;
+  if (x[0] % 2 != 0)
+    return false;
+  // Nearest exponent from the top two limbs, then 2^bits mod s_BASE
+  const double top = x.back() +
+    (x.size() > 1 ? x[x.size() - 2] / double(s_BASE) : 0.0);
+  bits = size_t(std::llround(std::log2(top) +
+        (x.size() - 1) * std::log2(double(s_BASE))));
+  uint64_t low = 1, square = 2;
+  for (size_t n = bits; n != 0; n /= 2) {
+    if (n % 2 == 1)
+      low = low * square % s_BASE;
+    square = square * square % s_BASE;
+  }
+  return low == x[0];
+}
+
+bool BigInt::shift_right_magnitude(size_t bits, const BigInt& five)
+{
+  m_negative = false;
+  operator*=(five);
+  // Then drop bits decimal digits: whole limbs, then a short division
+  const size_t limbs = bits / s_BASE_DIGITS;
+  const DataT& data = *m_data;
+  bool exact = std::all_of(data.begin(),
+      data.begin() + std::min(limbs, data.size()),
+      [](DigitT limb) { return limb == 0; });
+  shift_limbs(-long(limbs));
+  const DigitT divisor = pow10(bits % s_BASE_DIGITS);
+  if (divisor != 1) {
+    DataT q, r;
+    divmod(*m_data, DataT{divisor}, &q, &r);
+    m_data = std::move(q);
+    exact = exact && r[0] == 0;
+  }
+  resize();
+  return exact;
+}
+
+size_t BigInt::shift_count(const BigInt& bits)
+{
+  if (bits.m_negative)
+    throw std::domain_error(
+        "Negative shift count '" + std::string{bits} + "'");
+  if (bits.size() > 2)
+    throw std::out_of_range(
+        "Shift count '" + std::string{bits} + "' out of range");
+  return static_cast<unsigned long>(bits);
+}
+
+void BigInt::shift_limbs(long limbs)
+{
+  if (is_zero())
+    return;
+  if (limbs > 0) {
+    DataT& data = m_data.mut();
+    data.insert(data.begin(), limbs, 0);
+  } else if (size_t(-limbs) >= size()) {
+    m_data = Limbs{};
+    m_negative = false;
+  } else {
+    DataT& data = m_data.mut();
+    data.erase(data.begin(), data.begin() + (-limbs));
+  }
+}
+
+BigInt BigInt::iroot_magnitude(const BigInt& x, unsigned long n)
+{
+  if (n == 1 || x < 2)
+    return x;
+  // Any root of degree beyond the bit length of x is 1
+  if (n >= x.size() * 30)
+    return 1;
+  // Seed with an upper bound on the root, either from floating point (for
+  // few limbs) or from the root of the top limbs
+  BigInt r;
+  const size_t shift = x.size() / (2 * n);
+  if (shift == 0) {
+    double log = std::log(double(x.data().back())) +
+      (x.size() - 1) * std::log(double(s_BASE));
+    if (x.size() > 1)
+      log += std::log1p(x.data()[x.size() - 2] /
+          (double(s_BASE) * x.data().back()));
+    r = BigInt(static_cast<unsigned long long>(
+          std::exp(log / n) * (1 + 1e-9)) + 1);
+  } else {
+    BigInt high = x;
+    high.shift_limbs(-long(shift * n));
+    r = iroot_magnitude(high, n) + 1;
+    r.shift_limbs(shift);
+  }
+  // Newton iteration decreases monotonically to the floor of the root:
+  //   r' = ((n - 1) * r + x / r^(n - 1)) / n
+  if (n == 2) {
+    while (true) {
+      mesa::cancellation_point();
+      BigInt next = (r + x / r) / 2;
+      if (next >= r)
+        return r;
+      r = std::move(next);
+    }
+  }
+  const BigInt degree = n, power = n - 1;
+  while (true) {
+    mesa::cancellation_point();
+    BigInt next = (power * r + x / (r ^ power)) / degree;
+    if (next >= r)
+      return r;
+    r = std::move(next);
+  }
+}
+
+void BigInt::assign_radix(const std::string& s, size_t first, unsigned bits)
+{
+  auto digit = [](char c) -> DigitT
+  {
+    if (c >= 'a')
+      return DigitT(c - 'a' + 10);
+    if (c >= 'A')
+      return DigitT(c - 'A' + 10);
+    return DigitT(c - '0');
+  };
+  // Blocks of s_BLOCK_CHUNKS chunks from the least significant end, each by
+  // Horner's rule one chunk (less than s_BASE) at a time
+  const size_t chunkDigits = s_CHUNK_BITS / bits;
+  const size_t blockDigits = chunkDigits * s_BLOCK_CHUNKS;
+  std::vector<BigInt> blocks;
+  for (size_t last = s.size(); last > first;) {
+    mesa::cancellation_point();
+    const size_t begin = (last - first > blockDigits ?
+        last - blockDigits : first);
+    DataT data{0};
+    size_t i = begin;
+    for (size_t n = (last - begin) % chunkDigits; i < last; n = chunkDigits) {
+      if (n == 0)
+        continue;
+      uint64_t carry = 0;
+      for (size_t j = 0; j < n; ++j, ++i)
+        carry = carry << bits | digit(s[i]);
+      for (auto& limb: data) {
+        const uint64_t t = (uint64_t(limb) << (n * bits)) + carry;
+        limb = DigitT(t % s_BASE);
+        carry = t / s_BASE;
+      }
+      if (carry)
+        data.push_back(DigitT(carry));
+    }
+    blocks.emplace_back();
+    blocks.back().m_data = std::move(data);
+    blocks.back().resize();
+    last = begin;
+  }
+  // Then pairs of blocks, least significant first, as lo + hi * 2^(block
+  // bits), doubling the block size at each level
+  BigInt scale{1 << s_CHUNK_BITS};
+  for (size_t n = s_BLOCK_CHUNKS; n > 1; n /= 2)
+    scale = scale.square();
+  while (blocks.size() > 1) {
+    for (size_t i = 0; i + 1 < blocks.size(); i += 2) {
+      mesa::cancellation_point();
+      blocks[i / 2] = blocks[i] + blocks[i + 1] * scale;
+    }
+    if (blocks.size() % 2 == 1)
+      blocks[blocks.size() / 2] = std::move(blocks.back());
+    blocks.resize((blocks.size() + 1) / 2);
+    if (blocks.size() > 1)
+      scale = scale.square();
+  }
+  m_data = (blocks.empty() ? Limbs{} : std::move(blocks[0].m_data));
+  m_negative = (s[0] == '-') && !is_zero();
+}
+
+void BigInt::radix_words(const BigInt& x, size_t level,
+    const std::vector<BigInt>& twos, const std::vector<BigInt>& fives,
+    uint32_t* out)
+{
+  mesa::cancellation_point();
+  if (level == 0 || x.size() <= s_KARATSUBA_THRESHOLD) {
+    // Short division by 2^32, which is a shift on each partial remainder
+    DataT q = x.data();
+    while (q.size() > 1 || q[0] != 0) {
+      uint64_t rem = 0;
+      for (size_t i = q.size(); i-- > 0;) {
+        const uint64_t t = rem * s_BASE + q[i];
+        q[i] = DigitT(t >> 32);
+        rem = t & 0xffffffff;
+      }
+      *out++ = uint32_t(rem);
+      while (q.size() > 1 && q.back() == 0)
+        q.pop_back();
+    }
+    return;
+  }
+  // x = hi * 2^m + lo, with hi = floor(x * 5^m / 10^m)
+  const size_t m = 32 * (s_BLOCK_WORDS << (level - 1));
+  BigInt hi = x;
+  hi.shift_right_magnitude(m, fives[level - 1]);
+  const BigInt lo = x - hi * twos[level - 1];
+  radix_words(lo, level - 1, twos, fives, out);
+  radix_words(hi, level - 1, twos, fives, out + (s_BLOCK_WORDS << (level - 1)));
 }
 
 // -----------------------------------------------------------------------------
@@ -170,54 +1338,153 @@ void BigInt::exponentiate(const BigInt& other)
 // Public non-static member definitions
 // -----------------------------------------------------------------------------
 
-BigInt::BigInt(unsigned long long n) noexcept
-{
-  // Don't have to remove trailing zeroes (not a thing for numbers)
-  // Inserts digits in reverse order
-  do {
-    m_data.push_back(n % 10);
-    n /= 10;
-  } while (n != 0);
-}
-
 BigInt::BigInt(const std::string& s)
 {
+  // Power-of-two radixes after '0x' and '0b' (and an optional sign)
+  if (const unsigned bits = mesa::radix_bits(s)) {
+    const size_t first = 2 + (s[0] == '-');
+    assign_radix(s, std::min(s.find_first_not_of('0', first), s.size()),
+        bits);
+    return;
+  }
+  // Optional sign
+  auto first = s.begin();
+  if (first != s.end() && *first == '-')
+    ++first;
   // Check if is numeric
-  if (s.empty() || std::find_if(s.begin(), s.end(),
+  if (first == s.end() || std::find_if(first, s.end(),
         [](char c) { return !std::isdigit(c); }) != s.end())
     throw std::invalid_argument(
         "Attempted conversion from non-numeric token '" + s + "'");
-  // Get position of first non-trailing-zero character...
-  auto jt = ((s.size() > 1) ?
-      std::string::const_reverse_iterator(
-        std::find_if_not(s.begin(), s.end(),
-          [](const char& c) { return c == '0'; })) :
-      s.crend());
-  // And insert from there to end
-  for (auto it = s.rbegin(); it != jt; ++it)
-    m_data.push_back((*it) - '0');
+  // Skip leading zeroes (but keep a single '0')
+  first = std::find_if_not(first, s.end() - 1,
+      [](const char& c) { return c == '0'; });
+  // And insert limbs from the least significant end
+  DataT data;
+  data.reserve((s.end() - first) / s_BASE_DIGITS + 1);
+  for (auto last = s.end(); last != first;) {
+    auto it = (size_t(last - first) > s_BASE_DIGITS ?
+        last - s_BASE_DIGITS : first);
+    DigitT limb = 0;
+    for (auto jt = it; jt != last; ++jt)
+      limb = limb * 10 + ((*jt) - '0');
+    data.push_back(limb);
+    last = it;
+  }
+  m_data = std::move(data);
+  m_negative = (s[0] == '-') && !is_zero();
+}
+
+size_t BigInt::hash() const
+{
+  if (m_hash != 0)
+    return m_hash;
+  uint64_t h = m_negative;
+  size_t i = 0;
+  for (; i + 1 < size(); i += 2)
+    h = (h ^ (uint64_t(data()[i + 1]) << 32 | data()[i])) *
+      0x9e3779b97f4a7c15ull;
+  if (i < size())
+    h = (h ^ data()[i]) * 0x9e3779b97f4a7c15ull;
+  // Zero marks the cache as empty
+  h = mesa::hash_mix(h ^ size());
+  m_hash = size_t(h != 0 ? h : 1);
+  return m_hash;
+}
+
+size_t BigInt::digits() const
+{
+  size_t n = (size() - 1) * s_BASE_DIGITS + 1;
+  for (DigitT top = data().back(); top >= 10; top /= 10)
+    ++n;
+  return n;
+}
+
+int BigInt::compare(const BigInt& other) const
+{
+  if (m_negative != other.m_negative)
+    return (m_negative ? -1 : 1);
+  int cmp = compare_magnitude(data(), other.data());
+  return (m_negative ? -cmp : cmp);
 }
 
 BigInt::operator unsigned long() const
 {
-  std::ostringstream oss;
-  std::copy(m_data.rbegin(), m_data.rend(), std::ostream_iterator<DigitT>(oss));
-  return std::stoul(oss.str());
+  if (m_negative)
+    throw std::out_of_range(
+        "Negative value '" + std::string{*this} + "' out of range");
+  return std::stoul(std::string{*this});
 }
 
 BigInt::operator std::string() const
 {
-  std::ostringstream ss;
-  std::copy(m_data.rbegin(), m_data.rend(),
-      std::ostream_iterator<DigitT>(ss));
-  return ss.str();
+  // Most significant limb unpadded, the rest zero-padded to s_BASE_DIGITS
+  std::string top = (m_negative ? "-" : "") + std::to_string(data().back());
+  std::string s(top.size() + (size() - 1) * s_BASE_DIGITS, '0');
+  std::copy(top.begin(), top.end(), s.begin());
+  auto out = s.end();
+  for (size_t i = 0; i + 1 < size(); ++i) {
+    DigitT limb = data()[i];
+    for (size_t j = 0; j < s_BASE_DIGITS; ++j) {
+      *(--out) = '0' + (limb % 10);
+      limb /= 10;
+    }
+  }
+  return s;
+}
+
+std::string BigInt::toString(unsigned radix) const
+{
+  if (radix == 10)
+    return std::string{*this};
+  if (radix != 16 && radix != 2)
+    throw std::invalid_argument(
+        "Unsupported radix " + std::to_string(radix) +
+        " (use 2, 10 or 16)");
+  // Split into halves until the blocks, with the powers of two and five at
+  // each level; a limb holds less than 30 bits
+  const size_t bits = 30 * size();
+  std::vector<BigInt> twos, fives;
+  size_t level = 0;
+  for (; 32 * (s_BLOCK_WORDS << level) < bits; ++level) {
+    mesa::cancellation_point();
+    if (level == 0) {
+      twos.push_back(BigInt{2} ^ BigInt{32 * s_BLOCK_WORDS});
+      fives.push_back(BigInt{5} ^ BigInt{32 * s_BLOCK_WORDS});
+    } else {
+      twos.push_back(twos.back().square());
+      fives.push_back(fives.back().square());
+    }
+  }
+  BigInt x{*this};
+  x.m_negative = false;
+  std::vector<uint32_t> words(s_BLOCK_WORDS << level, 0);
+  radix_words(x, level, twos, fives, words.data());
+  // Digits from the most significant nonzero one on
+  static const char digits[] = "0123456789abcdef";
+  const unsigned digitBits = (radix == 16 ? 4 : 1);
+  std::string s = std::string{m_negative ? "-" : ""} +
+    (radix == 16 ? "0x" : "0b");
+  const size_t prefix = s.size();
+  s.reserve(prefix + 32 / digitBits * words.size());
+  for (size_t i = words.size(); i-- > 0;) {
+    for (unsigned shift = 32; shift > 0;) {
+      shift -= digitBits;
+      const uint32_t d = (words[i] >> shift) & (radix - 1);
+      if (d != 0 || s.size() > prefix)
+        s.push_back(digits[d]);
+    }
+  }
+  if (s.size() == prefix)
+    s.push_back('0');
+  return s;
 }
 
 //BigInt::operator char*() const
 
 BigInt& BigInt::operator+=(const BigInt& other)
 {
-  if (other == 0)
+  if (other.is_zero())
     return *this;
   add(other);
   resize();
@@ -240,16 +1507,15 @@ BigInt& BigInt::operator*=(const BigInt& other)
 
 BigInt& BigInt::operator/=(const BigInt& other)
 {
-  divide(other);
+  divide(other, false);
   resize();
   return *this;
 }
 
 BigInt& BigInt::operator%=(const BigInt& other)
 {
-  BigInt temp(*this);
-  temp /= other;
-  operator-=(temp * other);
+  divide(other, true);
+  resize();
   return *this;
 }
 
@@ -260,32 +1526,803 @@ BigInt& BigInt::operator^=(const BigInt& other)
   return *this;
 }
 
-// -----------------------------------------------------------------------------
-// External definitions
-// -----------------------------------------------------------------------------
+BigInt& BigInt::operator<<=(const BigInt& bits)
+{
+  return operator*=(power_small(2, shift_count(bits)));
+}
+
+BigInt& BigInt::operator>>=(const BigInt& bits)
+{
+  const size_t n = shift_count(bits);
+  if (n == 0 || is_zero())
+    return *this;
+  // A limb holds less than 30 bits
+  const bool negative = m_negative;
+  bool exact;
+  if (n >= 30 * size()) {
+    *this = 0;
+    exact = false;
+  } else if (n / 30 < s_KARATSUBA_THRESHOLD) {
+    // Short divisors: one long division pass
+    DataT q, r;
+    divmod(*m_data, *power_small(2, n).m_data, &q, &r);
+    m_data = std::move(q);
+    exact = (r.size() == 1 && r[0] == 0);
+    resize();
+  } else {
+    exact = shift_right_magnitude(n, power_small(5, n));
+  }
+  // Floor: inexact negative quotients round away from zero
+  if (negative && !exact)
+    add_magnitude(DataT{1});
+  m_negative = negative;
+  resize();
+  return *this;
+}
+
+BigInt BigInt::square() const
+{
+  BigInt result;
+  if (is_zero())
+    return result;
+  DataT r(2 * size());
+  sqr_karatsuba(data().data(), size(), r.data());
+  result.m_data = std::move(r);
+  result.resize();
+  return result;
+}
 
-bool operator<(const BigInt& lhs, const BigInt& rhs)
+BigInt& BigInt::addmul(const BigInt& a, const BigInt& b)
 {
-  if (lhs == rhs) {
+  if (a.is_zero() || b.is_zero())
+    return *this;
+  const bool negative = (a.m_negative != b.m_negative);
+  // Opposite signs subtract, and an operand aliasing this would be written
+  // while it is read
+  if ((negative != m_negative && !is_zero()) || &a == this || &b == this)
+    return operator+=(a * b);
+  const DataT* x = &*a.m_data;
+  const DataT* y = &*b.m_data;
+  if (x->size() < y->size())
+    std::swap(x, y);
+  const size_t n = x->size() + y->size();
+  if (y->size() < s_KARATSUBA_THRESHOLD) {
+    DataT& r = m_data.mut();
+    if (r.size() < n)
+      r.resize(n);
+    const DigitT carry = addmul_basecase(x->data(), x->size(),
+        y->data(), y->size(), r.data(), r.size());
+    if (carry)
+      r.push_back(carry);
+  } else {
+    DataT t(n);
+    mul_karatsuba(x->data(), x->size(), y->data(), y->size(), t.data());
+    add_magnitude(t);
+  }
+  m_negative = negative;
+  resize();
+  return *this;
+}
+
+BigInt BigInt::isqrt() const
+{
+  if (m_negative)
+    throw std::domain_error(
+        "Square root of negative number '" + std::string{*this} + "'");
+  return iroot_magnitude(*this, 2);
+}
+
+BigInt BigInt::iroot(const BigInt& n) const
+{
+  if (n < 1)
+    throw std::domain_error(
+        "Root of degree '" + std::string{n} + "' undefined");
+  const bool even = (n.data().front() % 2 == 0);
+  if (m_negative && even)
+    throw std::domain_error(
+        "Even root of negative number '" + std::string{*this} + "'");
+  BigInt x = *this;
+  x.m_negative = false;
+  // Roots of degree past the bit length of x are all 1
+  BigInt r = (n >= x.size() * 30 ?
+      BigInt(x.is_zero() ? 0 : 1) :
+      iroot_magnitude(x, (unsigned long)(n)));
+  r.negative(m_negative);
+  return r;
+}
+
+bool BigInt::isPrime() const
+{
+  if (m_negative || (size() == 1 && data()[0] < 2))
     return false;
+  // Trial division, several small primes per pass over the limbs
+  const auto& primes = small_primes();
+  const uint64_t last = primes.back();
+  for (size_t i = 0; i < primes.size();) {
+    uint64_t product = 1;
+    size_t j = i;
+    while (j < primes.size() && product * primes[j] <= UINT32_MAX)
+      product *= primes[j++];
+    const uint64_t r = mod_small(data(), product);
+    for (; i < j; ++i) {
+      if (r % primes[i] == 0)
+        return (size() == 1 && data()[0] == primes[i]);
+    }
   }
-  if (lhs.size() < rhs.size()) {
+  if (size() <= 2 && uint64_t(*this) < last * last)
     return true;
-  }
-  if (lhs.size() > rhs.size()) {
+  // Baillie-PSW
+  // https://en.wikipedia.org/wiki/Baillie%E2%80%93PSW_primality_test
+  const Montgomery mont{to_words(data())};
+  if (!mont.strongProbablePrime(2))
     return false;
+  // Lucas parameters by Selfridge's method: first D in 5, -7, 9, -11, ...
+  // with Jacobi symbol (D/n) = -1. None exists for perfect squares.
+  const BigInt root = isqrt();
+  if (root * root == *this)
+    return false;
+  long D = 5;
+  while (jacobi(D, data()) != -1)
+    D = (D > 0 ? -(D + 2) : -D + 2);
+  return mont.strongLucasProbablePrime(D, (1 - D) / 4);
+}
+
+BigInt BigInt::nextPrime() const
+{
+  if (*this < 2)
+    return 2;
+  BigInt candidate = *this + 1;
+  if (candidate.data().front() % 2 == 0)
+    ++candidate;
+  const auto& primes = small_primes();
+  const uint64_t last = primes.back();
+  if (candidate.data().size() <= 2 && uint64_t(candidate) <= last * last) {
+    while (!candidate.isPrime())
+      candidate += 2;
+    return candidate;
+  }
+  // Sieve windows of odd candidates with the small primes and only run the
+  // full test on the survivors. Candidates exceed every sieving prime here.
+  const size_t WINDOW = 4096;
+  std::vector<bool> composite(WINDOW);
+  while (true) {
+    mesa::cancellation_point();
+    std::fill(composite.begin(), composite.end(), false);
+    for (size_t i = 1; i < primes.size(); ++i) {
+      const uint64_t p = primes[i];
+      // Offset of the first multiple of p: candidate + 2 * k == 0 (mod p)
+      const uint64_t r = mod_small(candidate.data(), p);
+      uint64_t k = (r == 0 ? 0 : (p - r) * ((p + 1) / 2) % p);
+      for (; k < WINDOW; k += p)
+        composite[k] = true;
+    }
+    for (size_t k = 0; k < WINDOW; ++k) {
+      if (!composite[k]) {
+        BigInt n = candidate + 2 * k;
+        if (n.isPrime())
+          return n;
+      }
+    }
+    candidate += 2 * WINDOW;
+  }
+}
+
+BigInt BigInt::choose(const BigInt& k) const
+{
+  if (m_negative)
+    throw std::domain_error(
+        "Binomial coefficient of negative number '" + std::string{*this} +
+        "'");
+  if (k.m_negative || k > *this)
+    return 0;
+  // C(n, k) = C(n, n - k)
+  const BigInt rest = *this - k;
+  const BigInt& m = (rest < k ? rest : k);
+  // Then n >= 2^33 as well, for billions of digits
+  if (m >= UINT32_MAX) {
+    throw std::out_of_range(
+        "Binomial coefficient of '" + std::string{*this} + "' and '" +
+        std::string{k} + "' out of range");
+  }
+  const uint64_t j = static_cast<unsigned long>(m);
+  if (size() > 2) {
+    // n (n - 1) ... (n - j + 1) / j!, for huge n (so small j)
+    std::vector<BigInt> terms;
+    terms.reserve(j);
+    BigInt term = *this;
+    Leaves denominator;
+    for (uint64_t i = 1; i <= j; ++i) {
+      mesa::cancellation_point();
+      terms.push_back(term);
+      --term;
+      denominator.push(i);
+    }
+    return product(terms, 0, terms.size()) / denominator.product();
+  }
+  const uint64_t n = static_cast<unsigned long>(*this);
+  Leaves factors;
+  if (n >= UINT32_MAX || j < n / s_CHOOSE_SIEVE_RATIO) {
+    // n (n - 1) ... (n - j + 1) / j!, with the exponent of each prime p in
+    // j! (Legendre: the sum of j / p^i) divided out of the terms, of which
+    // n - i is a multiple of p for i = n mod p (mod p)
+    std::vector<uint64_t> terms(j);
+    for (uint64_t i = 0; i < j; ++i)
+      terms[i] = n - i;
+    for_each_prime(j, [&](uint64_t p)
+      {
+        uint64_t e = 0;
+        for (uint64_t q = p; q <= j; q *= p) {
+          e += j / q;
+          if (q > j / p)
+            break;
+        }
+        for (uint64_t i = n % p; e > 0; i += p) {
+          assert(i < j);
+          while (e > 0 && terms[i] % p == 0) {
+            terms[i] /= p;
+            --e;
+          }
+        }
+      });
+    for (auto term: terms)
+      factors.push(term);
+    return factors.product();
+  }
+  // The exponent of p is the number of carries adding j and n - j in base p
+  // (Kummer), so p^e <= n
+  for_each_prime(n, [&](uint64_t p)
+    {
+      uint64_t power = 1;
+      for (uint64_t q = p; q <= n; q *= p) {
+        if (n / q > j / q + (n - j) / q)
+          power *= p;
+        if (q > n / p)
+          break;
+      }
+      if (power > 1)
+        factors.push(power);
+    });
+  return factors.product();
+}
+
+BigInt BigInt::fibonacci() const
+{
+  if (size() > 2)
+    throw std::out_of_range(
+        "Fibonacci index '" + std::string{*this} + "' out of range");
+  const uint64_t n = data()[0] +
+    (size() > 1 ? uint64_t{data()[1]} * s_BASE : 0);
+  if (n == 0)
+    return 0;
+  // (f, g) = (F(j), F(j - 1)), with j the bits of n above bit i, stepped
+  // one at a time while F(j) fits in 64 bits (up to F(93))
+  int i = 0;
+  while ((n >> i) > 93)
+    ++i;
+  uint64_t f0 = 1, g0 = 0;
+  for (uint64_t j = 1; j < (n >> i); ++j) {
+    f0 += g0;
+    g0 = f0 - g0;
+  }
+  BigInt f = f0, g = g0;
+  for (--i; i > 0; --i) {
+    const bool odd = ((n >> (i + 1)) & 1);
+    const BigInt f2 = f.square(), g2 = g.square();
+    BigInt next = f2 * 4 - g2; // F(2j + 1)
+    next += (odd ? -2 : 2);
+    BigInt prev = f2 + g2;     // F(2j - 1)
+    BigInt even = next - prev; // F(2j)
+    if ((n >> i) & 1) {
+      f = std::move(next);
+      g = std::move(even);
+    } else {
+      f = std::move(even);
+      g = std::move(prev);
+    }
+  }
+  // Last bit: F(2j + 1) = (2F(j) + F(j - 1))(2F(j) - F(j - 1)) + 2(-1)^j,
+  // F(2j) = F(j)(F(j) + 2F(j - 1)), one product instead of two squares
+  if (i == 0) {
+    const bool odd = ((n >> 1) & 1);
+    if (n & 1) {
+      const BigInt twice = f * 2;
+      f = (twice + g) * (twice - g);
+      f += (odd ? -2 : 2);
+    } else {
+      f *= f + g * 2;
+    }
+  }
+  // F(-n) = (-1)^(n + 1) F(n)
+  if (m_negative && n % 2 == 0)
+    f.negative(true);
+  return f;
+}
+
+// -----------------------------------------------------------------------------
+// Extended GCD
+// -----------------------------------------------------------------------------
+
+struct BigInt::Cofactors
+{
+  BigInt u, v;
+  bool negative;
+};
+
+struct BigInt::Matrix
+{
+  BigInt m00 = 1, m01 = 0, m10 = 0, m11 = 1;
+
+  //! this <- t this
+  void prepend(const Matrix& t)
+  {
+    BigInt r00 = t.m00 * m00, r01 = t.m00 * m01;
+    BigInt r10 = t.m10 * m00, r11 = t.m10 * m01;
+    r00.addmul(t.m01, m10);
+    r01.addmul(t.m01, m11);
+    r10.addmul(t.m11, m10);
+    r11.addmul(t.m11, m11);
+    m00 = std::move(r00);
+    m01 = std::move(r01);
+    m10 = std::move(r10);
+    m11 = std::move(r11);
+  }
+};
+
+void BigInt::combine(DataT& ra, DataT& rb, const DataT& a, const DataT& b,
+    const int64_t (&s)[4])
+{
+  // |x a_i + y b_i + carry| < 2^62 < 2^33 s_BASE, so biasing by 2^33 s_BASE
+  // makes it unsigned (and the carry floored) for a division by a constant.
+  // The rows are independent carry chains, interleaved.
+  const uint64_t bias = uint64_t{1} << 33;
+  const size_t na = a.size(), nb = b.size(), n = std::max(na, nb);
+  ra.resize(n + 2);
+  rb.resize(n + 2);
+  int64_t ca = 0, cb = 0;
+  auto put = [](DigitT& r, int64_t& carry, int64_t t)
+  {
+    const uint64_t u = uint64_t(t + carry) + bias * s_BASE;
+    const uint64_t q = u / s_BASE;
+    r = DigitT(u - q * s_BASE);
+    carry = int64_t(q - bias);
+  };
+  auto step = [&](size_t i, int64_t x, int64_t y)
+  {
+    put(ra[i], ca, s[0] * x + s[1] * y);
+    put(rb[i], cb, s[2] * x + s[3] * y);
+  };
+  size_t i = 0;
+  for (; i < std::min(na, nb); ++i)
+    step(i, a[i], b[i]);
+  for (; i < na; ++i)
+    step(i, a[i], 0);
+  for (; i < nb; ++i)
+    step(i, 0, b[i]);
+  assert(ca >= 0 && cb >= 0);
+  ra[n] = DigitT(ca % s_BASE);
+  ra[n + 1] = DigitT(ca / s_BASE);
+  rb[n] = DigitT(cb % s_BASE);
+  rb[n + 1] = DigitT(cb / s_BASE);
+  for (DataT* r: {&ra, &rb}) {
+    while (r->size() > 1 && r->back() == 0)
+      r->pop_back();
+  }
+}
+
+void BigInt::lehmer(BigInt& a, BigInt& b, size_t m, Cofactors* first,
+    Cofactors* second)
+{
+  const int64_t LIMIT = int64_t{1} << 31;
+  Cofactors* const cofactors[] = {first, second};
+  DataT ra, rb;
+  while (b.size() > m && !b.is_zero()) {
+    mesa::cancellation_point();
+    const DataT& x = *a.m_data;
+    const DataT& y = *b.m_data;
+    const size_t n = x.size();
+    // Leading limbs of a, three if they fit in 63 bits (else two), and the
+    // limbs of b in the same places
+    auto limb = [n](const DataT& v, size_t k) -> uint64_t
+    { return (k < n && n - 1 - k < v.size() ? v[n - 1 - k] : 0); };
+    const size_t k = (x.back() < 9 ? 3 : 2);
+    uint64_t ah = 0, bh = 0;
+    for (size_t i = 0; i < k; ++i) {
+      ah = ah * s_BASE + limb(x, i);
+      bh = bh * s_BASE + limb(y, i);
+    }
+    // Knuth, TAOCP Vol. 2, 4.5.2, Algorithm L: the quotient of the leading
+    // limbs is that of the whole values while both bounds on it agree.
+    // (a, b) <- (A a + B b, C a + D b), with A, B (and C, D) of opposite
+    // signs.
+    int64_t A = 1, B = 0, C = 0, D = 1;
+    bool odd = false;
+    while (bh != 0) {
+      const int64_t u = int64_t(ah), v = int64_t(bh);
+      if (v + C <= 0 || v + D <= 0 || u + A < 0 || u + B < 0)
+        break;
+      const int64_t q = (u + A) / (v + C);
+      if (q != (u + B) / (v + D) || q > LIMIT || uint64_t(q) > ah / bh)
+        break;
+      const int64_t c = A - q * C, d = B - q * D;
+      if (c > LIMIT || -c > LIMIT || d > LIMIT || -d > LIMIT)
+        break;
+      A = C;
+      B = D;
+      C = c;
+      D = d;
+      const uint64_t t = ah - uint64_t(q) * bh;
+      ah = bh;
+      bh = t;
+      odd = !odd;
+    }
+    if (B == 0) {
+      // No quotient is certain: one step of long division
+      DataT q, r;
+      divmod(x, y, &q, &r);
+      BigInt quotient;
+      quotient.m_data = std::move(q);
+      quotient.resize();
+      a = std::move(b);
+      b.m_data = std::move(r);
+      b.m_negative = false;
+      b.resize();
+      for (Cofactors* c: cofactors) {
+        if (c) {
+          BigInt w = c->u;
+          w.addmul(quotient, c->v);
+          c->u = std::move(c->v);
+          c->v = std::move(w);
+          c->negative = !c->negative;
+        }
+      }
+      continue;
+    }
+    const int64_t steps[4] = {A, B, C, D};
+    combine(ra, rb, x, y, steps);
+    std::swap(a.m_data.mut(), ra);
+    std::swap(b.m_data.mut(), rb);
+    a.resize();
+    b.resize();
+    // Cofactors alternate in sign too, so their magnitudes only add
+    const int64_t magnitudes[4] =
+      {std::abs(A), std::abs(B), std::abs(C), std::abs(D)};
+    for (Cofactors* c: cofactors) {
+      if (c) {
+        combine(ra, rb, *c->u.m_data, *c->v.m_data, magnitudes);
+        std::swap(c->u.m_data.mut(), ra);
+        std::swap(c->v.m_data.mut(), rb);
+        c->u.resize();
+        c->v.resize();
+        c->negative ^= odd;
+      }
+    }
   }
-  auto lhsIt = lhs.data().rbegin();
-  auto rhsIt = rhs.data().rbegin();
-  for (; lhsIt != lhs.data().rend(); ++lhsIt, ++rhsIt) {
-    if (*lhsIt < *rhsIt)
-      return true;
-    else if (*lhsIt > *rhsIt)
-      return false;
+}
+
+void BigInt::euclid_step(BigInt& a, BigInt& b, Matrix& s)
+{
+  DataT q, r;
+  divmod(*a.m_data, *b.m_data, &q, &r);
+  BigInt quotient;
+  quotient.m_data = std::move(q);
+  quotient.resize();
+  a = std::move(b);
+  b.m_data = std::move(r);
+  b.m_negative = false;
+  b.resize();
+  // Rows (r0, r1) <- (r1, r0 - q r1)
+  BigInt r10 = s.m00 - quotient * s.m10;
+  BigInt r11 = s.m01 - quotient * s.m11;
+  s.m00 = std::move(s.m10);
+  s.m01 = std::move(s.m11);
+  s.m10 = std::move(r10);
+  s.m11 = std::move(r11);
+}
+
+void BigInt::apply(Matrix& t, BigInt& a, BigInt& b, Matrix& s)
+{
+  BigInt x = t.m00 * a, y = t.m10 * a;
+  x.addmul(t.m01, b);
+  y.addmul(t.m11, b);
+  auto flip = [](BigInt& n) { n.negative(!n.negative()); };
+  if (x.m_negative) {
+    flip(x);
+    flip(t.m00);
+    flip(t.m01);
+  }
+  if (y.m_negative) {
+    flip(y);
+    flip(t.m10);
+    flip(t.m11);
+  }
+  if (compare_magnitude(*x.m_data, *y.m_data) < 0) {
+    std::swap(x, y);
+    std::swap(t.m00, t.m10);
+    std::swap(t.m01, t.m11);
+  }
+  a = std::move(x);
+  b = std::move(y);
+  s.prepend(t);
+}
+
+void BigInt::hgcd(BigInt& a, BigInt& b, size_t m, Matrix& s)
+{
+  s = Matrix{};
+  if (b.size() <= m)
+    return;
+  const size_t n = a.size();
+  if (n < s_HGCD_THRESHOLD) {
+    // (m00, m10) and (m01, m11) are the cofactors of a and b
+    Cofactors first{1, 0, false}, second{0, 1, true};
+    lehmer(a, b, m, &first, &second);
+    s.m00 = std::move(first.u);
+    s.m10 = std::move(first.v);
+    s.m01 = std::move(second.u);
+    s.m11 = std::move(second.v);
+    s.m00.negative(first.negative);
+    s.m10.negative(!first.negative);
+    s.m01.negative(second.negative);
+    s.m11.negative(!second.negative);
+    return;
+  }
+  // Steps that halve the leading limbs (from limb k up) mostly hold for the
+  // whole values, where they remove as many limbs
+  auto reduce = [&](size_t k)
+  {
+    BigInt x = a, y = b;
+    x.shift_limbs(-long(k));
+    y.shift_limbs(-long(k));
+    Matrix t;
+    hgcd(x, y, x.size() / 2, t);
+    apply(t, a, b, s);
+  };
+  // The leading n - m limbs take a and b to about 3n/4 limbs, and then the
+  // leading 2 (l - m) of the l left to about m
+  reduce(m);
+  if (b.size() <= m)
+    return;
+  euclid_step(a, b, s);
+  const size_t l = a.size();
+  if (b.size() > m && l <= 2 * m && 2 * (l - m) < n)
+    reduce(2 * m - l);
+  while (b.size() > m)
+    euclid_step(a, b, s);
+}
+
+BigInt BigInt::xgcd(const BigInt& other, BigInt* x, BigInt* y) const
+{
+  BigInt a = *this, b = other;
+  a.m_negative = b.m_negative = false;
+  const bool swapped = (compare_magnitude(*a.m_data, *b.m_data) < 0);
+  if (swapped)
+    std::swap(a, b);
+  BigInt* const xa = (swapped ? y : x);
+  BigInt* const xb = (swapped ? x : y);
+  // Columns of s, with (a, b) = s (|this|, |other|) in the order after the
+  // swap, tracked only when wanted
+  BigInt sa[2] = {1, 0}, sb[2] = {0, 1};
+  auto update = [&](const Matrix& t)
+  {
+    for (BigInt* c: {(xa ? sa : nullptr), (xb ? sb : nullptr)}) {
+      if (c) {
+        BigInt c0 = t.m00 * c[0], c1 = t.m10 * c[0];
+        c0.addmul(t.m01, c[1]);
+        c1.addmul(t.m11, c[1]);
+        c[0] = std::move(c0);
+        c[1] = std::move(c1);
+      }
+    }
+  };
+  const bool halves = (b.size() >= s_HGCD_THRESHOLD);
+  while (b.size() >= s_HGCD_THRESHOLD) {
+    Matrix t;
+    hgcd(a, b, a.size() / 2, t);
+    update(t);
+    // a may still be as long, and b is at most half as long
+    if (!b.is_zero()) {
+      euclid_step(a, b, t = Matrix{});
+      update(t);
+    }
   }
-  return false;
+  // Cofactors of the a and b left, then of the inputs through s
+  const bool both = (halves && (xa || xb));
+  Cofactors first{1, 0, false}, second{0, 1, true};
+  lehmer(a, b, 0, (xa || both ? &first : nullptr),
+      (xb || both ? &second : nullptr));
+  BigInt ua = std::move(first.u), ub = std::move(second.u);
+  ua.negative(first.negative);
+  ub.negative(second.negative);
+  if (a.is_zero())
+    ua = ub = 0;
+  if (xa) {
+    *xa = (halves ? ua * sa[0] : ua);
+    if (halves)
+      xa->addmul(ub, sa[1]);
+    xa->negative(xa->negative() != (swapped ? other : *this).m_negative);
+  }
+  if (xb) {
+    *xb = (halves ? ua * sb[0] : ub);
+    if (halves)
+      xb->addmul(ub, sb[1]);
+    xb->negative(xb->negative() != (swapped ? *this : other).m_negative);
+  }
+  return a;
 }
 
+BigInt BigInt::invmod(const BigInt& m) const
+{
+  if (m < 1)
+    throw std::domain_error(
+        "Inverse modulo '" + std::string{m} + "' undefined");
+  BigInt r = *this % m;
+  if (r.m_negative)
+    r += m;
+  BigInt x;
+  if (r.xgcd(m, &x) != 1)
+    throw std::domain_error("'" + std::string{*this} +
+        "' has no inverse modulo '" + std::string{m} + "'");
+  // Within (-m, m) unless half-GCD overshot
+  x %= m;
+  if (x.m_negative)
+    x += m;
+  return x;
+}
+
+// -----------------------------------------------------------------------------
+// Binary format
+//
+// Limbs are stored as they are in memory (little-endian uint32), so writing
+// and reading are copies; only big-endian machines swap bytes limb by limb.
+// -----------------------------------------------------------------------------
+
+namespace
+{
+  constexpr char   s_MAGIC[4]     = {'M', 'B', 'I', 'G'};
+  constexpr size_t s_HEADER_BYTES = 16;
+  constexpr uint8_t s_NEGATIVE    = 1;
+  constexpr uint8_t s_CHECKSUM    = 2;
+
+  constexpr bool s_LITTLE_ENDIAN =
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+  void put_le64(char* out, uint64_t x)
+  {
+    for (size_t i = 0; i < 8; ++i)
+      out[i] = char(x >> (8 * i));
+  }
+
+  uint64_t get_le64(const char* in)
+  {
+    uint64_t x = 0;
+    for (size_t i = 8; i-- > 0;)
+      x = (x << 8) | uint8_t(in[i]);
+    return x;
+  }
+
+  //! Copy n uint32 limbs to little-endian bytes
+  void limbs_to_le(char* out, const uint32_t* limbs, size_t n)
+  {
+    if (s_LITTLE_ENDIAN) {
+      std::memcpy(out, limbs, n * sizeof(uint32_t));
+      return;
+    }
+    for (size_t i = 0; i < n; ++i)
+      for (size_t j = 0; j < 4; ++j)
+        out[4 * i + j] = char(limbs[i] >> (8 * j));
+  }
+
+  //! Copy little-endian bytes to n uint32 limbs
+  void le_to_limbs(uint32_t* limbs, const char* in, size_t n)
+  {
+    if (s_LITTLE_ENDIAN) {
+      std::memcpy(limbs, in, n * sizeof(uint32_t));
+      return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      limbs[i] = 0;
+      for (size_t j = 4; j-- > 0;)
+        limbs[i] = (limbs[i] << 8) | uint8_t(in[4 * i + j]);
+    }
+  }
+}
+
+uint64_t BigInt::checksum(const DigitT* limbs, size_t n)
+{
+  // Same mixing as hash(), but fixed by the format rather than cached
+  uint64_t h = 0;
+  size_t i = 0;
+  for (; i + 1 < n; i += 2)
+    h = (h ^ (uint64_t(limbs[i + 1]) << 32 | limbs[i])) *
+      0x9e3779b97f4a7c15ull;
+  if (i < n)
+    h = (h ^ limbs[i]) * 0x9e3779b97f4a7c15ull;
+  return mesa::hash_mix(h ^ n);
+}
+
+std::string BigInt::header(bool checksum) const
+{
+  std::string h(s_HEADER_BYTES, '\0');
+  std::memcpy(&h[0], s_MAGIC, sizeof(s_MAGIC));
+  h[4] = char(s_FORMAT_VERSION);
+  h[5] = char((m_negative ? s_NEGATIVE : 0) | (checksum ? s_CHECKSUM : 0));
+  put_le64(&h[8], size());
+  return h;
+}
+
+void BigInt::serialize(std::ostream& os, bool checksum) const
+{
+  os << header(checksum);
+  if (s_LITTLE_ENDIAN) {
+    os.write(reinterpret_cast<const char*>(data().data()),
+        std::streamsize(bytes()));
+  } else {
+    std::string limbs(bytes(), '\0');
+    limbs_to_le(&limbs[0], data().data(), size());
+    os << limbs;
+  }
+  if (checksum) {
+    char sum[8];
+    put_le64(sum, BigInt::checksum(data().data(), size()));
+    os.write(sum, sizeof(sum));
+  }
+}
+
+std::string BigInt::serialize(bool checksum) const
+{
+  std::string s = header(checksum);
+  s.resize(s_HEADER_BYTES + bytes() + (checksum ? 8 : 0));
+  limbs_to_le(&s[s_HEADER_BYTES], data().data(), size());
+  if (checksum) {
+    put_le64(&s[s_HEADER_BYTES + bytes()],
+        BigInt::checksum(data().data(), size()));
+  }
+  return s;
+}
+
+BigInt BigInt::deserialize(const char* data, size_t size)
+{
+  auto malformed = [](const std::string& why)
+  { return std::invalid_argument("Malformed binary BigInt: " + why); };
+  if (size < s_HEADER_BYTES ||
+      std::memcmp(data, s_MAGIC, sizeof(s_MAGIC)) != 0)
+    throw malformed("bad header");
+  if (uint8_t(data[4]) != s_FORMAT_VERSION) {
+    throw std::invalid_argument("Unsupported binary BigInt format version " +
+        std::to_string(uint8_t(data[4])));
+  }
+  const uint8_t flags = uint8_t(data[5]);
+  if ((flags & ~(s_NEGATIVE | s_CHECKSUM)) != 0 || data[6] != 0 ||
+      data[7] != 0)
+    throw malformed("unknown flags");
+  const bool checksum = (flags & s_CHECKSUM);
+  const uint64_t n = get_le64(data + 8);
+  if (size < s_HEADER_BYTES + (checksum ? 8 : 0))
+    throw malformed("truncated");
+  const size_t body = size - s_HEADER_BYTES - (checksum ? 8 : 0);
+  if (n == 0 || n != body / sizeof(DigitT) || body % sizeof(DigitT) != 0)
+    throw malformed("size does not match limb count");
+
+  DataT limbs(n);
+  le_to_limbs(limbs.data(), data + s_HEADER_BYTES, n);
+  for (auto limb: limbs)
+    if (limb >= s_BASE)
+      throw malformed("limb out of range");
+  if (n > 1 && limbs.back() == 0)
+    throw malformed("leading zero limb");
+  if (checksum && get_le64(data + s_HEADER_BYTES + body) !=
+      BigInt::checksum(limbs.data(), n))
+    throw malformed("checksum mismatch");
+
+  BigInt result;
+  result.m_data = std::move(limbs);
+  result.m_negative = (flags & s_NEGATIVE) && !result.is_zero();
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+// External definitions
+// -----------------------------------------------------------------------------
+
 std::ostream& operator<<(std::ostream& os, const BigInt& rhs)
 {
   return (os << std::string{rhs});
@@ -18,24 +18,111 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <memory>
 #include <cstdint>
 #include <cassert>
+#include <type_traits>
+
+#include "Allocator.h"
 
 // -----------------------------------------------------------------------------
 
 namespace mesa {
 
+  //! Copy-on-write limb buffer
+  // Copies share one reference-counted vector, so copying a BigInt (to the
+  // stack, 'ans', a cache) is a pointer bump. A shared vector is copied by
+  // the first write through mut(). No vector at all (default constructed or
+  // moved from) reads as zero, which allocates nothing.
+  class Limbs
+  {
+    public:
+      using DataT = std::vector<uint32_t, CountingAllocator<uint32_t>>;
+
+      //! Default constructor (zero)
+      Limbs() noexcept = default;
+
+      //! Constructor (takes the vector)
+      Limbs(DataT data):
+        m_ptr{make(std::move(data))}
+      {}
+
+      //! Replace the vector (reusing it if not shared)
+      Limbs& operator=(DataT data)
+      {
+        if (m_ptr && m_ptr.use_count() == 1)
+          *m_ptr = std::move(data);
+        else
+          m_ptr = make(std::move(data));
+        return *this;
+      }
+
+      //! Read access
+      const DataT& operator*() const
+      { return (m_ptr ? *m_ptr : zero()); }
+
+      //! Read access
+      const DataT* operator->() const
+      { return &**this; }
+
+      //! Write access, copying the vector first if it is shared
+      DataT& mut()
+      {
+        if (!m_ptr)
+          m_ptr = make(DataT{0});
+        else if (m_ptr.use_count() != 1)
+          m_ptr = make(DataT(*m_ptr));
+        return *m_ptr;
+      }
+
+      //! Get if the vector is shared with other copies
+      bool shared() const
+      { return m_ptr && m_ptr.use_count() != 1; }
+
+      void swap(Limbs& other) noexcept
+      { m_ptr.swap(other.m_ptr); }
+
+    private:
+      static std::shared_ptr<DataT> make(DataT data)
+      {
+        return std::allocate_shared<DataT>(CountingAllocator<DataT>{},
+            std::move(data));
+      }
+
+      static const DataT& zero()
+      {
+        static const DataT z{0};
+        return z;
+      }
+
+      std::shared_ptr<DataT> m_ptr;
+  };
+
   //! BigInt class
   class BigInt
   {
     public:
       // Type aliases
       using DigitT = uint32_t;
-      using DataT  = std::vector<DigitT>;
+      using DataT  = Limbs::DataT;
+
+      // Each limb (DigitT) holds s_BASE_DIGITS decimal digits
+      static constexpr DigitT s_BASE        = 1000000000;
+      static constexpr size_t s_BASE_DIGITS = 9;
+
+      //! Default constructor (zero)
+      BigInt() noexcept = default;
 
       //! Constructor (integer)
-      // @param n Integer
-      BigInt(unsigned long long n = 0) noexcept;
+      // @param n Integer of any built-in integral type
+      template<class IntT, typename std::enable_if<
+        std::is_integral<IntT>::value, int>::type = 0>
+      BigInt(IntT n) noexcept
+      {
+        assign(n < IntT(0) ?
+            0ull - static_cast<unsigned long long>(n) :
+            static_cast<unsigned long long>(n), n < IntT(0));
+      }
 
       //! Copy constructor
       BigInt(const BigInt&) = default;
@@ -44,7 +131,10 @@ namespace mesa {
       BigInt(BigInt&&) = default;
 
       //! Constructor (string)
-      // @param s String whose every character is a decimal integer digit
+      // @param s String of decimal integer digits with an optional leading
+      // '-', or of hexadecimal digits after '0x' or binary digits after '0b'
+      // (e.g. '-0xff'). Those convert by divide and conquer on Karatsuba
+      // products, so a huge literal costs a few multiplications of its size.
       // @throws Invalid argument exception
       // TODO:
       // I know I'm not supposed to throw exceptions from constructors but I
@@ -53,18 +143,54 @@ namespace mesa {
 
       //! Get underlying container
       const DataT& data() const
-      { return m_data; }
+      { return *m_data; }
 
       //! Get if underlying container is empty
       bool empty() const
-      { return m_data.empty(); }
+      { return m_data->empty(); }
 
       //! Get size of underlying container
       size_t size() const
-      { return m_data.size(); }
+      { return m_data->size(); }
+
+      //! Get if negative (zero is never negative)
+      bool negative() const
+      { return m_negative; }
+
+      //! Set sign (ignored for zero)
+      void negative(bool negative)
+      {
+        m_negative = negative && !is_zero();
+        m_hash = 0;
+      }
+
+      //! Get size of the limbs in bytes
+      size_t bytes() const
+      { return m_data->size() * sizeof(DigitT); }
+
+      //! Get number of decimal digits of the magnitude
+      size_t digits() const;
+
+      //! Largest number of decimal digits of any value (unbounded)
+      static constexpr size_t maxDigits()
+      { return SIZE_MAX; }
+
+      //! Estimated size in bytes of a value with a number of decimal digits
+      static size_t bytesFor(size_t digits)
+      { return (digits / s_BASE_DIGITS + 1) * sizeof(DigitT); }
+
+      //! Hash of the value
+      // One pass over the limbs, two at a time; the result is cached until
+      // the value is next modified, so repeated lookups cost nothing.
+      size_t hash() const;
+
+      //! Three-way comparison
+      // @return Negative, zero or positive if less than, equal to or greater
+      // than other
+      int compare(const BigInt& other) const;
 
       //! Long conversion operator
-      // @throw std::out_of_range
+      // @throw std::out_of_range Including when negative
       explicit operator unsigned long() const;
 
       //! Double conversion operator
@@ -75,6 +201,38 @@ namespace mesa {
       //! String conversion operator
       explicit operator std::string() const;
 
+      //! Get as a string in radix 10, 16 ('0x' prefix) or 2 ('0b' prefix)
+      // Other radixes divide by powers of two as multiplications by powers
+      // of five (x / 2^m = x * 5^m / 10^m), split in halves, so conversion
+      // is subquadratic like the conversion of literals.
+      // @throws std::invalid_argument Other radixes
+      std::string toString(unsigned radix) const;
+
+      //! Version of the binary format written by serialize()
+      static constexpr uint8_t s_FORMAT_VERSION = 1;
+
+      //! Write in the binary format
+      // A 16-byte header (magic "MBIG", version, flags: 1 negative and
+      // 2 checksum, two zero bytes, uint64 limb count), the uint32 base 10^9
+      // limbs, and with checksum a uint64 over the limbs; all little-endian.
+      // On little-endian machines the limbs are written straight from
+      // memory, so this costs a copy instead of a radix conversion.
+      void serialize(std::ostream& os, bool checksum = false) const;
+
+      //! Get in the binary format
+      std::string serialize(bool checksum = false) const;
+
+      //! Read the binary format (one copy of the limbs)
+      // @throws std::invalid_argument Malformed, unsupported version, or
+      // checksum mismatch
+      static BigInt deserialize(const char* data, size_t size);
+
+      //! Read the binary format
+      // @throws std::invalid_argument Malformed, unsupported version, or
+      // checksum mismatch
+      static BigInt deserialize(const std::string& s)
+      { return deserialize(s.data(), s.size()); }
+
       //! Copy assignment operator
       BigInt& operator=(const BigInt&) = default;
 
@@ -97,8 +255,6 @@ namespace mesa {
       }
 
       //! Subtraction assignment operator
-      // Uses method of complements
-      // https://en.wikipedia.org/wiki/Method_of_complements
       BigInt& operator-=(const BigInt& other);
 
       //! Prefix decrement operator
@@ -125,39 +281,285 @@ namespace mesa {
       //! Exponentiation assignment operator
       BigInt& operator^=(const BigInt& other);
 
+      //! Left shift assignment operator (multiplication by 2^bits)
+      // @throws std::domain_error If bits is negative
+      BigInt& operator<<=(const BigInt& bits);
+
+      //! Right shift assignment operator (division by 2^bits, floored)
+      // Negative values round toward minus infinity, as in two's complement.
+      // Shifts past a few dozen limbs multiply by 5^bits and drop bits
+      // decimal digits instead of dividing.
+      // @throws std::domain_error If bits is negative
+      BigInt& operator>>=(const BigInt& bits);
+
+      //! Square
+      // Each cross product a_i*a_j is computed once instead of twice, so this
+      // costs about half of a general multiplication at every size.
+      BigInt square() const;
+
+      //! Multiply-accumulate (this += a * b)
+      // Products with a short operand are accumulated row by row straight
+      // into the limbs of this, so no product is materialized; longer ones
+      // go through a Karatsuba scratch buffer that is added in place. A
+      // product of the opposite sign is subtracted instead.
+      BigInt& addmul(const BigInt& a, const BigInt& b);
+
+      //! Integer square root (floor)
+      // Newton's method seeded from the root of the high half of the limbs,
+      // so precision doubles at each level of recursion.
+      // @throws std::domain_error If negative
+      BigInt isqrt() const;
+
+      //! Integer nth root (truncated toward zero)
+      // @param n Degree of the root
+      // @throws std::domain_error If n < 1, or an even root of a negative
+      BigInt iroot(const BigInt& n) const;
+
+      //! Primality test
+      // Trial division by a sieved table of small primes, then Baillie-PSW
+      // (strong base-2 Miller-Rabin and strong Lucas test) on Montgomery
+      // arithmetic. No BPSW pseudoprime is known; below 2^64 the answer is
+      // exact.
+      bool isPrime() const;
+
+      //! Smallest prime greater than this
+      BigInt nextPrime() const;
+
+      //! Binomial coefficient C(this, k)
+      // The exponent of a prime p in C(n, k) is the number of carries when
+      // adding k and n - k in base p (Kummer), so the result is a product of
+      // sieved prime powers, multiplied as a balanced tree in O(M(size) log
+      // size). For small k the prime factors of k! (Legendre) are divided
+      // out of the falling factorial n (n - 1) ... (n - k + 1) instead.
+      // @return 0 if k < 0 or k > n
+      // @throws std::domain_error If negative
+      // @throws std::out_of_range If min(k, n - k) is 2^32 or more
+      BigInt choose(const BigInt& k) const;
+
+      //! Fibonacci number F(this), negative indexes included
+      // Fast doubling on squares: F(2j - 1) = F(j)^2 + F(j - 1)^2 and
+      // F(2j + 1) = 4F(j)^2 - F(j - 1)^2 + 2(-1)^j, so each bit of the index
+      // costs two squarings, O(M(size)) in all as the sizes double.
+      // @throws std::out_of_range If |this| is 10^18 or more
+      BigInt fibonacci() const;
+
+      //! Extended GCD: g = gcd(|this|, |other|) and x, y with
+      // this * x + other * y = g
+      // Lehmer's algorithm: Euclid runs on the leading 63 bits or so while
+      // its quotients are certain (Knuth's Algorithm L), then the steps are
+      // applied to the full values and cofactors in one pass. From
+      // s_HGCD_THRESHOLD limbs on, half-GCD first reduces the leading half
+      // of the values recursively, for O(M(size) log size) in all.
+      // @param x Coefficient of this (may be null)
+      // @param y Coefficient of other (may be null)
+      // @return g, 0 if both are 0
+      BigInt xgcd(const BigInt& other, BigInt* x = nullptr,
+          BigInt* y = nullptr) const;
+
+      //! Modular inverse: x in [0, m) with this * x = 1 (mod m)
+      // @throws std::domain_error If m < 1, or this and m share a factor
+      BigInt invmod(const BigInt& m) const;
+
+      //! Get minimum operand size (limbs) at which multiplication fans out
+      static size_t parallelThreshold()
+      { return s_parallelThreshold; }
+
+      //! Set minimum operand size (limbs) at which multiplication fans out
+      // Karatsuba sub-products of at least this many limbs are evaluated on
+      // the shared ThreadPool. Use SIZE_MAX to always multiply serially.
+      static void parallelThreshold(size_t limbs)
+      { s_parallelThreshold = limbs; }
+
     private:
-      DataT m_data; // Has a vector of digits
+      Limbs m_data; // Shares a vector of limbs (least significant first)
+      bool m_negative = false; // Sign of magnitude m_data
+      mutable size_t m_hash = 0; // Cached hash() (0 until computed)
+
+      static constexpr size_t s_KARATSUBA_THRESHOLD = 32;
 
-      //! Remove trailing zeroes
+      // Binomials C(n, k) with min(k, n - k) below n / this cancel k! out of
+      // the falling factorial rather than sieving the primes up to n
+      static constexpr uint64_t s_CHOOSE_SIEVE_RATIO = 16;
+
+      // Values of at least this many limbs go through half-GCD in xgcd()
+      static constexpr size_t s_HGCD_THRESHOLD = 1024;
+      static size_t s_parallelThreshold;
+
+      // Radix conversion: bits per limb-sized chunk of a literal, chunks per
+      // block combined by Horner's rule, and 32-bit words per block output
+      // by short division
+      static constexpr size_t s_CHUNK_BITS   = 28;
+      static constexpr size_t s_BLOCK_CHUNKS = 64;
+      static constexpr size_t s_BLOCK_WORDS  = 32;
+
+      //! Set from magnitude and sign
+      void assign(unsigned long long n, bool negative);
+
+      //! Get if zero
+      bool is_zero() const
+      { return m_data->size() == 1 && (*m_data)[0] == 0; }
+
+      //! Remove trailing zeroes (and the sign of zero)
+      // Every modifying operator ends here, so this also drops the cached hash.
       void resize();
 
       //! Add trailing zeroes (pad)
       void resize(const size_t& n);
 
-      //! Convert to nines complement
-      // Flops each digit to its nines complement
-      static void to_nines_comp(DataT& data);
+      //! r = a + b + carry over n limbs
+      // Dispatches to an AVX2 kernel when the CPU supports it.
+      // @return Carry out of the most significant limb
+      static DigitT add_n(
+          DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT carry);
+
+      //! r = a - b - borrow over n limbs
+      // Dispatches to an AVX2 kernel when the CPU supports it.
+      // @return Borrow out of the most significant limb
+      static DigitT sub_n(
+          DigitT* r, const DigitT* a, const DigitT* b, size_t n, DigitT borrow);
+
+      //! Compare magnitudes
+      static int compare_magnitude(const DataT& lhs, const DataT& rhs);
+
+      //! Add magnitude of other to own magnitude
+      void add_magnitude(const DataT& other);
 
-      //! Handle carry digits for a BigInt data container
-      static void carry(DataT& data);
+      //! Subtract magnitudes, leaving |this - other| in place
+      // @return true if other was the larger magnitude (sign must flip)
+      bool sub_magnitude(const DataT& other);
 
-      //! Add addition helper function
-      void add(const BigInt& other);
+      //! Addition helper function
+      // Signs are resolved here, so mixed-sign operands cost one magnitude
+      // add or subtract, same as unsigned ones.
+      void add(const BigInt& other, bool negate = false);
 
       //! Subtraction helper function
-      void subtract(const BigInt& other);
+      void subtract(const BigInt& other)
+      { add(other, true); }
 
       //! Multiplication helper function
       void multiply(const BigInt& other);
 
+      //! Add limbs of x into r, propagating the carry
+      // r must have room for the carry out of the most significant digit.
+      static void add_to(DigitT* r, size_t nr, const DigitT* x, size_t nx);
+
+      //! Subtract limbs of x from r, propagating the borrow (requires r >= x)
+      static void sub_from(DigitT* r, size_t nr, const DigitT* x, size_t nx);
+
+      //! Schoolbook multiplication into zeroed r[0, na + nb)
+      static void mul_basecase(
+          const DigitT* a, size_t na, const DigitT* b, size_t nb, DigitT* r);
+
+      //! Schoolbook multiply-accumulate into r[0, nr), propagating carries
+      // Requires nr >= na + nb.
+      // @return Carry out of the most significant limb
+      static DigitT addmul_basecase(const DigitT* a, size_t na,
+          const DigitT* b, size_t nb, DigitT* r, size_t nr);
+
+      //! Karatsuba multiplication into zeroed r[0, na + nb)
+      static void mul_karatsuba(
+          const DigitT* a, size_t na, const DigitT* b, size_t nb, DigitT* r);
+
+      //! Schoolbook squaring into zeroed r[0, 2n)
+      static void sqr_basecase(const DigitT* a, size_t n, DigitT* r);
+
+      //! Karatsuba squaring into zeroed r[0, 2n)
+      static void sqr_karatsuba(const DigitT* a, size_t n, DigitT* r);
+
+      //! Magnitude long division (Knuth, Algorithm D)
+      // @param q Quotient output (may be null)
+      // @param r Remainder output (may be null)
+      static void divmod(const DataT& u, const DataT& v, DataT* q, DataT* r);
+
       //! Division helper function
-      void divide(const BigInt& other);
+      // Truncates toward zero; the remainder takes the sign of the dividend.
+      // @param modulus Keep remainder instead of quotient
+      void divide(const BigInt& other, bool modulus);
 
       //! Exponentiation helper functions
       void exponentiate(const BigInt& other);
 
-      //! FFT implementation TODO
-      //BigInt& fft(const BigInt& other);
+      //! base^n for a base below s_BASE
+      // Squares left to right with a short multiplication by the base for
+      // each set bit of n, so no general product is needed; powers of ten
+      // are limb shifts.
+      static BigInt power_small(DigitT base, size_t n);
+
+      //! Get if a magnitude may be a power of two, by its bit length and
+      // its low limb
+      // @param bits Exponent, if so
+      static bool maybe_pow2(const DataT& x, size_t& bits);
+
+      //! Floor divide magnitude by 2^bits, given five = 5^bits
+      // x / 2^bits = x * 5^bits / 10^bits, a product and a digit shift.
+      // @return If exact
+      bool shift_right_magnitude(size_t bits, const BigInt& five);
+
+      //! Get shift count
+      // @throws std::domain_error If negative
+      static size_t shift_count(const BigInt& bits);
+
+      //! Multiply (limbs > 0) or floor divide (limbs < 0) magnitude by
+      // s_BASE^|limbs|
+      void shift_limbs(long limbs);
+
+      //! Set from the digits of a power-of-two radix
+      // @param first Index of the most significant digit in s
+      // @param bits Bits per digit (4 or 1)
+      void assign_radix(const std::string& s, size_t first, unsigned bits);
+
+      //! Write the 32-bit words of a non-negative value, least significant
+      // first, below 2^(32 * (s_BLOCK_WORDS << level))
+      // @param twos 2^(32 * s_BLOCK_WORDS * 2^i) for i below the level
+      // @param fives 5^(32 * s_BLOCK_WORDS * 2^i) for i below the level
+      // @param out s_BLOCK_WORDS << level zeroed words
+      static void radix_words(const BigInt& x, size_t level,
+          const std::vector<BigInt>& twos, const std::vector<BigInt>& fives,
+          uint32_t* out);
+
+      //! Floor of nth root of a non-negative magnitude
+      static BigInt iroot_magnitude(const BigInt& x, unsigned long n);
+
+      //! Cofactor magnitudes (u, v) of one input through Euclid's steps,
+      // standing for (u, -v), or (-u, v) if negative, as the signs alternate
+      struct Cofactors;
+
+      //! Unimodular 2x2 matrix of Euclid's steps
+      struct Matrix;
+
+      //! (ra, rb) = s (a, b), for non-negative results and entries of the
+      // 2x2 matrix s (row-major) at most 2^31 in magnitude
+      static void combine(DataT& ra, DataT& rb, const DataT& a,
+          const DataT& b, const int64_t (&s)[4]);
+
+      //! Lehmer's algorithm on magnitudes a >= b until b has at most m
+      // limbs (or is 0, for m = 0)
+      // @param first Cofactors to step along (may be null)
+      // @param second Cofactors to step along (may be null)
+      static void lehmer(BigInt& a, BigInt& b, size_t m, Cofactors* first,
+          Cofactors* second);
+
+      //! Half-GCD: (a, b) <- s (a, b) for magnitudes a >= b, until b has at
+      // most m limbs
+      // The leading limbs of a and b are reduced recursively, and the same
+      // steps applied to the whole; Euclid's steps patch up the rest.
+      // @param s Steps taken
+      static void hgcd(BigInt& a, BigInt& b, size_t m, Matrix& s);
+
+      //! One Euclid step (a, b) <- (b, a mod b), also applied to s
+      static void euclid_step(BigInt& a, BigInt& b, Matrix& s);
+
+      //! (a, b) <- t (a, b), also applied to s (s <- t s)
+      // Signs and order are restored, by negating or swapping rows of t, if
+      // the steps overshot.
+      static void apply(Matrix& t, BigInt& a, BigInt& b, Matrix& s);
+
+      //! Header of the binary format
+      std::string header(bool checksum) const;
+
+      //! Checksum of limbs in the binary format
+      static uint64_t checksum(const DigitT* limbs, size_t n);
   };
 }
 
@@ -171,7 +573,7 @@ inline bool operator!(
 //! Equality operator
 inline bool operator==(
     const mesa::BigInt& lhs, const mesa::BigInt& rhs)
-{ return lhs.data() == rhs.data(); }
+{ return lhs.negative() == rhs.negative() && lhs.data() == rhs.data(); }
 
 //! Inequality operator
 inline bool operator!=(
@@ -179,8 +581,9 @@ inline bool operator!=(
 { return !operator==(lhs, rhs); }
 
 //! Less-than operator
-bool operator<(
-    const mesa::BigInt& lhs, const mesa::BigInt& rhs);
+inline bool operator<(
+    const mesa::BigInt& lhs, const mesa::BigInt& rhs)
+{ return lhs.compare(rhs) < 0; }
 
 //! Greater-than operator
 inline bool operator>(
@@ -197,6 +600,14 @@ inline bool operator>=(
     const mesa::BigInt& lhs, const mesa::BigInt& rhs)
 { return !operator<(lhs, rhs); }
 
+//! BigInt unary negation
+inline mesa::BigInt operator-(
+    mesa::BigInt rhs)
+{
+  rhs.negative(!rhs.negative());
+  return rhs;
+}
+
 //! BigInt binary addition
 inline mesa::BigInt operator+(
     mesa::BigInt lhs, const mesa::BigInt& rhs)
@@ -227,6 +638,16 @@ inline mesa::BigInt operator^(
     mesa::BigInt lhs, const mesa::BigInt& rhs)
 { return lhs ^= rhs; }
 
+//! BigInt left shift
+inline mesa::BigInt operator<<(
+    mesa::BigInt lhs, const mesa::BigInt& rhs)
+{ return lhs <<= rhs; }
+
+//! BigInt right shift
+inline mesa::BigInt operator>>(
+    mesa::BigInt lhs, const mesa::BigInt& rhs)
+{ return lhs >>= rhs; }
+
 //! BigInt insertion operator
 std::ostream& operator<<(
     std::ostream& os, const mesa::BigInt& rhs);
@@ -0,0 +1,407 @@
+/** Microbenchmarks for the BigInt kernels and Calc::evaluate
+ *
+ * Every case is timed in batches: the iteration count is doubled until a
+ * batch takes at least the minimum time, then the batch is repeated and the
+ * median and minimum time per operation are reported. Inputs are random
+ * digits from a generator seeded with the seed and the case's name and size,
+ * so the same options give the same inputs on every run (and filtering out
+ * cases doesn't change the others).
+ *
+ * Sizes run from 10 to 10^7 digits, except for the quadratic kernels
+ * (division, modulus) and the operand-by-operand ones (power, factorial),
+ * which stop at 10^6 and 10^5 digits to keep a full run in minutes.
+ *
+ * Results are printed as JSON, e.g. for comparing commits:
+ * ```
+ * make bench && mv bench.json before.json
+ * ```
+ */
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BigInt.h"
+#include "HybridInt.h"
+#include "Calc.h"
+#include "ThreadPool.h"
+
+using mesa::BigInt;
+using Clock = std::chrono::steady_clock;
+
+const std::string USAGE =
+"Usage: BigInt_bench [options] > bench.json\n"
+"  -h  Show this message\n"
+"  -n  Largest operand size in digits (default 10000000)\n"
+"  -t  Minimum time per batch in milliseconds (default 50)\n"
+"  -f  Only run cases whose name contains this string\n"
+"  -s  Random seed (default 1)\n"
+"  -j  Number of threads for parallel arithmetic (default all)\n";
+
+// -----------------------------------------------------------------------------
+
+//! Benchmark options
+struct Options
+{
+  size_t max_digits = 10000000;
+  std::chrono::milliseconds min_time{50};
+  std::string filter;
+  uint64_t seed = 1;
+};
+
+//! Timing of one case
+struct Result
+{
+  std::string name;
+  size_t digits;
+  size_t iterations; // Per batch
+  size_t batches;
+  double median_ns;  // Per operation
+  double min_ns;     // Per operation
+};
+
+// Results are folded in here so the optimizer can't drop the work
+volatile size_t g_sink = 0;
+
+//! Random generator for a case
+std::mt19937_64 generator(const Options& options, const std::string& name,
+    size_t digits)
+{
+  std::seed_seq seq{options.seed, uint64_t(std::hash<std::string>{}(name)),
+    uint64_t(digits)};
+  return std::mt19937_64{seq};
+}
+
+//! Random decimal string without leading zeros
+std::string random_digits(std::mt19937_64& rng, size_t digits)
+{
+  std::uniform_int_distribution<int> digit{0, 9}, lead{1, 9};
+  std::string s(digits, '0');
+  s[0] = char('0' + lead(rng));
+  for (size_t i = 1; i < digits; ++i)
+    s[i] = char('0' + digit(rng));
+  return s;
+}
+
+//! Time a batch of calls
+double time_batch(const std::function<void()>& op, size_t iterations)
+{
+  const auto start = Clock::now();
+  for (size_t i = 0; i < iterations; ++i)
+    op();
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+    .count();
+}
+
+//! Time an operation
+Result measure(const Options& options, const std::string& name,
+    size_t digits, const std::function<void()>& op)
+{
+  const double min_ns =
+    std::chrono::duration<double, std::nano>(options.min_time).count();
+  // Calibrate (which also warms up the caches and the allocator)
+  size_t iterations = 1;
+  double ns = time_batch(op, iterations);
+  while (ns < min_ns && iterations < (size_t{1} << 30)) {
+    iterations *= 2;
+    ns = time_batch(op, iterations);
+  }
+  // Operations over a second are only repeated once more
+  const size_t batches = (ns / iterations > 1e9 ? 1 : 5);
+  std::vector<double> times{ns};
+  for (size_t i = 0; i < batches; ++i)
+    times.push_back(time_batch(op, iterations));
+  std::sort(times.begin(), times.end());
+  return Result{name, digits, iterations, times.size(),
+    times[times.size() / 2] / iterations, times.front() / iterations};
+}
+
+//! Print results as JSON
+void print_json(std::ostream& os, const Options& options,
+    const std::vector<Result>& results)
+{
+  os << "{\n"
+    << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+    << "  \"threads\": " << mesa::ThreadPool::instance().workers() + 1
+    << ",\n"
+    << "  \"seed\": " << options.seed << ",\n"
+    << "  \"min_time_ms\": " << options.min_time.count() << ",\n"
+    << "  \"results\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& r = results[i];
+    os << "    {\"name\": \"" << r.name << "\", \"digits\": " << r.digits
+      << ", \"iterations\": " << r.iterations
+      << ", \"batches\": " << r.batches
+      << ", \"median_ns\": " << std::fixed << std::setprecision(1)
+      << r.median_ns << ", \"min_ns\": " << r.min_ns
+      << std::defaultfloat << "}" << (i + 1 < results.size() ? "," : "")
+      << "\n";
+  }
+  os << "  ]\n}\n";
+}
+
+// -----------------------------------------------------------------------------
+
+//! Benchmark the BigInt kernels
+void bench_kernels(const Options& options, std::vector<Result>& results)
+{
+  // Kernel, and the largest size it runs at
+  struct Kernel
+  {
+    std::string name;
+    size_t max_digits;
+    std::function<std::function<void()>(std::mt19937_64&, size_t)> setup;
+  };
+
+  const std::vector<Kernel> kernels = {
+    {"add", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)}, b{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + (a + b).bytes(); };
+      }
+    },
+    {"sub", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)}, b{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + (a - b).bytes(); };
+      }
+    },
+    {"mul", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)}, b{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + (a * b).bytes(); };
+      }
+    },
+    {"sq", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + a.square().bytes(); };
+      }
+    },
+    // 2n + n*n digits, accumulated in place. The accumulator is owned by
+    // the closure and kept across runs, so no run pays for a copy; after
+    // k runs it has grown by only about log10(k) digits
+    {"addmul", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)}, b{random_digits(rng, digits)};
+        BigInt c{random_digits(rng, 2 * digits)};
+        return [a, b, c]() mutable
+          { g_sink = g_sink + c.addmul(a, b).bytes(); };
+      }
+    },
+    // 2n by n digits
+    {"div", 1000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, 2 * digits)};
+        BigInt b{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + (a / b).bytes(); };
+      }
+    },
+    {"mod", 1000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, 2 * digits)};
+        BigInt b{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + (a % b).bytes(); };
+      }
+    },
+    // Nine digit base, exponent for a result of about digits digits
+    {"pow", 1000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, 9)};
+        BigInt e{static_cast<unsigned long long>(std::max<size_t>(
+              digits / 9, 1))};
+        return [=]{ g_sink = g_sink + (a ^ e).bytes(); };
+      }
+    },
+    // n! for the smallest n with at least digits digits, as Calc's '!'
+    {"factorial", 100000, [](std::mt19937_64&, size_t digits)
+      {
+        unsigned long n = 1;
+        for (double log = 0; log + 1 < digits; log += std::log10(double(n)))
+          ++n;
+        return [=]{
+          BigInt r{1};
+          for (unsigned long i = 2; i <= n; ++i)
+            r *= BigInt{i};
+          g_sink = g_sink + r.bytes();
+        };
+      }
+    },
+    // C(2m, m) for the smallest m with at least digits digits
+    {"choose", 100000, [](std::mt19937_64&, size_t digits)
+      {
+        const BigInt m{
+          static_cast<unsigned long>(digits / std::log10(4.0)) + 1};
+        return [=]{ g_sink = g_sink + (m * 2).choose(m).bytes(); };
+      }
+    },
+    // F(n) for the smallest n with at least digits digits
+    {"fib", 1000000, [](std::mt19937_64&, size_t digits)
+      {
+        const BigInt n{static_cast<unsigned long>(
+            digits / std::log10((1 + std::sqrt(5.0)) / 2)) + 2};
+        return [=]{ g_sink = g_sink + n.fibonacci().bytes(); };
+      }
+    },
+    // Inverse of a random value modulo a random one of as many digits,
+    // stepped until they are coprime
+    {"invmod", 100000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)};
+        const BigInt m{random_digits(rng, digits)};
+        while (a.xgcd(m) != 1)
+          ++a;
+        return [=]{ g_sink = g_sink + a.invmod(m).bytes(); };
+      }
+    },
+    {"parse", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        const std::string s = random_digits(rng, digits);
+        return [=]{ g_sink = g_sink + BigInt{s}.bytes(); };
+      }
+    },
+    {"format", 10000000, [](std::mt19937_64& rng, size_t digits)
+      {
+        BigInt a{random_digits(rng, digits)};
+        return [=]{ g_sink = g_sink + std::string(a).size(); };
+      }
+    },
+  };
+
+  for (const auto& kernel: kernels) {
+    if (kernel.name.find(options.filter) == std::string::npos)
+      continue;
+    const size_t max = std::min(kernel.max_digits, options.max_digits);
+    for (size_t digits = 10; digits <= max; digits *= 10) {
+      auto rng = generator(options, kernel.name, digits);
+      results.push_back(
+          measure(options, kernel.name, digits, kernel.setup(rng, digits)));
+      std::cerr << kernel.name << ' ' << digits << ": "
+        << results.back().median_ns << " ns\n";
+    }
+  }
+}
+
+//! Benchmark Calc::evaluate over synthetic postfix workloads
+// Times are per line. Caches are disabled except in 'evaluate/cached'.
+void bench_evaluate(const Options& options, std::vector<Result>& results)
+{
+  using Calc = mesa::Calc<mesa::HybridInt>;
+  static mesa::StreamLogger logger{&std::cerr, mesa::LogLevel::None};
+  Calc* calc = Calc::instance();
+  calc->stdLogger(&logger);
+  calc->errLogger(&logger);
+
+  const size_t LINES = 256;
+  // Random lines of operands (of the given size) and '+ - *' operators,
+  // reduced by '%' so that results stay that size
+  auto workload = [&](const std::string& name, size_t digits)
+  {
+    auto rng = generator(options, name, digits);
+    std::uniform_int_distribution<int> pick{0, 2};
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < LINES; ++i) {
+      std::string line = random_digits(rng, digits);
+      for (int j = 0; j < 8; ++j)
+        line += ' ' + random_digits(rng, digits) + ' ' + "+-*"[pick(rng)];
+      lines.push_back(line + ' ' + random_digits(rng, digits) + " %");
+    }
+    return lines;
+  };
+  auto evaluate_all = [calc](const std::vector<std::string>& lines)
+  {
+    return [calc, lines]{
+      for (const auto& line: lines)
+        g_sink = g_sink + calc->evaluate(line).bytes();
+    };
+  };
+  auto run = [&](const std::string& name, size_t digits,
+      const std::function<void()>& op)
+  {
+    if (name.find(options.filter) == std::string::npos)
+      return;
+    Result result = measure(options, name, digits, op);
+    result.median_ns /= LINES;
+    result.min_ns /= LINES;
+    results.push_back(result);
+    std::cerr << name << ' ' << digits << ": " << result.median_ns
+      << " ns/line\n";
+  };
+
+  calc->cacheCapacity(0);
+  calc->opCacheCapacity(0);
+  for (size_t digits = 10; digits <= std::min<size_t>(options.max_digits,
+        10000); digits *= 10) {
+    run("evaluate/mixed", digits,
+        evaluate_all(workload("evaluate/mixed", digits)));
+  }
+
+  // Chained through 'ans', so nothing folds at compile time
+  std::vector<std::string> chain(LINES, "ans 3 * 7 + 1000000007 %");
+  run("evaluate/ans", 10, [calc, chain]{
+      for (const auto& line: chain)
+        g_sink = g_sink + calc->evaluate(line).bytes();
+  });
+
+  // Repeated lines, served by the result cache
+  calc->cacheCapacity(size_t{1} << 24);
+  run("evaluate/cached", 100,
+      evaluate_all(workload("evaluate/cached", 100)));
+  calc->cacheCapacity(0);
+}
+
+// -----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+  Options options;
+  size_t threads;
+
+  for (char c; (c = getopt(argc, argv, "hn:t:f:s:j:")) != -1;) {
+    switch (c) {
+      case 'h':
+        std::cout << USAGE;
+        return 0;
+      case 'n':
+        options.max_digits = std::strtoul(optarg, nullptr, 10);
+        break;
+      case 't':
+        options.min_time = std::chrono::milliseconds{
+          std::strtoul(optarg, nullptr, 10)};
+        break;
+      case 'f':
+        options.filter = optarg;
+        break;
+      case 's':
+        options.seed = std::strtoull(optarg, nullptr, 10);
+        break;
+      case 'j':
+        threads = std::strtoul(optarg, nullptr, 10);
+        if (threads == 0) {
+          std::cerr << "Error: Invalid thread count '" << optarg << "'\n";
+          return 1;
+        }
+        mesa::ThreadPool::instance().workers(threads - 1);
+        break;
+      default:
+        std::cerr << USAGE;
+        return 1;
+    }
+  }
+
+  std::vector<Result> results;
+  bench_kernels(options, results);
+  bench_evaluate(options, results);
+  print_json(std::cout, options, results);
+  return 0;
+}
@@ -1,17 +1,236 @@
-//#define BOOST_TEST_DYN_LINK
-//#define BOOST_TEST_MODULE BigInt_test
+/** Self-checking tests for BigInt
+ *
+ * Known vectors for the arithmetic, and identities checked on seeded random
+ * values where a vector would be unwieldy. See Test.h.
+ *
+ * ```
+ * make test
+ * ```
+ */
 
-//#include <boost/test/unit_test.hpp>
-//#include <cmath>
-//#include <iostream>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
 
-//#include "BigInt.h"
+#include "BigInt.h"
+#include "Test.h"
 
-//BOOST_AUTO_TEST_CASE( BigInt_move )
-//{
-//}
+using mesa::BigInt;
+using mesa::test::check;
+using mesa::test::check_equal;
+using mesa::test::check_throws;
+
+//! Random value of a number of decimal digits, negative if asked
+BigInt random_value(std::mt19937_64& rng, size_t digits, bool negative = false)
+{ return BigInt{mesa::test::random_digits(rng, digits, negative)}; }
+
+// -----------------------------------------------------------------------------
+
+void test_arithmetic()
+{
+  const BigInt a{"123456789012345678901234567890"};
+  const BigInt b{"-987654321098765432109876543210"};
+  check_equal(a + b, "-864197532086419753208641975320", "a + b");
+  check_equal(a - b, "1111111110111111111011111111100", "a - b");
+  check_equal(a * b,
+      "-121932631137021795226185032733622923332237463801111263526900",
+      "a * b");
+  check_equal(BigInt{2} ^ BigInt{100}, "1267650600228229401496703205376",
+      "2^100");
+  check_equal(BigInt{0} ^ BigInt{5}, "0", "0^5");
+  check_throws<std::domain_error>([]{ BigInt{0} ^ BigInt{0}; }, "0^0");
+}
+
+//! Truncated division: the quotient rounds toward zero and the remainder
+// takes the sign of the dividend, on one limb and through Algorithm D
+void test_division()
+{
+  struct Vector
+  {
+    const char *u, *v, *q, *r;
+  };
+  const Vector vectors[] = {
+    {"7", "2", "3", "1"},
+    {"-7", "2", "-3", "-1"},
+    {"7", "-2", "-3", "1"},
+    {"-7", "-2", "3", "-1"},
+    {"-10000000000000000000000000000000123456789", "100000000000000000003",
+      "-99999999999999999997", "-123456798"},
+    {"100000000000000000000000000000000000000000000000017",
+      "-10000000000000000000000007", "-9999999999999999999999993", "66"},
+    {"-16069380442589902755419620923411626025222029937827928353013" "76",
+      "-147808829414345923316083210206383297601", "10871732430505435257719",
+      "-23475774836784534757900150934325869257"},
+  };
+  for (const auto& vector: vectors) {
+    const BigInt u{vector.u}, v{vector.v};
+    const std::string what = std::string{vector.u} + " / " + vector.v;
+    check_equal(u / v, vector.q, what);
+    check_equal(u % v, vector.r, what + " remainder");
+  }
+  check_throws<std::invalid_argument>([]{ BigInt{1} / BigInt{0}; }, "1 / 0");
+  check_throws<std::domain_error>([]{ BigInt{0} ^ BigInt{-1}; }, "0^-1");
+  check_throws<std::domain_error>([]{ BigInt{2} ^ BigInt{-1}; }, "2^-1");
+}
+
+//! Baillie-PSW, including pseudoprimes of its two halves
+void test_primes()
+{
+  const char* primes[] = {
+    "2", "3", "97", "2305843009213693951", // 2^61 - 1
+    "170141183460469231731687303715884105727", // 2^127 - 1
+    "10000000000000000000000000000000000000121", // 10^40 + 121
+  };
+  for (auto p: primes)
+    check(BigInt{p}.isPrime(), std::string{p} + " is prime");
+  const char* composites[] = {
+    "0", "1", "-7", "561", // Carmichael
+    "2047", "3215031751", // Strong pseudoprimes to base 2
+    "5459", "5777", // Strong Lucas pseudoprimes
+    "1427247692705959880439315947500961989719490561", // (2^61-1)(2^89-1)
+  };
+  for (auto c: composites)
+    check(!BigInt{c}.isPrime(), std::string{c} + " is composite");
+  const BigInt p = (BigInt{10} ^ BigInt{100}) + BigInt{267};
+  check((BigInt{10} ^ BigInt{100}).nextPrime() == p, "nextPrime(10^100)");
+  check(!(p * p).isPrime(), "(10^100 + 267)^2 is composite");
+}
+
+void test_deserialize()
+{
+  const BigInt x = BigInt{"-12345678901234567890"};
+  const std::string plain = x.serialize(), summed = x.serialize(true);
+  check(BigInt::deserialize(plain) == x, "Round trip");
+  check(BigInt::deserialize(summed) == x, "Round trip with checksum");
+  auto rejects = [](std::string s, const std::string& what)
+  {
+    check_throws<std::invalid_argument>([&]{ BigInt::deserialize(s); },
+        "Deserializing " + what);
+  };
+  rejects(plain.substr(0, 15), "a truncated header");
+  rejects("XBIG" + plain.substr(4), "a bad magic");
+  std::string s = plain;
+  s[4] = char(BigInt::s_FORMAT_VERSION + 1);
+  rejects(s, "an unsupported version");
+  s = plain;
+  s[5] = char(s[5] | 4);
+  rejects(s, "unknown flags");
+  s = plain;
+  s[6] = 1;
+  rejects(s, "a nonzero reserved byte");
+  rejects(plain.substr(0, plain.size() - 1), "a partial limb");
+  rejects(plain + std::string(4, '\0'), "an extra limb");
+  rejects(summed.substr(0, 20), "a truncated checksum");
+  s = summed;
+  s[s.size() - 1] = char(s[s.size() - 1] ^ 1);
+  rejects(s, "a checksum mismatch");
+  s = plain;
+  std::memset(&s[16], 0xff, 4); // Limb 2^32 - 1
+  rejects(s, "a limb out of range");
+  s = plain;
+  std::memset(&s[s.size() - 4], 0, 4);
+  rejects(s, "a leading zero limb");
+  s = BigInt{}.serialize();
+  s[8] = 0; // No limbs
+  rejects(s.substr(0, 16), "no limbs");
+}
+
+void test_radix(std::mt19937_64& rng)
+{
+  check_equal(BigInt{"0xff"}, "255", "0xff");
+  check_equal(BigInt{"-0b101"}, "-5", "-0b101");
+  check((BigInt{2} ^ BigInt{100}).toString(16) ==
+      "0x10000000000000000000000000", "2^100 in hexadecimal");
+  check(BigInt{5}.toString(2) == "0b101", "5 in binary");
+  check(BigInt{-255}.toString(16) == "-0xff", "-255 in hexadecimal");
+  check(BigInt{0}.toString(16) == "0x0", "0 in hexadecimal");
+  check_throws<std::invalid_argument>([]{ BigInt{"0x"}; }, "0x");
+  check_throws<std::invalid_argument>([]{ BigInt{"0b102"}; }, "0b102");
+  check_throws<std::invalid_argument>([]{ BigInt{1}.toString(8); },
+      "Radix 8");
+  const size_t sizes[] = {5, 100, 2000, 20000}; // Digits
+  for (auto digits: sizes) {
+    const BigInt x = random_value(rng, digits, digits % 2);
+    const std::string what = std::to_string(digits) + " digits";
+    check(BigInt{x.toString(16)} == x, what + " through hexadecimal");
+    check(BigInt{x.toString(2)} == x, what + " through binary");
+  }
+}
+
+//! Right shifts floor, as in two's complement
+void test_shift(std::mt19937_64& rng)
+{
+  check_equal(BigInt{-1} >> BigInt{1}, "-1", "-1 >> 1");
+  check_equal(BigInt{-5} >> BigInt{1}, "-3", "-5 >> 1");
+  check_equal(BigInt{-4} >> BigInt{1}, "-2", "-4 >> 1");
+  check_equal(BigInt{"-1000000000000000000000000000000"} >> BigInt{64},
+      "-54210108625", "-10^30 >> 64");
+  check_equal(BigInt{5} >> BigInt{1}, "2", "5 >> 1");
+  check_throws<std::domain_error>([]{ BigInt{1} >> BigInt{-1}; }, "1 >> -1");
+  // Including shifts past a few dozen limbs, which multiply by 5^bits
+  const size_t bits[] = {1, 31, 100, 1000, 5000};
+  for (auto n: bits) {
+    const BigInt x = random_value(rng, 3000, true);
+    const BigInt q = x >> BigInt{n}, scale = BigInt{1} << BigInt{n};
+    check(q * scale <= x && x < (q + BigInt{1}) * scale,
+        "Negative >> " + std::to_string(n) + " floors");
+  }
+}
+
+//! Extended GCD identities below and above the half-GCD threshold
+void test_xgcd(std::mt19937_64& rng)
+{
+  const size_t sizes[] = {1, 20, 500, 3000, 12000}; // Digits
+  for (auto digits: sizes) {
+    for (int i = 0; i < 4; ++i) {
+      const BigInt f = random_value(rng, digits / 3 + 1);
+      const BigInt a = random_value(rng, digits, i & 1) * f;
+      const BigInt b = random_value(rng, digits, i & 2) * f;
+      BigInt x, y;
+      const BigInt g = a.xgcd(b, &x, &y);
+      const std::string what = "xgcd of " + std::to_string(digits) +
+        " digits";
+      check(a * x + b * y == g, what + ": a x + b y = g");
+      check(!g.negative() && a % g == BigInt{0} && b % g == BigInt{0},
+          what + ": g divides a and b");
+      check((a / g).xgcd(b / g) == BigInt{1}, what + ": g is greatest");
+    }
+  }
+  BigInt x, y;
+  check_equal(BigInt{0}.xgcd(BigInt{0}, &x, &y), "0", "xgcd(0, 0)");
+  check_equal(BigInt{0}.xgcd(BigInt{-5}, &x, &y), "5", "xgcd(0, -5)");
+  check(BigInt{-5} * y == BigInt{5}, "xgcd(0, -5) cofactor");
+}
+
+void test_invmod(std::mt19937_64& rng)
+{
+  const BigInt m = (BigInt{2} ^ BigInt{127}) - BigInt{1};
+  for (int i = 0; i < 20; ++i) {
+    const BigInt a = random_value(rng, 1 + rng() % 60, i & 1);
+    const BigInt inverse = a.invmod(m);
+    check(!inverse.negative() && inverse < m, "invmod in [0, m)");
+    check((a * inverse - BigInt{1}) % m == BigInt{0}, "a invmod(a) = 1");
+  }
+  check_equal(BigInt{3}.invmod(BigInt{7}), "5", "3 invmod 7");
+  check_throws<std::domain_error>([]{ BigInt{6}.invmod(BigInt{9}); },
+      "6 invmod 9");
+  check_throws<std::domain_error>([]{ BigInt{3}.invmod(BigInt{0}); },
+      "3 invmod 0");
+}
+
+// -----------------------------------------------------------------------------
 
 int main()
 {
-  return 0;
+  std::mt19937_64 rng{1};
+  test_arithmetic();
+  test_division();
+  test_primes();
+  test_deserialize();
+  test_radix(rng);
+  test_shift(rng);
+  test_xgcd(rng);
+  test_invmod(rng);
+  return mesa::test::report();
 }
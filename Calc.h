@@ -3,12 +3,23 @@
 #include <vector>
 #include <stack>
 #include <queue>
+#include <map>
+#include <unordered_map>
 #include <functional>
 #include <exception>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
 
 #include "Logger.h"
+#include "Allocator.h"
 #include "BigInt.h"
+#include "CancelToken.h"
 #include "Command.h"
+#include "LruCache.h"
+#include "Program.h"
+#include "Stats.h"
 
 #include "util.h"
 
@@ -18,6 +29,14 @@
 
 namespace mesa
 {
+  //! Resource limits of an evaluation (0 for unlimited)
+  struct Limits
+  {
+    size_t digits = 100000000;       // Digits of any result, intermediates too
+    size_t bytes  = size_t{1} << 30; // Bytes of all values held at once
+    std::chrono::milliseconds time{0}; // Wall time
+  };
+
   template<class T>
     class Calc
     {
@@ -28,10 +47,34 @@ namespace mesa
         using Operands                = typename Command::Operands;
         using ArbitraryCommand        = mesa::ArbitraryCommand<DataT>;
         using ParseNumCommand         = mesa::ParseNumCommand<DataT>;
+        using ParseBinCommand         = mesa::ParseBinCommand<DataT>;
         using UnaryOpCommand          = mesa::UnaryOpCommand<DataT>;
         using BinaryOpCommand         = mesa::BinaryOpCommand<DataT>;
+        using TernaryOpCommand        = mesa::TernaryOpCommand<DataT>;
         using ConsumerBinaryOpCommand = mesa::ConsumerBinaryOpCommand<DataT>;
+        using StoreCommand            = mesa::StoreCommand<DataT>;
+        using RecallCommand           = mesa::RecallCommand<DataT>;
+        using Variables               = std::map<std::string, DataT>;
         using Commands                = std::vector<Command*>;
+        using Program                 = mesa::Program<DataT>;
+        using Cache                   = mesa::LruCache<std::string, Program>;
+        using CacheStats              = mesa::CacheStats;
+        using OpCache                 = mesa::OpCache<DataT>;
+        using Limits                  = mesa::Limits;
+        using Stats                   = mesa::Stats;
+        using AllocStats              = mesa::AllocStats;
+        using Allocations             = mesa::Allocations;
+
+        //! Constructor (of an independent calculator, e.g. per session)
+        // Set both loggers before evaluating.
+        Calc() { initialize(); }
+
+        //! Destructor
+        ~Calc()
+        {
+          for (auto command: m_commands)
+            delete command;
+        }
 
         // Default copy constructor
         Calc(const Calc&) = delete;
@@ -39,7 +82,7 @@ namespace mesa
         // Default copy assignment
         void operator=(const Calc&) = delete;
 
-        //! Return singleton instance
+        //! Return shared instance
         static Calc* instance();
 
         //! Get stdout logger
@@ -59,6 +102,76 @@ namespace mesa
         void printHelp(std::ostream& os)
         { os << s_HELP; }
 
+        //! Get result cache capacity in bytes
+        size_t cacheCapacity() const
+        { return m_cache.capacity(); }
+
+        //! Set result cache capacity in bytes (0 disables)
+        // Compiled programs are cached by their normalized token sequence,
+        // least recently used first out, and charged their size in bytes.
+        // Folding leaves only a constant for lines without 'ans'.
+        void cacheCapacity(size_t bytes)
+        { m_cache.capacity(bytes); }
+
+        //! Get result cache counters
+        CacheStats cacheStats() const
+        { return m_cache.stats(); }
+
+        //! Get operation cache capacity in bytes
+        size_t opCacheCapacity() const
+        { return m_opCache.capacity(); }
+
+        //! Set operation cache capacity in bytes (0 disables)
+        // Results of the expensive unary and binary operations are cached by
+        // (token, operands), within and across expressions.
+        void opCacheCapacity(size_t bytes)
+        { m_opCache.capacity(bytes); }
+
+        //! Get operation cache counters
+        CacheStats opCacheStats() const
+        { return m_opCache.stats(); }
+
+        //! Get resource limits
+        const Limits& limits() const
+        { return m_limits; }
+
+        //! Set resource limits
+        // Each command's result size is estimated from its operands before
+        // it runs, so an expression like '10 1000000000 ^' fails up front
+        // with a std::length_error instead of exhausting memory. The time
+        // limit cancels the kernels at their next cancellation point.
+        void limits(const Limits& limits)
+        { m_limits = limits; }
+
+        //! Get command and evaluation statistics
+        // Every command execution is counted under its token (literals
+        // under '(number)', names under '(name)'), whether it runs when
+        // folding at compile time or in a compiled program. Commands with
+        // operands are also timed.
+        const Stats& stats() const
+        { return m_stats; }
+
+        //! Get limb allocations of the last evaluation, on any thread
+        // peak is the most bytes allocated at once over those at the start.
+        const AllocStats& allocations() const
+        { return m_allocations; }
+
+        //! Reset command and evaluation statistics
+        void clearStats()
+        { m_stats.clear(); }
+
+        //! Get named values
+        // 'x store <name>' binds x to the name (leaving x on the stack) and
+        // '<name>' pushes it, from then on, in any expression. Values are
+        // kept parsed and shared with the expressions that use them.
+        const Variables& variables() const
+        { return m_variables; }
+
+        //! Get the token that cancels the evaluation in progress
+        // cancel() is async-signal-safe; each evaluation resets the token.
+        CancelToken& cancelToken()
+        { return m_cancel; }
+
         //! Evaluate string as expression
         // Evaluate a string a single prefix notation mathematical expression.
         // @throws runtime_error Token went unhandled, or operand stack has more
@@ -66,17 +179,79 @@ namespace mesa
         DataT evaluate(const std::string& line);
 
       private:
-        Calc() { initialize(); }
-
         void initialize();
 
+        //! Get the command that handles a token
+        // @throws runtime_error Token went unhandled
+        const Command* find(const std::string& token) const;
+
+        //! Compile tokens into a program, folding constant subexpressions
+        // @throws runtime_error Token went unhandled, too few operands,
+        // invalid name to store, or operand stack has other than one
+        // remaining.
+        Program compile(std::queue<std::string> tokens);
+
+        //! Run a compiled program
+        DataT run(const Program& program);
+
+        using Args     = std::vector<const DataT*>;
+        using Estimate = std::function<double(const Args& args)>;
+
+        //! Check a command's estimated result against the limits
+        // @throws length_error Result would exceed the digit or byte limit
+        void admit(const std::string& token, const Args& args) const;
+
+        //! Check a command's actual result against the limits and hold it
+        // @throws length_error Result exceeds the digit or byte limit
+        void account(const std::string& token, const DataT& result);
+
+        //! Command execution in progress, for the statistics
+        struct Sample
+        {
+          std::chrono::steady_clock::time_point start;
+          uint64_t operandBytes, maxOperand;
+          AllocStats memory; // At the start
+        };
+
+        //! Start timing a command (before its operands are moved)
+        Sample sample(const Args& args);
+
+        //! End the allocation window, starting the next one
+        // The window restarts at each command, so the evaluation's peak is
+        // the largest of its windows.
+        // @return Peak bytes of the window
+        size_t window();
+
+        //! Get allocations since a snapshot
+        AllocStats allocated(const AllocStats& since, size_t peak) const;
+
+        //! Record a finished command in the statistics
+        void record(const std::string& token, const Sample& sample,
+            const DataT& result);
+
+        //! Release a value no longer held by the evaluation
+        void release(const DataT& value)
+        { m_heldBytes -= std::min(m_heldBytes, value.bytes()); }
+
         static Calc *s_instance;
         static std::string s_HELP;
 
         Commands m_commands;
+        const Command* m_recall; // Handles the names that no other does
         Logger *m_stdLogger, *m_errLogger;
         Operands m_operands;
         DataT m_result;
+        Variables m_variables;
+        Cache m_cache;
+        OpCache m_opCache;
+        std::unordered_map<std::string, Estimate> m_estimates; // Digits
+        Limits m_limits;
+        CancelToken m_cancel;
+        size_t m_heldBytes = 0; // Bytes of the values of this evaluation
+        Stats m_stats;
+        AllocStats m_allocations; // Of the last evaluation
+        Allocations::Account m_account; // Current while evaluating
+        size_t m_peak = 0;        // Largest window peak of this evaluation
     };
 }
 
@@ -101,32 +276,44 @@ void mesa::Calc<T>::initialize()
     [](DataT lhs, const DataT &rhs) { return lhs %= rhs; };
   auto exponentiate =
     [](DataT lhs, const DataT &rhs) { return lhs ^= rhs; };
+  auto shift_left =
+    [](DataT lhs, const DataT &rhs) { return lhs <<= rhs; };
+  auto shift_right =
+    [](DataT lhs, const DataT &rhs) { return lhs >>= rhs; };
+  auto addmul =
+    [](DataT acc, const DataT &lhs, const DataT &rhs)
+    { return acc.addmul(lhs, rhs); };
   auto min =
     [](const DataT &lhs, const DataT &rhs)
     { return (lhs < rhs ? lhs : rhs); };
   auto max =
     [](const DataT &lhs, const DataT &rhs)
     { return (lhs > rhs ? lhs : rhs); };
-  auto lcm =
-    [](const DataT &lhs, const DataT &rhs)
+  // Euclid on the magnitudes, so gcf(0, n) = |n| and lcm(0, n) = 0
+  auto absolute =
+    [](const DataT &x) { return (x < DataT{0} ? DataT{0} - x : x); };
+  auto gcf =
+    [absolute](const DataT &lhs, const DataT &rhs)
     {
-      DataT n = lhs;
-      while ((n % rhs) != 0) {
-        n += lhs;
+      DataT a = absolute(lhs), b = absolute(rhs);
+      while (b != 0) {
+        cancellation_point();
+        a %= b;
+        std::swap(a, b);
       }
-      return n;
+      return a;
     };
-  auto gcf =
-    [](const DataT &lhs, const DataT &rhs)
+  auto lcm =
+    [absolute, gcf](const DataT &lhs, const DataT &rhs)
     {
-      DataT n = (lhs > rhs ? lhs : rhs) / 2;
-      while (!((lhs % n == 0) && (rhs % n == 0))) { --n; }
-      return n;
+      const DataT g = gcf(lhs, rhs);
+      return (g == 0 ? g : absolute(lhs / g * rhs));
     };
 
   // TODO: Update help
   m_commands = {
     new ParseNumCommand{},
+    new ParseBinCommand{},
     // Arbitrary commands
     new ArbitraryCommand{"ans", [this](const std::string&)
       {
@@ -136,34 +323,211 @@ void mesa::Calc<T>::initialize()
     // Binary operation commands
     new BinaryOpCommand{"+",   add},
     new BinaryOpCommand{"-",   subtract},
-    new BinaryOpCommand{"*",   multiply},
-    new BinaryOpCommand{"/",   divide},
-    new BinaryOpCommand{"%",   modulus},
-    new BinaryOpCommand{"^",   exponentiate},
+    new BinaryOpCommand{"*",   multiply, true},
+    new BinaryOpCommand{"/",   divide, true},
+    new BinaryOpCommand{"%",   modulus, true},
+    new BinaryOpCommand{"^",   exponentiate, true},
+    new BinaryOpCommand{"<<",  shift_left, true},
+    new BinaryOpCommand{">>",  shift_right, true},
     new BinaryOpCommand{"min", min},
     new BinaryOpCommand{"max", max},
-    new BinaryOpCommand{"lcm", lcm},
-    new BinaryOpCommand{"gcf", gcf},
+    new BinaryOpCommand{"lcm", lcm, true},
+    new BinaryOpCommand{"gcf", gcf, true},
+    new BinaryOpCommand{"root", [](const DataT &lhs, const DataT &rhs)
+      { return lhs.iroot(rhs); }, true
+    },
+    new BinaryOpCommand{"choose", [](const DataT &lhs, const DataT &rhs)
+      { return lhs.choose(rhs); }, true
+    },
+    new BinaryOpCommand{"invmod", [](const DataT &lhs, const DataT &rhs)
+      { return lhs.invmod(rhs); }, true
+    },
+    // Ternary commands
+    new TernaryOpCommand{"*+",  addmul},
     // Unary commands
     new UnaryOpCommand{"!", [](const DataT &lhs)
       {
-        DataT result = lhs;
-        for (auto i = (lhs-1); i > 1; --i)
+        if (lhs < 0)
+          throw std::domain_error("Factorial of negative number");
+        DataT result = 1;
+        for (auto i = lhs; i > 1; --i) {
+          cancellation_point();
           result *= i;
+        }
         return  result;
+      }, true
+    },
+    new UnaryOpCommand{"sq", [](const DataT &lhs)
+      { return lhs.square(); }, true
+    },
+    new UnaryOpCommand{"sqrt", [](const DataT &lhs)
+      { return lhs.isqrt(); }, true
+    },
+    new UnaryOpCommand{"isprime", [](const DataT &lhs)
+      { return DataT(lhs.isPrime() ? 1 : 0); }, true
+    },
+    new UnaryOpCommand{"nextprime", [](const DataT &lhs)
+      { return lhs.nextPrime(); }, true
+    },
+    new UnaryOpCommand{"fib", [](const DataT &lhs)
+      { return lhs.fibonacci(); }, true
+    },
+    new StoreCommand{[this](const std::string& name, const DataT& value)
+      {
+        m_variables[name] = value;
       }
     },
     // Consumer binary commands
-    new ConsumerBinaryOpCommand{"+.",   add},
+    new ConsumerBinaryOpCommand{"+.",   add, true},
     new ConsumerBinaryOpCommand{"-.",   subtract},
-    new ConsumerBinaryOpCommand{"*.",   multiply},
+    new ConsumerBinaryOpCommand{"*.",   multiply, true},
     new ConsumerBinaryOpCommand{"/.",   divide},
     new ConsumerBinaryOpCommand{"%.",   modulus},
     new ConsumerBinaryOpCommand{"^.",   exponentiate},
-    new ConsumerBinaryOpCommand{"min.", min},
-    new ConsumerBinaryOpCommand{"max.", max},
-    new ConsumerBinaryOpCommand{"lcm.", lcm},
-    new ConsumerBinaryOpCommand{"gcf.", gcf},
+    new ConsumerBinaryOpCommand{"min.", min, true},
+    new ConsumerBinaryOpCommand{"max.", max, true},
+    new ConsumerBinaryOpCommand{"lcm.", lcm, true},
+    new ConsumerBinaryOpCommand{"gcf.", gcf, true},
+    // Named values, after every command with a named token
+    new RecallCommand{[this](const std::string& name)
+      -> const DataT&
+      {
+        auto it = m_variables.find(name);
+        if (it == m_variables.end())
+          throw std::runtime_error("Name '" + name + "' is not bound");
+        return it->second;
+      }
+    },
+  };
+  m_recall = m_commands.back();
+  for (auto command: m_commands)
+    command->opCache(&m_opCache);
+
+  // Cost model: estimated decimal digits of each result from the operands
+  auto digits = [](const DataT* x) { return double(x->digits()); };
+  // |x| of counts and exponents (infinite when too large to matter)
+  auto value = [](const DataT* x)
+  {
+    return (x->digits() > 15 ? HUGE_VAL :
+        std::fabs(std::stod(std::string{*x})));
+  };
+  // log10 |x|, at least 0
+  auto magnitude = [=](const DataT* x)
+  {
+    return (x->digits() > 15 ? digits(x) - 1 :
+        std::log10(std::max(1.0, value(x))));
+  };
+  auto widest = [=](const Args& args)
+  {
+    double n = 0;
+    for (auto arg: args)
+      n = std::max(n, digits(arg));
+    return n;
+  };
+  auto narrowest = [=](const Args& args)
+  {
+    double n = HUGE_VAL;
+    for (auto arg: args)
+      n = std::min(n, digits(arg));
+    return n;
+  };
+  auto total = [=](const Args& args)
+  {
+    double n = 0;
+    for (auto arg: args)
+      n += digits(arg);
+    return n;
+  };
+  auto sum = [=](const Args& args)
+  { return widest(args) + std::log10(double(args.size())) + 1; };
+  // Serial fold order: top of the stack (last operand) first
+  auto power = [=](const Args& args)
+  {
+    double n = magnitude(args.back());
+    for (size_t i = args.size() - 1; n > 0 && i-- > 0;)
+      n *= value(args[i]);
+    return n + 1;
+  };
+  m_estimates = {
+    {"+",    sum},
+    {"-",    sum},
+    {"*",    total},
+    {"/",    [=](const Args& args)
+      { return std::max(1.0, digits(args[0]) - digits(args[1]) + 1); }
+    },
+    {"%",    narrowest},
+    {"^",    [=](const Args& args)
+      {
+        const double n = magnitude(args[0]);
+        return (n > 0 ? n * value(args[1]) + 1 : 1);
+      }
+    },
+    {"<<",   [=](const Args& args)
+      { return digits(args[0]) + value(args[1]) * std::log10(2.0); }
+    },
+    {">>",   [=](const Args& args)
+      {
+        return std::max(1.0,
+            digits(args[0]) - value(args[1]) * std::log10(2.0) + 1);
+      }
+    },
+    {"*+",   [=](const Args& args)
+      {
+        return std::max(digits(args[0]),
+            digits(args[1]) + digits(args[2])) + 1;
+      }
+    },
+    {"min",  widest},
+    {"max",  widest},
+    {"lcm",  total},
+    {"gcf",  narrowest},
+    {"root", [=](const Args& args)
+      { return digits(args[0]) / std::max(1.0, value(args[1])) + 1; }
+    },
+    // log10 C(n, k) = log10 n! - log10 k! - log10 (n - k)!, about k log10 n
+    // for n too large to count, with k the smaller of k and n - k
+    {"choose", [=](const Args& args)
+      {
+        if (*args[1] < 0 || *args[1] > *args[0])
+          return 1.0;
+        const DataT rest = *args[0] - *args[1];
+        const double n = value(args[0]),
+              k = value(rest < *args[1] ? &rest : args[1]);
+        if (n == HUGE_VAL)
+          return (k == HUGE_VAL ? HUGE_VAL : k * magnitude(args[0]) + 1);
+        return (std::lgamma(n + 1) - std::lgamma(k + 1) -
+            std::lgamma(n - k + 1)) / std::log(10.0) + 1;
+      }
+    },
+    {"invmod", [=](const Args& args)
+      { return digits(args[1]); }
+    },
+    // Stirling: log10 n! ~ n log10(n / e) + log10(2 pi n) / 2
+    {"!",    [=](const Args& args)
+      {
+        const double n = value(args[0]);
+        return (n < 2 ? 1 : n * std::log10(n / std::exp(1.0)) +
+            std::log10(2 * std::acos(-1.0) * n) / 2 + 1);
+      }
+    },
+    {"sq",   [=](const Args& args) { return 2 * digits(args[0]); }},
+    {"sqrt", [=](const Args& args) { return digits(args[0]) / 2 + 1; }},
+    {"isprime",   [](const Args&) { return 1.0; }},
+    {"nextprime", [=](const Args& args) { return digits(args[0]) + 1; }},
+    // log10 F(n) ~ n log10 phi
+    {"fib",  [=](const Args& args)
+      { return value(args[0]) * std::log10((1 + std::sqrt(5.0)) / 2) + 1; }
+    },
+    {"+.",   sum},
+    {"-.",   sum},
+    {"*.",   total},
+    {"/.",   [=](const Args& args) { return digits(args.back()); }},
+    {"%.",   narrowest},
+    {"^.",   power},
+    {"min.", widest},
+    {"max.", widest},
+    {"lcm.", total},
+    {"gcf.", narrowest},
   };
 }
 
@@ -196,44 +560,424 @@ typename mesa::Calc<T>::DataT mesa::Calc<T>::evaluate(const std::string& line)
 {
   m_stdLogger->log(LogLevel::Debug, "[Calc::evaluate] '" + line + "'\n");
 
+  const auto start = std::chrono::steady_clock::now();
+  auto elapsed = [start]
+  {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count());
+  };
   while (!m_operands.empty())
     m_operands.pop();
+  m_heldBytes = 0;
+  m_cancel.reset();
+  // Only this session's allocations, also on pool threads, count
+  Allocations::Account::Scope accounting{&m_account};
+  const AllocStats memory = m_account.stats();
+  m_account.mark();
+  m_peak = 0;
 
-  // Convert space-delimited raw input line into token queue
-  std::queue<std::string> tokens = queuify(line);
-  std::string token;
+  // Repeated expressions come back compiled (and folded) from the cache
+  std::string key;
+  const Program* program = nullptr;
+  Program compiled;
+  if (m_cache.enabled()) {
+    key = normalize(line);
+    program = m_cache.find(key);
+    if (program)
+      m_stdLogger->log(LogLevel::Debug, "[Calc::evaluate] Cache hit\n");
+  }
 
-  bool unhandled;
   try {
-    while (!tokens.empty()) {
-      unhandled = true;
-      token = tokens.front();
-      for (auto command: m_commands) {
-        if (command->execute(m_operands, token)) {
-          unhandled = false;
-          break;
+    CancelToken::Scope scope{&m_cancel, m_limits.time};
+    if (!program) {
+      compiled = compile(queuify(line));
+      program = &compiled;
+    }
+    m_result = run(*program);
+  } catch (std::exception& e) {
+    window();
+    m_allocations = allocated(memory, m_peak);
+    m_stats.evaluation(elapsed(), true, m_allocations);
+    // Rethrow exception with stack-dump
+    throw std::runtime_error(std::string{e.what()} +
+        "\nStack dump: { " + stack_to_string(m_operands) + " }");
+  }
+  if (!key.empty() && program == &compiled) {
+    const size_t bytes = key.size() + compiled.bytes();
+    m_cache.insert(key, std::move(compiled), bytes);
+  }
+  window();
+  m_allocations = allocated(memory, m_peak);
+  m_stats.evaluation(elapsed(), false, m_allocations);
+  return m_result;
+}
+
+  template<class T>
+const typename mesa::Calc<T>::Command* mesa::Calc<T>::find(
+    const std::string& token) const
+{
+  for (auto command: m_commands)
+    if (command->handles(token))
+      return command;
+  throw std::runtime_error("Token '" + token + "' went unhandled");
+}
+
+  template<class T>
+typename mesa::Calc<T>::Program mesa::Calc<T>::compile(
+    std::queue<std::string> tokens)
+{
+  using Instruction = typename Program::Instruction;
+
+  // Expression DAG, in creation (so topological) order
+  struct Node
+  {
+    const Command* command;
+    std::string token;
+    std::vector<size_t> args;
+    bool constant;
+    DataT value; // Folded value, if constant
+    size_t slot;
+    std::string key;
+    size_t pending; // Times on the stack, not yet consumed
+    bool emitted;   // Consumed by a node that is not folded
+    bool held;      // Value charged to m_heldBytes
+  };
+  std::vector<Node> nodes;
+  std::unordered_map<std::string, size_t> shared; // Structure to node
+  std::vector<size_t> stack;
+  size_t folded = 0, reused = 0;
+  size_t stores = 0; // Stores compiled so far, each may rebind a name
+
+  // Folded values are only held while still on the stack or loaded by the
+  // program, so a line of literals holds its live values, not every
+  // intermediate. A freed value is no longer shared: an identical subtree
+  // later on folds again.
+  auto consume = [&](const std::vector<size_t>& args, bool folding)
+  {
+    for (auto arg: args) {
+      Node& node = nodes[arg];
+      --node.pending;
+      node.emitted = node.emitted || !folding;
+      if (node.pending == 0 && !node.emitted && node.held) {
+        release(node.value);
+        node.value = DataT{};
+        node.held = false;
+        auto it = shared.find(node.key);
+        if (it != shared.end() && it->second == arg)
+          shared.erase(it);
+      }
+    }
+  };
+
+  try {
+    for (; !tokens.empty(); tokens.pop()) {
+      // 'store' takes the next token as the name to bind
+      if (tokens.front() == "store") {
+        tokens.pop();
+        if (tokens.empty())
+          throw std::runtime_error("Store requires a name");
+        if (find(tokens.front()) != m_recall) {
+          throw std::runtime_error(
+              "Invalid name to store '" + tokens.front() + "'");
         }
+        tokens.front().insert(0, "store ");
+        ++stores;
       }
-      if (unhandled) {
-        throw std::runtime_error(
-            "Token '" + token + "' went unhandled");
+      Node node{find(tokens.front()), tokens.front(), {}, true, {}, 0, {}, 1,
+        false, false};
+      const size_t n = node.command->arity(stack.size());
+      node.args.assign(stack.end() - n, stack.end());
+      const std::vector<size_t> consumed = node.args;
+      stack.resize(stack.size() - n);
+      // Squaring is cheaper than multiplying
+      if (node.token == "*" && n == 2 && node.args[0] == node.args[1]) {
+        node.token = "sq";
+        node.command = find(node.token);
+        node.args.pop_back();
       }
-      tokens.pop();
+      // Identical subtrees have identical (token, args) keys
+      std::string key = node.token;
+      for (auto arg: node.args)
+        key += ' ' + std::to_string(arg);
+      // Impure reads are only identical between the same stores, and a
+      // store is never identical to another
+      if (!node.command->pure())
+        key += " @" + std::to_string(stores);
+      auto it = shared.find(key);
+      if (it != shared.end()) {
+        ++nodes[it->second].pending;
+        consume(consumed, nodes[it->second].constant);
+        stack.push_back(it->second);
+        ++reused;
+        continue;
+      }
+      node.constant = node.command->pure();
+      for (auto arg: node.args)
+        node.constant = node.constant && nodes[arg].constant;
+      if (node.constant) {
+        while (!m_operands.empty())
+          m_operands.pop();
+        Args args;
+        for (auto arg: node.args)
+          args.push_back(&nodes[arg].value);
+        admit(node.token, args);
+        const Sample started = sample(args);
+        for (auto arg: node.args)
+          m_operands.push(nodes[arg].value);
+        node.command->execute(m_operands, node.token);
+        node.value = std::move(m_operands.top());
+        m_operands.pop();
+        record(node.token, started, node.value);
+        node.held = true;
+        account(node.token, node.value);
+        folded += !node.args.empty();
+      }
+      consume(consumed, node.constant);
+      shared.emplace(key, nodes.size());
+      node.key = std::move(key);
+      stack.push_back(nodes.size());
+      nodes.push_back(std::move(node));
     }
-    if (m_operands.size() == 0) {
+    if (stack.size() == 0) {
       throw std::runtime_error(
           "No operands remaining on stack after evaluation, expected one");
     }
-    else if (m_operands.size() > 1) {
+    else if (stack.size() > 1) {
       throw std::runtime_error(
           "More than one operand remaining on stack, expected one");
     }
-  } catch (std::exception& e) {
-    // Rethrow exception with stack-dump
-    throw std::runtime_error(std::string{e.what()} +
-        "\nStack dump: { " + stack_to_string(m_operands) + " }");
+  } catch (std::exception&) {
+    // Leave the (known) stack for the stack dump
+    while (!m_operands.empty())
+      m_operands.pop();
+    for (auto id: stack)
+      if (nodes[id].constant)
+        m_operands.push(nodes[id].value);
+    throw;
+  }
+
+  // Loaded values are charged again as the program runs
+  for (auto& node: nodes) {
+    if (node.held) {
+      release(node.value);
+      node.held = false;
+    }
+  }
+
+  // 'a b c * +' becomes 'a b c *+', which accumulates the product into a
+  // instead of materializing it, unless the product is also used elsewhere
+  // (only emitted nodes refer to a non-constant product, so its count of
+  // references is exact)
+  const size_t root = stack.back();
+  std::vector<size_t> uses(nodes.size());
+  ++uses[root];
+  for (const auto& node: nodes)
+    for (auto arg: node.args)
+      ++uses[arg];
+  for (auto& node: nodes) {
+    if (node.constant || node.token != "+" || node.args.size() != 2)
+      continue;
+    for (size_t k = 0; k < 2; ++k) {
+      const size_t id = node.args[k];
+      const Node& product = nodes[id];
+      if (product.constant || product.token != "*" || uses[id] != 1)
+        continue;
+      node.args = {node.args[1 - k], product.args[0], product.args[1]};
+      node.token = "*+";
+      node.command = find(node.token);
+      break;
+    }
+  }
+
+  // Only nodes that a non-constant node (or the result) refers to are emitted
+  std::vector<bool> reachable(nodes.size());
+  reachable[root] = true;
+  for (size_t i = nodes.size(); i-- > 0;)
+    if (reachable[i] && !nodes[i].constant)
+      for (auto arg: nodes[i].args)
+        reachable[arg] = true;
+
+  Program program;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    if (!reachable[i])
+      continue;
+    Node& node = nodes[i];
+    node.slot = program.slots++;
+    Instruction instruction;
+    instruction.slot = node.slot;
+    if (node.constant) {
+      instruction.op = Instruction::Load;
+      instruction.value = std::move(node.value);
+    } else {
+      instruction.op = Instruction::Apply;
+      instruction.command = node.command;
+      instruction.token = node.token;
+      for (auto arg: node.args)
+        instruction.operands.push_back({nodes[arg].slot, false});
+    }
+    program.code.push_back(std::move(instruction));
+  }
+  program.result = nodes[root].slot;
+
+  // Values may be moved out of slots at their last reference
+  std::vector<bool> referenced(program.slots);
+  referenced[program.result] = true;
+  for (auto it = program.code.rbegin(); it != program.code.rend(); ++it) {
+    for (auto jt = it->operands.rbegin(); jt != it->operands.rend(); ++jt) {
+      jt->last = !referenced[jt->slot];
+      referenced[jt->slot] = true;
+    }
+  }
+
+  m_stdLogger->log(LogLevel::Debug,
+      "[Calc::compile] " + std::to_string(nodes.size() + reused) +
+      " tokens -> " + std::to_string(program.code.size()) +
+      " instructions (" + std::to_string(folded) + " folded, " +
+      std::to_string(reused) + " shared)\n");
+  return program;
+}
+
+  template<class T>
+typename mesa::Calc<T>::DataT mesa::Calc<T>::run(const Program& program)
+{
+  using Instruction = typename Program::Instruction;
+
+  std::vector<DataT> slots(program.slots);
+  for (const auto& instruction: program.code) {
+    if (instruction.op == Instruction::Load) {
+      slots[instruction.slot] = instruction.value;
+      m_heldBytes += instruction.value.bytes();
+      continue;
+    }
+    while (!m_operands.empty())
+      m_operands.pop();
+    Args args;
+    for (const auto& operand: instruction.operands)
+      args.push_back(&slots[operand.slot]);
+    admit(instruction.token, args);
+    const Sample started = sample(args);
+    for (const auto& operand: instruction.operands) {
+      if (operand.last) {
+        release(slots[operand.slot]);
+        m_operands.push(std::move(slots[operand.slot]));
+      } else {
+        m_operands.push(slots[operand.slot]);
+      }
+    }
+    instruction.command->execute(m_operands, instruction.token);
+    slots[instruction.slot] = std::move(m_operands.top());
+    m_operands.pop();
+    record(instruction.token, started, slots[instruction.slot]);
+    account(instruction.token, slots[instruction.slot]);
+  }
+  return std::move(slots[program.result]);
+}
+
+  template<class T>
+void mesa::Calc<T>::admit(const std::string& token, const Args& args) const
+{
+  if (m_limits.digits == 0 && m_limits.bytes == 0)
+    return;
+  auto it = m_estimates.find(token);
+  if (it == m_estimates.end())
+    return;
+  const double digits =
+    std::min(it->second(args), double(DataT::maxDigits()));
+  // Round the (possibly astronomical) estimate for the message
+  auto approximate = [](double n)
+  {
+    std::ostringstream ss;
+    ss << std::setprecision(n < 1e15 ? 15 : 3) << std::floor(n);
+    return ss.str();
+  };
+  if (m_limits.digits != 0 && digits > m_limits.digits) {
+    throw std::length_error("Result of '" + token + "' would have about " +
+        approximate(digits) + " digits, over the limit of " +
+        std::to_string(m_limits.digits));
+  }
+  const double bytes = m_heldBytes + (digits < 1e18 ?
+      double(DataT::bytesFor(size_t(digits))) : HUGE_VAL);
+  if (m_limits.bytes != 0 && bytes > m_limits.bytes) {
+    throw std::length_error("Evaluating '" + token + "' would hold about " +
+        approximate(bytes) + " bytes, over the limit of " +
+        std::to_string(m_limits.bytes));
+  }
+}
+
+  template<class T>
+void mesa::Calc<T>::account(const std::string& token, const DataT& result)
+{
+  m_heldBytes += result.bytes();
+  if (m_limits.digits != 0 && result.digits() > m_limits.digits) {
+    throw std::length_error("Result of '" + token + "' has " +
+        std::to_string(result.digits()) + " digits, over the limit of " +
+        std::to_string(m_limits.digits));
+  }
+  if (m_limits.bytes != 0 && m_heldBytes > m_limits.bytes) {
+    throw std::length_error("Evaluation holds " +
+        std::to_string(m_heldBytes) + " bytes, over the limit of " +
+        std::to_string(m_limits.bytes));
   }
-  m_result = m_operands.top();
-  return m_result;
 }
 
+  template<class T>
+typename mesa::Calc<T>::Sample mesa::Calc<T>::sample(const Args& args)
+{
+  // Operand-less commands (literals, 'ans') are only counted, which saves
+  // the clock reads on literal-heavy lines
+  Sample sample{{}, 0, 0, {}};
+  window();
+  sample.memory = m_account.stats();
+  if (!args.empty())
+    sample.start = std::chrono::steady_clock::now();
+  for (auto arg: args) {
+    sample.operandBytes += arg->bytes();
+    sample.maxOperand = std::max<uint64_t>(sample.maxOperand, arg->bytes());
+  }
+  return sample;
+}
+
+  template<class T>
+void mesa::Calc<T>::record(const std::string& token, const Sample& sample,
+    const DataT& result)
+{
+  using std::chrono::steady_clock;
+  const auto ns = (sample.start == steady_clock::time_point{} ? 0 :
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        steady_clock::now() - sample.start).count());
+  // Literals, names and stores are counted together, not one entry each
+  std::string key;
+  if (is_numeric(token) || radix_bits(token) != 0 ||
+      token.compare(0, 4, "bin:") == 0)
+    key = "(number)";
+  else if (token.compare(0, 6, "store ") == 0)
+    key = "store";
+  else if (is_name(token) && find(token) == m_recall)
+    key = "(name)";
+  m_stats.record((key.empty() ? token : key), uint64_t(ns),
+      sample.operandBytes, sample.maxOperand, result.bytes(),
+      allocated(sample.memory, window()));
+}
+
+  template<class T>
+size_t mesa::Calc<T>::window()
+{
+  const size_t peak = m_account.windowPeak();
+  m_account.mark();
+  m_peak = std::max(m_peak, peak);
+  return peak;
+}
+
+  template<class T>
+mesa::AllocStats mesa::Calc<T>::allocated(const AllocStats& since,
+    size_t peak) const
+{
+  const AllocStats now = m_account.stats();
+  AllocStats delta;
+  delta.current = (now.current > since.current ?
+      now.current - since.current : 0);
+  delta.peak = (peak > since.current ? peak - since.current : 0);
+  delta.total = now.total - since.total;
+  delta.allocations = now.allocations - since.allocations;
+  return delta;
+}
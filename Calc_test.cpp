@@ -0,0 +1,122 @@
+/** Self-checking tests for Calc
+ *
+ * Lines go through Calc::evaluate and their results are compared with known
+ * values, so the compiler's folding, sharing and rewrites are checked end to
+ * end. See Test.h.
+ *
+ * ```
+ * make test
+ * ```
+ */
+
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include "BigInt.h"
+#include "Calc.h"
+#include "Logger.h"
+#include "Test.h"
+
+using mesa::test::check;
+
+using Calc = mesa::Calc<mesa::BigInt>;
+
+//! Check the result of evaluating a line
+void check_line(Calc& calc, const std::string& line,
+    const std::string& expected)
+{
+  std::string actual;
+  try {
+    actual = std::string{calc.evaluate(line)};
+  } catch (const std::exception& e) {
+    actual = e.what();
+  }
+  check(actual == expected,
+      "'" + line + "' is " + actual + ", expected " + expected);
+}
+
+//! Get if a token ran since the stats were last cleared
+bool ran(const Calc& calc, const std::string& token)
+{ return calc.stats().commands().count(token) != 0; }
+
+// -----------------------------------------------------------------------------
+
+//! Compiling: folding, sharing of identical subtrees and rewrites
+void test_compile(mesa::Logger& logger)
+{
+  Calc calc;
+  calc.stdLogger(&logger);
+  calc.errLogger(&logger);
+
+  // Reads of a name are only shared between the same stores
+  check_line(calc, "3 store a", "3");
+  check_line(calc, "a 5 store a a + +", "13");
+  check_line(calc, "2 store b b 3 store b b + + +", "10");
+
+  // Squaring a shared operand
+  calc.clearStats();
+  check_line(calc, "a a *", "25");
+  check(ran(calc, "sq") && !ran(calc, "*"), "'a a *' squares");
+
+  // A product feeding only an addition is fused; one used again is not
+  calc.clearStats();
+  check_line(calc, "a 7 * 4 +", "39");
+  check(ran(calc, "*+"), "'a 7 * 4 +' fuses");
+  check_line(calc, "a 7 * 4 + a 7 * -", "4");
+  check_line(calc, "4 a 7 * + a 7 * +", "74");
+
+  // Folded intermediates are freed once consumed, so a chain of literals
+  // holds one large value at a time
+  mesa::Limits limits;
+  limits.bytes = size_t{2} << 20;
+  calc.limits(limits);
+  check_line(calc, "7 1000000 ^ 1 + 1 + 1 + 1 + 1 + 7 %", "5");
+  calc.limits(mesa::Limits{});
+}
+
+//! Repeated lines and subtrees with the result and operation caches on
+void test_caches(mesa::Logger& logger)
+{
+  Calc calc;
+  calc.stdLogger(&logger);
+  calc.errLogger(&logger);
+  calc.cacheCapacity(size_t{1} << 20);
+  calc.opCacheCapacity(size_t{1} << 20);
+  check_line(calc, "3 store x", "3");
+  const std::string line = "x 7 ^ x 7 ^ + x 7 ^ x 7 ^ + *";
+  check_line(calc, line, "19131876");
+  check_line(calc, line, "19131876");
+  check(calc.cacheStats().hits == 1, "Repeated line hits the cache");
+  check_line(calc, "2 store x", "2");
+  check_line(calc, line, "65536");
+}
+
+//! Euclid on magnitudes, also when reducing a series
+void test_gcf_lcm(mesa::Logger& logger)
+{
+  Calc calc;
+  calc.stdLogger(&logger);
+  calc.errLogger(&logger);
+  check_line(calc, "0 5 gcf", "5");
+  check_line(calc, "4 4 gcf", "4");
+  check_line(calc, "1 1 gcf", "1");
+  check_line(calc, "0 0 gcf", "0");
+  check_line(calc, "-12 18 gcf", "6");
+  check_line(calc, "-4 6 lcm", "12");
+  check_line(calc, "0 5 lcm", "0");
+  check_line(calc, "1000000007 998244353 lcm", "998244359987710471");
+  check_line(calc, "12 18 -24 30 gcf.", "6");
+  check_line(calc, "4 6 -10 7 lcm.", "420");
+}
+
+// -----------------------------------------------------------------------------
+
+int main()
+{
+  mesa::StreamLogger logger{&std::cerr, mesa::LogLevel::Error};
+  test_compile(logger);
+  test_caches(logger);
+  test_gcf_lcm(logger);
+  return mesa::test::report();
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+/** Cooperative cancellation
+ *
+ * Long-running kernels call mesa::cancellation_point() in their outer loops,
+ * which throws mesa::Cancelled once the calling thread's current token has
+ * been cancelled, either explicitly (e.g. from a signal handler) or by a
+ * deadline. Polling is a thread-local load and a relaxed atomic load, and
+ * deadlines are enforced by one shared timer thread rather than by reading
+ * the clock in the kernels.
+ *
+ * Example usage:
+ * ```
+ * mesa::CancelToken token;
+ * {
+ *   // Current token of this thread (and of pool jobs it forks) until the
+ *   // end of the scope, cancelled after 100 ms
+ *   mesa::CancelToken::Scope scope{&token, std::chrono::milliseconds{100}};
+ *   x ^= y; // May throw mesa::Cancelled
+ * }
+ * ```
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace mesa
+{
+  //! Thrown from a cancellation point of a cancelled computation
+  class Cancelled : public std::runtime_error
+  {
+    public:
+      using std::runtime_error::runtime_error;
+  };
+
+  class CancelToken
+  {
+    public:
+      using Clock = std::chrono::steady_clock;
+
+      CancelToken() = default;
+
+      CancelToken(const CancelToken&) = delete;
+      void operator=(const CancelToken&) = delete;
+
+      ~CancelToken()
+      { disarm(); }
+
+      //! Cancel (async-signal-safe)
+      void cancel() noexcept
+      { m_state.store(s_CANCELLED, std::memory_order_relaxed); }
+
+      //! Clear cancellation and any deadline
+      void reset()
+      {
+        disarm();
+        m_state.store(s_RUNNING, std::memory_order_relaxed);
+      }
+
+      //! Get if cancelled (or timed out)
+      bool cancelled() const noexcept
+      { return m_state.load(std::memory_order_relaxed) != s_RUNNING; }
+
+      //! Time out at a deadline
+      void deadline(Clock::time_point when)
+      { Timer::instance().arm(this, when); }
+
+      //! Remove the deadline, if any
+      void disarm()
+      { Timer::instance().disarm(this); }
+
+      //! Throw if cancelled
+      // @throws Cancelled
+      void check() const
+      {
+        switch (m_state.load(std::memory_order_relaxed)) {
+          case s_RUNNING:
+            return;
+          case s_TIMED_OUT:
+            throw Cancelled("Evaluation exceeded its time limit");
+          default:
+            throw Cancelled("Evaluation cancelled");
+        }
+      }
+
+      //! Current token of the calling thread (nullptr if none)
+      static CancelToken*& current()
+      {
+        static thread_local CancelToken* token = nullptr;
+        return token;
+      }
+
+      //! Make a token current for the lifetime of the scope
+      class Scope
+      {
+        public:
+          //! Constructor
+          // @param timeout Time out the token after this long (0 for never);
+          // the deadline is removed again at the end of the scope
+          explicit Scope(CancelToken* token,
+              std::chrono::milliseconds timeout = std::chrono::milliseconds{0}):
+            m_token{token},
+            m_previous{current()},
+            m_timed{token != nullptr && timeout.count() > 0}
+          {
+            if (m_timed)
+              m_token->deadline(Clock::now() + timeout);
+            current() = m_token;
+          }
+
+          Scope(const Scope&) = delete;
+          void operator=(const Scope&) = delete;
+
+          ~Scope()
+          {
+            current() = m_previous;
+            if (m_timed)
+              m_token->disarm();
+          }
+
+        private:
+          CancelToken* m_token;
+          CancelToken* m_previous;
+          bool m_timed;
+      };
+
+    private:
+      static constexpr int s_RUNNING   = 0;
+      static constexpr int s_CANCELLED = 1;
+      static constexpr int s_TIMED_OUT = 2;
+
+      //! Shared timer thread firing deadlines (started on first use)
+      class Timer
+      {
+        public:
+          static Timer& instance()
+          {
+            static Timer timer;
+            return timer;
+          }
+
+          ~Timer()
+          {
+            {
+              std::lock_guard<std::mutex> lock{m_mutex};
+              m_stop = true;
+            }
+            m_wake.notify_all();
+            if (m_thread.joinable())
+              m_thread.join();
+          }
+
+          void arm(CancelToken* token, Clock::time_point when)
+          {
+            {
+              std::lock_guard<std::mutex> lock{m_mutex};
+              m_deadlines[token] = when;
+              if (!m_thread.joinable())
+                m_thread = std::thread{&Timer::run, this};
+            }
+            m_wake.notify_all();
+          }
+
+          void disarm(CancelToken* token)
+          {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_deadlines.erase(token);
+          }
+
+        private:
+          void run()
+          {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            while (!m_stop) {
+              auto next = Clock::time_point::max();
+              const auto now = Clock::now();
+              for (auto it = m_deadlines.begin(); it != m_deadlines.end();) {
+                if (it->second <= now) {
+                  int running = s_RUNNING;
+                  it->first->m_state.compare_exchange_strong(
+                      running, s_TIMED_OUT, std::memory_order_relaxed);
+                  it = m_deadlines.erase(it);
+                } else {
+                  next = std::min(next, it->second);
+                  ++it;
+                }
+              }
+              if (next == Clock::time_point::max())
+                m_wake.wait(lock);
+              else
+                m_wake.wait_until(lock, next);
+            }
+          }
+
+          std::mutex m_mutex;
+          std::condition_variable m_wake;
+          std::map<CancelToken*, Clock::time_point> m_deadlines;
+          std::thread m_thread;
+          bool m_stop = false;
+      };
+
+      std::atomic<int> m_state{s_RUNNING};
+  };
+
+  //! Throw if the calling thread's current token is cancelled
+  // @throws Cancelled
+  inline void cancellation_point()
+  {
+    const CancelToken* token = CancelToken::current();
+    if (token != nullptr)
+      token->check();
+  }
+}
@@ -17,10 +17,13 @@
  */
 
 #include <stack>
+#include <vector>
 #include <functional>
 #include <algorithm>
 
 #include "Logger.h"
+#include "OpCache.h"
+#include "ThreadPool.h"
 
 #include "util.h"
 
@@ -61,6 +64,26 @@ namespace mesa
       void stderrLogger(Logger* logger)
       { m_stderrLogger = logger; }
 
+      /** Set operation cache (nullptr disables memoization)
+      */
+      void opCache(OpCache<T>* cache)
+      { m_opCache = cache; }
+
+      /** Get if this command handles a token
+      */
+      virtual bool handles(const std::string& token) const = 0;
+
+      /** Get number of operands consumed from a stack of the given depth
+       * @throws runtime_error If the stack holds too few operands
+       */
+      virtual size_t arity(size_t depth) const = 0;
+
+      /** Get if the result depends only on the token and operands
+       * Pure commands over constant operands are folded when compiling.
+       */
+      virtual bool pure() const
+      { return true; }
+
       /** Execute command
        * @param operands Stack of unsigned integer numbers.
        * @param token Token to be evaluated and used during execution. If the
@@ -84,8 +107,27 @@ namespace mesa
           m_stderrLogger->log(logLevel, line);
       }
 
+      /** Apply operation, memoized through the operation cache if enabled
+       * @param rhs Right operand, or zero for unary operations
+       */
+      template<class Op>
+      Data memoize(const std::string& token, const Data& lhs, const Data& rhs,
+          Op op) const
+      {
+        if (m_opCache == nullptr || !m_opCache->enabled())
+          return op();
+        if (const Data* hit = m_opCache->find(token, lhs, rhs)) {
+          log(LogLevel::Debug, " (cached)");
+          return *hit;
+        }
+        Data result = op();
+        m_opCache->insert(token, lhs, rhs, result);
+        return result;
+      }
+
       Logger* m_stdoutLogger = nullptr;
       Logger* m_stderrLogger = nullptr;
+      OpCache<T>* m_opCache = nullptr;
   };
 
   // ---------------------------------------------------------------------------
@@ -102,11 +144,21 @@ namespace mesa
         m_op{op}
       {}
 
+      bool handles(const std::string& token) const override
+      { return token == m_TOKEN; }
+
+      size_t arity(size_t) const override
+      { return 0; }
+
+      //! Arbitrary commands read state outside of the operand stack
+      bool pure() const override
+      { return false; }
+
       bool execute(
           Operands&,
           const std::string& token) const override
       {
-        if (token != m_TOKEN)
+        if (!handles(token))
           return false;
         Command<T>::log(LogLevel::Debug,
             "[ArbitraryCommand] token:'" + token + "'\n");
@@ -121,17 +173,27 @@ namespace mesa
 
   // ---------------------------------------------------------------------------
   //! "Parse operand as number" command
+  // Handles decimal, '0x' hexadecimal and '0b' binary literals.
   template<class T> class ParseNumCommand : public Command<T>
   {
     public:
       using Data     = typename Command<T>::Data;
       using Operands = typename Command<T>::Operands;
 
+      bool handles(const std::string& token) const override
+      {
+        return !token.empty() &&
+          (mesa::is_numeric(token) || mesa::radix_bits(token) != 0);
+      }
+
+      size_t arity(size_t) const override
+      { return 0; }
+
       bool execute(
           Operands& operands,
           const std::string& token) const override
       {
-        if (token.empty() || !mesa::is_numeric(token))
+        if (!handles(token))
           return false;
         Command<T>::log(LogLevel::Debug,
             "[ParseNumCommand] token:'" + token +
@@ -141,6 +203,132 @@ namespace mesa
       }
   };
 
+  // ---------------------------------------------------------------------------
+  //! "Parse operand from the binary format" command
+  // Handles 'bin:' followed by the hexadecimal bytes of T::serialize(), which
+  // is linear in the size of the value for any radix.
+  template<class T> class ParseBinCommand : public Command<T>
+  {
+    public:
+      using Data     = typename Command<T>::Data;
+      using Operands = typename Command<T>::Operands;
+
+      static constexpr size_t s_PREFIX_SIZE = 4;
+
+      bool handles(const std::string& token) const override
+      { return token.compare(0, s_PREFIX_SIZE, "bin:") == 0; }
+
+      size_t arity(size_t) const override
+      { return 0; }
+
+      bool execute(
+          Operands& operands,
+          const std::string& token) const override
+      {
+        if (!handles(token))
+          return false;
+        Command<T>::log(LogLevel::Debug,
+            "[ParseBinCommand] " + std::to_string(token.size()) +
+            " characters\n");
+        operands.push(Data::deserialize(mesa::from_hex(token,
+                s_PREFIX_SIZE)));
+        return true;
+      }
+  };
+
+  // ---------------------------------------------------------------------------
+  //! "Bind operand to a name" command
+  // Handles 'store <name>' tokens (Calc joins 'store' and the name that
+  // follows it) and leaves the operand on the stack.
+  template<class T> class StoreCommand : public Command<T>
+  {
+    public:
+      using Data      = typename Command<T>::Data;
+      using Operands  = typename Command<T>::Operands;
+      using Operation = std::function<void(const std::string&, const T&)>;
+
+      static constexpr const char* s_PREFIX = "store ";
+
+      StoreCommand(Operation op):
+        m_op{op}
+      {}
+
+      bool handles(const std::string& token) const override
+      { return token.compare(0, name_offset(), s_PREFIX) == 0; }
+
+      size_t arity(size_t depth) const override
+      {
+        if (depth < 1)
+          throw std::runtime_error("Store requires one operand");
+        return 1;
+      }
+
+      //! Stores outlive the expression
+      bool pure() const override
+      { return false; }
+
+      bool execute(
+          Operands& operands,
+          const std::string& token) const override
+      {
+        if (!handles(token))
+          return false;
+        arity(operands.size());
+        Command<T>::log(LogLevel::Debug,
+            "[StoreCommand] token:'" + token +
+            "' stack:{ " + stack_to_string(operands) + " }\n");
+        m_op(token.substr(name_offset()), operands.top());
+        return true;
+      }
+
+    protected:
+      static size_t name_offset()
+      { return std::char_traits<char>::length(s_PREFIX); }
+
+      Operation m_op;
+  };
+
+  // ---------------------------------------------------------------------------
+  //! "Recall named value" command
+  // Handles every name, so it goes after the commands with named tokens.
+  // Unbound names fail when the expression runs.
+  template<class T> class RecallCommand : public Command<T>
+  {
+    public:
+      using Data     = typename Command<T>::Data;
+      using Operands = typename Command<T>::Operands;
+      using Lookup   = std::function<const T&(const std::string&)>;
+
+      RecallCommand(Lookup lookup):
+        m_lookup{lookup}
+      {}
+
+      bool handles(const std::string& token) const override
+      { return mesa::is_name(token); }
+
+      size_t arity(size_t) const override
+      { return 0; }
+
+      //! Names may be rebound between expressions
+      bool pure() const override
+      { return false; }
+
+      bool execute(
+          Operands& operands,
+          const std::string& token) const override
+      {
+        if (!handles(token))
+          return false;
+        Command<T>::log(LogLevel::Debug,
+            "[RecallCommand] token:'" + token + "'\n");
+        operands.push(m_lookup(token));
+        return true;
+      }
+
+    protected:
+      Lookup m_lookup;
+  };
+
   // ---------------------------------------------------------------------------
   //! Unary operation command
   template<class T> class UnaryOpCommand : public Command<T>
@@ -150,25 +338,40 @@ namespace mesa
       using Operands  = typename Command<T>::Operands;
       using Operation = std::function<T(const T&)>;
 
-      UnaryOpCommand(const std::string& token, Operation op):
+      //! Constructor
+      // @param memoize Look results up in the operation cache (worth it for
+      // operations that cost more than hashing their operands)
+      UnaryOpCommand(const std::string& token, Operation op,
+          bool memoize = false):
         m_TOKEN{token},
-        m_op{op}
+        m_op{op},
+        m_memoize{memoize}
       {}
 
+      bool handles(const std::string& token) const override
+      { return token == m_TOKEN; }
+
+      size_t arity(size_t depth) const override
+      {
+        if (depth < 1)
+          throw std::runtime_error("Unary operation requires one operand");
+        return 1;
+      }
+
       bool execute(
           Operands& operands,
           const std::string& token) const override
       {
-        if (token == m_TOKEN) {
+        if (handles(token)) {
+          arity(operands.size());
           Command<T>::log(LogLevel::Debug,
               "[UnaryOpCommand] token:'" + token +
               "' stack:{ " + stack_to_string(operands) + " }");
-          if (operands.size() < 1) {
-            Command<T>::log(LogLevel::Debug, "\n");
-            throw std::runtime_error("Unary operation requires one operand");
-          }
           auto lhs = operands.top(); operands.pop();
-          auto result = m_op(lhs);
+          auto result = (m_memoize ?
+              Command<T>::memoize(token, lhs, Data{},
+                [&]{ return m_op(lhs); }) :
+              m_op(lhs));
           Command<T>::log(LogLevel::Debug,
               " -> " + std::string{result} + "\n");
           operands.push(result);
@@ -180,6 +383,7 @@ namespace mesa
     protected:
       const std::string m_TOKEN;
       Operation m_op;
+      const bool m_memoize;
   };
 
   // ---------------------------------------------------------------------------
@@ -191,34 +395,103 @@ namespace mesa
       using Operands  = typename Command<T>::Operands;
       using Operation = std::function<T(const T&, const T&)>;
 
-      BinaryOpCommand(const std::string& token, Operation op):
+      //! Constructor
+      // @param memoize Look results up in the operation cache (worth it for
+      // operations that cost more than hashing their operands)
+      BinaryOpCommand(const std::string& token, Operation op,
+          bool memoize = false):
         m_TOKEN{token},
-        m_op{op}
+        m_op{op},
+        m_memoize{memoize}
       {}
 
+      bool handles(const std::string& token) const override
+      { return token == m_TOKEN; }
+
+      size_t arity(size_t depth) const override
+      {
+        if (depth < 2)
+          throw std::runtime_error(
+              "Binary operation require two operands");
+        return 2;
+      }
+
       bool execute(
           Operands &operands,
           const std::string& token) const override
       {
-        if (token != m_TOKEN)
+        if (!handles(token))
           return false;
+        arity(operands.size());
         Command<T>::log(LogLevel::Debug,
             "[BinaryOpCommand] token:'" + token +
             "' stack:{ " + stack_to_string(operands) + " }");
-        if (operands.size() < 2) {
-          Command<T>::log(LogLevel::Debug, "\n");
-          throw std::runtime_error(
-              "Binary operation require two operands");
-        }
         auto rhs = operands.top(); operands.pop();
         auto lhs = operands.top(); operands.pop();
-        auto result = m_op(lhs, rhs);
+        auto result = (m_memoize ?
+            Command<T>::memoize(token, lhs, rhs,
+              [&]{ return m_op(lhs, rhs); }) :
+            m_op(lhs, rhs));
         Command<T>::log(LogLevel::Debug,
             " -> " + std::string{result} + "\n");
         operands.push(result);
         return true;
       }
 
+    protected:
+      const std::string m_TOKEN;
+      Operation m_op;
+      const bool m_memoize;
+  };
+
+  // ---------------------------------------------------------------------------
+  //! Ternary operation command
+  // The deepest operand is moved into the operation, so an accumulating
+  // operation can write into its limbs. Results are not memoized: the
+  // operation cache is keyed on two operands.
+  template<class T> class TernaryOpCommand : public Command<T>
+  {
+    public:
+      using Data      = typename Command<T>::Data;
+      using Operands  = typename Command<T>::Operands;
+      using Operation = std::function<T(T, const T&, const T&)>;
+
+      TernaryOpCommand(const std::string& token, Operation op):
+        m_TOKEN{token},
+        m_op{op}
+      {}
+
+      bool handles(const std::string& token) const override
+      { return token == m_TOKEN; }
+
+      size_t arity(size_t depth) const override
+      {
+        if (depth < 3)
+          throw std::runtime_error(
+              "Ternary operation requires three operands");
+        return 3;
+      }
+
+      bool execute(
+          Operands &operands,
+          const std::string& token) const override
+      {
+        if (!handles(token))
+          return false;
+        arity(operands.size());
+        Command<T>::log(LogLevel::Debug,
+            "[TernaryOpCommand] token:'" + token +
+            "' stack:{ " + stack_to_string(operands) + " }");
+        auto rhs = std::move(operands.top()); operands.pop();
+        auto mid = std::move(operands.top()); operands.pop();
+        auto lhs = std::move(operands.top()); operands.pop();
+        auto result = m_op(std::move(lhs), mid, rhs);
+        Command<T>::log(LogLevel::Debug,
+            " -> " + std::string{result} + "\n");
+        operands.push(std::move(result));
+        return true;
+      }
+
     protected:
       const std::string m_TOKEN;
       Operation m_op;
@@ -226,6 +499,13 @@ namespace mesa
 
   // ---------------------------------------------------------------------------
   //! Consumer binary operation command
+  // Associative operations are reduced as a balanced binary tree whose
+  // subtrees are evaluated in parallel on the shared ThreadPool. This also
+  // keeps operand sizes balanced (e.g. for products) instead of repeatedly
+  // combining a large accumulator with a small operand. Subtrees of few
+  // and small values are reduced on the calling thread, where a fork would
+  // cost more than the operations it spreads. Non-associative
+  // operations fold from the top of the stack down, one operand at a time.
   template<class T> class ConsumerBinaryOpCommand : public Command<T>
   {
     public:
@@ -233,24 +513,47 @@ namespace mesa
       using Operands  = typename Command<T>::Operands;
       using Operation = std::function<T(const T& lhs, const T& rhs)>;
 
-      ConsumerBinaryOpCommand(const std::string &token, Operation op):
+      ConsumerBinaryOpCommand(const std::string &token, Operation op,
+          bool associative = false):
         m_TOKEN{token},
-        m_op{op}
+        m_op{op},
+        m_associative{associative}
       {}
 
+      bool handles(const std::string& token) const override
+      { return token == m_TOKEN; }
+
+      //! Consumes the whole stack
+      size_t arity(size_t depth) const override
+      {
+        if (depth < 2)
+          throw std::runtime_error(
+              "Consumer binary operation requires at least two operands");
+        return depth;
+      }
+
       bool execute(
           Operands &operands,
           const std::string& token) const override
       {
-        if (token != m_TOKEN)
+        if (!handles(token))
           return false;
+        arity(operands.size());
         Command<T>::log(LogLevel::Debug,
             "[ConsumerBinaryOpCommand] token:'" + token +
             "' stack:{ " + stack_to_string(operands) + " }\n");
-        if (operands.size() < 2) {
-          Command<T>::log(LogLevel::Debug, "\n");
-          throw std::runtime_error(
-              "Consumer binary operation requires at least two operands");
+        if (m_associative) {
+          // Top of stack first, to match the serial fold order
+          std::vector<Data> values;
+          values.reserve(operands.size());
+          std::vector<size_t> bytes{0}; // Of values before each index
+          bytes.reserve(operands.size() + 1);
+          while (!operands.empty()) {
+            values.push_back(std::move(operands.top())); operands.pop();
+            bytes.push_back(bytes.back() + values.back().bytes());
+          }
+          operands.push(reduce(values, bytes, 0, values.size()));
+          return true;
         }
         Data result;
         while (operands.size() > 1) {
@@ -262,7 +565,32 @@ namespace mesa
       }
 
     protected:
+      //! Reduce values in [lo, hi) as a balanced binary tree
+      // @param bytes Prefix sums of the sizes of the values
+      Data reduce(std::vector<Data>& values, const std::vector<size_t>& bytes,
+          size_t lo, size_t hi) const
+      {
+        if (hi - lo == 1)
+          return std::move(values[lo]);
+        size_t mid = lo + (hi - lo) / 2;
+        Data lhs, rhs;
+        if (hi - lo < s_FORK_VALUES && bytes[hi] - bytes[lo] < s_FORK_BYTES) {
+          lhs = reduce(values, bytes, lo, mid);
+          rhs = reduce(values, bytes, mid, hi);
+        } else {
+          ThreadPool::instance().invoke(
+              [&]{ lhs = reduce(values, bytes, lo, mid); },
+              [&]{ rhs = reduce(values, bytes, mid, hi); });
+        }
+        return m_op(lhs, rhs);
+      }
+
+      //! Fork subtrees of at least this many values or bytes
+      static constexpr size_t s_FORK_VALUES = 64;
+      static constexpr size_t s_FORK_BYTES  = 64 * 1024;
+
       const std::string m_TOKEN;
       Operation m_op;
+      const bool m_associative;
   };
 }
@@ -0,0 +1,769 @@
+#pragma once
+
+/** Fixed-width unsigned integer
+ *
+ * Operand type for Calc at a width chosen at compile time. The Bits / 64
+ * words live in a std::array, so values never touch the heap, and every limb
+ * loop has a compile-time trip count that the compiler fully unrolls.
+ * Arithmetic wraps modulo 2^Bits like the built-in unsigned types (negative
+ * literals wrap too), which is what modular arithmetic at a fixed width wants.
+ * Literals wider than Bits are rejected rather than truncated.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+#include "BigInt.h"
+#include "util.h"
+
+// -----------------------------------------------------------------------------
+
+namespace mesa {
+
+  //! FixedUInt class
+  template<size_t Bits>
+  class FixedUInt
+  {
+    static_assert(Bits >= 64 && Bits % 64 == 0,
+        "FixedUInt width must be a positive multiple of 64 bits");
+
+    public:
+      // Type aliases
+      using WordT = uint64_t;
+
+      static constexpr size_t s_WORDS = Bits / 64;
+
+      using DataT = std::array<WordT, s_WORDS>;
+
+      //! Default constructor (zero)
+      FixedUInt() noexcept:
+        m_data{}
+      {}
+
+      //! Constructor (integer)
+      // @param n Integer of any built-in integral type (negatives wrap)
+      template<class IntT, typename std::enable_if<
+        std::is_integral<IntT>::value, int>::type = 0>
+      FixedUInt(IntT n) noexcept:
+        m_data{}
+      {
+        m_data[0] = static_cast<WordT>(n);
+        if (n < IntT(0))
+          std::fill(m_data.begin() + 1, m_data.end(), ~WordT(0));
+      }
+
+      //! Constructor (string)
+      // @param s String of decimal integer digits with an optional leading
+      // '-', or of hexadecimal digits after '0x' or binary digits after '0b',
+      // which fill the words directly
+      // @throws std::invalid_argument If not numeric
+      // @throws std::out_of_range If the magnitude needs more than Bits bits
+      FixedUInt(const std::string& s):
+        m_data{}
+      {
+        if (const unsigned bits = radix_bits(s)) {
+          assign_radix(s, bits);
+          return;
+        }
+        auto first = s.begin();
+        if (first != s.end() && *first == '-')
+          ++first;
+        if (first == s.end() || std::find_if(first, s.end(),
+              [](char c) { return !std::isdigit(c); }) != s.end())
+          throw std::invalid_argument(
+              "Attempted conversion from non-numeric token '" + s + "'");
+        // Horner's rule, s_CHUNK_DIGITS digits at a time
+        while (first != s.end()) {
+          auto last = (size_t(s.end() - first) > s_CHUNK_DIGITS ?
+              first + s_CHUNK_DIGITS : s.end());
+          WordT chunk = 0, scale = 1;
+          for (; first != last; ++first) {
+            chunk = chunk * 10 + ((*first) - '0');
+            scale *= 10;
+          }
+          if (mul_word(m_data, scale, chunk) != 0)
+            throw std::out_of_range(
+                "Literal '" + s + "' exceeds " + std::to_string(Bits) +
+                " bits");
+        }
+        if (s[0] == '-')
+          negate();
+      }
+
+      //! Get underlying words (least significant first)
+      const DataT& data() const
+      { return m_data; }
+
+      //! Get size of the words in bytes
+      static constexpr size_t bytes()
+      { return sizeof(DataT); }
+
+      //! Get number of decimal digits (from the bit length, at most one over)
+      size_t digits() const
+      { return bit_length(m_data) * 30103 / 100000 + 1; }
+
+      //! Largest number of decimal digits of any value
+      static constexpr size_t maxDigits()
+      { return Bits * 30103 / 100000 + 1; }
+
+      //! Estimated size in bytes of a value with a number of decimal digits
+      static constexpr size_t bytesFor(size_t)
+      { return sizeof(DataT); }
+
+      //! Hash of the value
+      size_t hash() const
+      {
+        uint64_t h = 0;
+        for (size_t i = 0; i < s_WORDS; ++i)
+          h = (h ^ m_data[i]) * 0x9e3779b97f4a7c15ull;
+        return size_t(hash_mix(h));
+      }
+
+      //! Get in the binary format of BigInt
+      std::string serialize(bool checksum = false) const
+      { return BigInt{std::string{*this}}.serialize(checksum); }
+
+      //! Read the binary format of BigInt (negatives wrap)
+      // @throws std::invalid_argument Malformed
+      // @throws std::out_of_range If the magnitude needs more than Bits bits
+      static FixedUInt deserialize(const std::string& s)
+      { return FixedUInt{std::string{BigInt::deserialize(s)}}; }
+
+      //! Three-way comparison
+      int compare(const FixedUInt& other) const
+      {
+        for (size_t i = s_WORDS; i-- > 0;)
+          if (m_data[i] != other.m_data[i])
+            return (m_data[i] < other.m_data[i] ? -1 : 1);
+        return 0;
+      }
+
+      //! String conversion operator
+      explicit operator std::string() const
+      {
+        // Peel off s_CHUNK_DIGITS decimal digits per short division
+        DataT q = m_data;
+        std::string s;
+        do {
+          WordT chunk = div_word(q, s_CHUNK);
+          for (size_t i = 0; i < s_CHUNK_DIGITS; ++i, chunk /= 10)
+            s.push_back('0' + chunk % 10);
+        } while (!is_zero(q));
+        while (s.size() > 1 && s.back() == '0')
+          s.pop_back();
+        std::reverse(s.begin(), s.end());
+        return s;
+      }
+
+      //! Get as a string in radix 10, 16 ('0x' prefix) or 2 ('0b' prefix)
+      // Power-of-two radixes read the words directly.
+      // @throws std::invalid_argument Other radixes
+      std::string toString(unsigned radix) const
+      {
+        if (radix == 10)
+          return std::string{*this};
+        if (radix != 16 && radix != 2)
+          throw std::invalid_argument(
+              "Unsupported radix " + std::to_string(radix) +
+              " (use 2, 10 or 16)");
+        static const char digits[] = "0123456789abcdef";
+        const unsigned digitBits = (radix == 16 ? 4 : 1);
+        std::string s = (radix == 16 ? "0x" : "0b");
+        for (size_t i = s_WORDS; i-- > 0;) {
+          for (unsigned shift = 64; shift > 0;) {
+            shift -= digitBits;
+            const WordT d = (m_data[i] >> shift) & (radix - 1);
+            if (d != 0 || s.size() > 2)
+              s.push_back(digits[d]);
+          }
+        }
+        if (s.size() == 2)
+          s.push_back('0');
+        return s;
+      }
+
+      //! Addition assignment operator
+      FixedUInt& operator+=(const FixedUInt& other)
+      {
+        DWordT carry = 0;
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          carry += DWordT(m_data[i]) + other.m_data[i];
+          m_data[i] = WordT(carry);
+          carry >>= 64;
+        }
+        return *this;
+      }
+
+      //! Prefix increment operator
+      FixedUInt& operator++()
+      { return operator+=(1); }
+
+      //! Postfix increment operator
+      FixedUInt operator++(int)
+      {
+        FixedUInt temp{*this};
+        operator++();
+        return temp;
+      }
+
+      //! Subtraction assignment operator
+      FixedUInt& operator-=(const FixedUInt& other)
+      {
+        WordT borrow = 0;
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          WordT d = m_data[i] - other.m_data[i];
+          WordT b = (m_data[i] < other.m_data[i]);
+          m_data[i] = d - borrow;
+          borrow = b | (d < borrow);
+        }
+        return *this;
+      }
+
+      //! Prefix decrement operator
+      FixedUInt& operator--()
+      { return operator-=(1); }
+
+      //! Postfix decrement operator
+      FixedUInt operator--(int)
+      {
+        FixedUInt temp{*this};
+        operator--();
+        return temp;
+      }
+
+      //! Multiplication assignment operator
+      // Schoolbook, keeping only the low s_WORDS words of the product; a
+      // power of two is a shift.
+      FixedUInt& operator*=(const FixedUInt& other)
+      {
+        const size_t k = exact_log2(other.m_data);
+        if (k != Bits) {
+          shift_left(k);
+          return *this;
+        }
+        DataT r{};
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          DWordT carry = 0;
+          for (size_t j = 0; i + j < s_WORDS; ++j) {
+            carry += DWordT(m_data[i]) * other.m_data[j] + r[i + j];
+            r[i + j] = WordT(carry);
+            carry >>= 64;
+          }
+        }
+        m_data = r;
+        return *this;
+      }
+
+      //! Division assignment operator
+      // Powers of two are a shift.
+      // @throws std::invalid_argument Division by zero
+      FixedUInt& operator/=(const FixedUInt& other)
+      {
+        const size_t k = exact_log2(other.m_data);
+        if (k != Bits) {
+          shift_right(k);
+          return *this;
+        }
+        DataT q;
+        divmod(m_data, other.m_data, &q, nullptr);
+        m_data = q;
+        return *this;
+      }
+
+      //! Modulus assignment operator
+      // Powers of two are a mask.
+      // @throws std::invalid_argument Division by zero
+      FixedUInt& operator%=(const FixedUInt& other)
+      {
+        const size_t k = exact_log2(other.m_data);
+        if (k != Bits) {
+          for (size_t i = 0; i < s_WORDS; ++i)
+            m_data[i] &= (64 * i + 64 <= k ? ~WordT(0) :
+                64 * i >= k ? 0 : (WordT(1) << (k % 64)) - 1);
+          return *this;
+        }
+        DataT r;
+        divmod(m_data, other.m_data, nullptr, &r);
+        m_data = r;
+        return *this;
+      }
+
+      //! Exponentiation assignment operator (modulo 2^Bits)
+      // @throws std::domain_error 0^0
+      FixedUInt& operator^=(const FixedUInt& other)
+      {
+        if (is_zero(m_data) && is_zero(other.m_data))
+          throw std::domain_error("Result of '0^0' undefined");
+        // (2^k)^n is a single bit, or zero once k * n reaches Bits
+        const size_t k = exact_log2(m_data);
+        if (k != Bits) {
+          const size_t n = shift_count(other);
+          m_data = DataT{};
+          if (k == 0 || (n < Bits && k * n < Bits))
+            m_data[k * n / 64] = WordT(1) << (k * n % 64);
+          return *this;
+        }
+        FixedUInt base{*this}, result{1};
+        for (size_t i = bit_length(other.m_data); i-- > 0;) {
+          result = result.square();
+          if ((other.m_data[i / 64] >> (i % 64)) & 1)
+            result *= base;
+        }
+        return *this = result;
+      }
+
+      //! Left shift assignment operator (modulo 2^Bits)
+      FixedUInt& operator<<=(const FixedUInt& bits)
+      {
+        shift_left(shift_count(bits));
+        return *this;
+      }
+
+      //! Right shift assignment operator
+      FixedUInt& operator>>=(const FixedUInt& bits)
+      {
+        shift_right(shift_count(bits));
+        return *this;
+      }
+
+      //! Square (modulo 2^Bits)
+      // Cross products are computed once and doubled.
+      FixedUInt square() const
+      {
+        FixedUInt r;
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          DWordT carry = 0;
+          for (size_t j = i + 1; i + j < s_WORDS; ++j) {
+            carry += DWordT(m_data[i]) * m_data[j] + r.m_data[i + j];
+            r.m_data[i + j] = WordT(carry);
+            carry >>= 64;
+          }
+        }
+        r += r;
+        FixedUInt diagonal;
+        for (size_t i = 0; 2 * i < s_WORDS; ++i) {
+          DWordT d = DWordT(m_data[i]) * m_data[i];
+          diagonal.m_data[2 * i] = WordT(d);
+          if (2 * i + 1 < s_WORDS)
+            diagonal.m_data[2 * i + 1] = WordT(d >> 64);
+        }
+        return r += diagonal;
+      }
+
+      //! Multiply-accumulate (this += a * b, wrapping)
+      // The schoolbook rows of operator*= accumulate straight into the
+      // words of this, so the product is never materialized.
+      FixedUInt& addmul(const FixedUInt& a, const FixedUInt& b)
+      {
+        const DataT x = a.m_data, y = b.m_data; // Either may alias this
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          DWordT carry = 0;
+          for (size_t j = 0; i + j < s_WORDS; ++j) {
+            carry += DWordT(x[i]) * y[j] + m_data[i + j];
+            m_data[i + j] = WordT(carry);
+            carry >>= 64;
+          }
+        }
+        return *this;
+      }
+
+      //! Integer square root (floor)
+      FixedUInt isqrt() const
+      {
+        if (is_zero(m_data))
+          return *this;
+        // Newton's method from above, starting at 2^ceil(bits / 2)
+        FixedUInt x, y;
+        const size_t bits = (bit_length(m_data) + 1) / 2;
+        x.m_data[bits / 64] = WordT(1) << (bits % 64);
+        while (true) {
+          y = x + *this / x;
+          y.shift_right();
+          if (y >= x)
+            return x;
+          x = y;
+        }
+      }
+
+      //! Integer nth root (floor)
+      // @throws std::domain_error If n < 1
+      FixedUInt iroot(const FixedUInt& n) const
+      {
+        if (is_zero(n.m_data))
+          throw std::domain_error(
+              "Root of degree '" + std::string{n} + "' undefined");
+        // Roots of degree past the bit length are all 1 (or 0)
+        const size_t bits = bit_length(m_data);
+        if (n >= FixedUInt(bits))
+          return FixedUInt(bits == 0 ? 0 : 1);
+        const size_t k = n.m_data[0];
+        // Set result bits from the top while r^k stays within this
+        FixedUInt r;
+        for (size_t i = (bits + k - 1) / k; i-- > 0;) {
+          FixedUInt c{r};
+          c.m_data[i / 64] |= WordT(1) << (i % 64);
+          if (!power_exceeds(c, k, *this))
+            r = c;
+        }
+        return r;
+      }
+
+      //! Primality test (BigInt's Baillie-PSW)
+      bool isPrime() const
+      { return BigInt{std::string{*this}}.isPrime(); }
+
+      //! Smallest prime greater than this
+      // @throws std::out_of_range If that prime needs more than Bits bits
+      FixedUInt nextPrime() const
+      { return FixedUInt{std::string{BigInt{std::string{*this}}.nextPrime()}}; }
+
+      //! Binomial coefficient C(this, k), wrapping (BigInt's, reduced)
+      FixedUInt choose(const FixedUInt& k) const
+      {
+        BigInt r = BigInt{std::string{*this}}.choose(BigInt{std::string{k}});
+        r %= BigInt{1} << BigInt{Bits};
+        return FixedUInt{std::string{r}};
+      }
+
+      //! Fibonacci number F(this), wrapping
+      // Fast doubling over the bits of the index: F(2j) = F(j)(2F(j + 1) -
+      // F(j)) and F(2j + 1) = F(j)^2 + F(j + 1)^2, whose subtraction wraps
+      // harmlessly modulo 2^Bits, so any index takes Bits steps at most.
+      FixedUInt fibonacci() const
+      {
+        FixedUInt f, g{1}; // F(j), F(j + 1)
+        for (size_t i = bit_length(m_data); i-- > 0;) {
+          const FixedUInt even = f * (g + g - f);
+          const FixedUInt odd = f.square() + g.square();
+          if ((m_data[i / 64] >> (i % 64)) & 1) {
+            f = odd;
+            g = even + odd;
+          } else {
+            f = even;
+            g = odd;
+          }
+        }
+        return f;
+      }
+
+      //! Modular inverse in [0, m) (BigInt's)
+      // @throws std::domain_error If m is 0, or this and m share a factor
+      FixedUInt invmod(const FixedUInt& m) const
+      {
+        return FixedUInt{std::string{
+          BigInt{std::string{*this}}.invmod(BigInt{std::string{m}})}};
+      }
+
+      // -----------------------------------------------------------------------
+      // Operators are hidden friends so integer literals convert implicitly
+      // (e.g. 'n % rhs != 0'), which template argument deduction won't do.
+
+      //! Equality operator
+      friend bool operator==(const FixedUInt& lhs, const FixedUInt& rhs)
+      { return lhs.m_data == rhs.m_data; }
+
+      //! Inequality operator
+      friend bool operator!=(const FixedUInt& lhs, const FixedUInt& rhs)
+      { return !(lhs == rhs); }
+
+      //! Less-than operator
+      friend bool operator<(const FixedUInt& lhs, const FixedUInt& rhs)
+      { return lhs.compare(rhs) < 0; }
+
+      //! Greater-than operator
+      friend bool operator>(const FixedUInt& lhs, const FixedUInt& rhs)
+      { return rhs < lhs; }
+
+      //! Less-than or equal-to operator
+      friend bool operator<=(const FixedUInt& lhs, const FixedUInt& rhs)
+      { return !(lhs > rhs); }
+
+      //! Greater-than or equal-to operator
+      friend bool operator>=(const FixedUInt& lhs, const FixedUInt& rhs)
+      { return !(lhs < rhs); }
+
+      //! Binary addition
+      friend FixedUInt operator+(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs += rhs; }
+
+      //! Binary subtraction
+      friend FixedUInt operator-(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs -= rhs; }
+
+      //! Binary multiplication
+      friend FixedUInt operator*(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs *= rhs; }
+
+      //! Binary division
+      friend FixedUInt operator/(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs /= rhs; }
+
+      //! Binary modulus
+      friend FixedUInt operator%(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs %= rhs; }
+
+      //! Binary exponentiation
+      friend FixedUInt operator^(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs ^= rhs; }
+
+      //! Left shift (modulo 2^Bits)
+      friend FixedUInt operator<<(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs <<= rhs; }
+
+      //! Right shift
+      friend FixedUInt operator>>(FixedUInt lhs, const FixedUInt& rhs)
+      { return lhs >>= rhs; }
+
+      //! Insertion operator
+      friend std::ostream& operator<<(std::ostream& os, const FixedUInt& rhs)
+      { return (os << std::string{rhs}); }
+
+    private:
+      __extension__ typedef unsigned __int128 DWordT;
+
+      // Largest power of ten that fits a word
+      static constexpr WordT  s_CHUNK        = 10000000000000000000ull;
+      static constexpr size_t s_CHUNK_DIGITS = 19;
+
+      DataT m_data; // Words, least significant first
+
+      //! Get if zero
+      static bool is_zero(const DataT& x)
+      {
+        for (size_t i = 0; i < s_WORDS; ++i)
+          if (x[i] != 0)
+            return false;
+        return true;
+      }
+
+      //! Number of significant words
+      static size_t word_length(const DataT& x)
+      {
+        size_t n = s_WORDS;
+        while (n > 0 && x[n - 1] == 0)
+          --n;
+        return n;
+      }
+
+      //! Number of significant bits
+      static size_t bit_length(const DataT& x)
+      {
+        size_t n = word_length(x);
+        return (n == 0 ? 0 : 64 * n - __builtin_clzll(x[n - 1]));
+      }
+
+      //! Set from a '0x' or '0b' literal, bits per digit at a time
+      // @throws std::out_of_range If the magnitude needs more than Bits bits
+      void assign_radix(const std::string& s, unsigned bits)
+      {
+        // Digits follow the optional '-' and the '0x' or '0b' prefix
+        const size_t first = (s[0] == '-') + 2;
+        size_t shift = 0;
+        for (size_t i = s.size(); i > first; --i) {
+          const char c = s[i - 1];
+          const WordT d = WordT(c >= 'a' ? c - 'a' + 10 :
+              c >= 'A' ? c - 'A' + 10 : c - '0');
+          if (d != 0 && shift >= Bits)
+            throw std::out_of_range(
+                "Literal '" + s.substr(0, 32) +
+                (s.size() > 32 ? "...'" : "'") + " exceeds " +
+                std::to_string(Bits) + " bits");
+          if (d != 0)
+            m_data[shift / 64] |= d << (shift % 64);
+          shift += bits;
+        }
+        if (s[0] == '-')
+          negate();
+      }
+
+      //! Two's complement negation (modulo 2^Bits)
+      void negate()
+      {
+        for (auto& word: m_data)
+          word = ~word;
+        operator++();
+      }
+
+      //! Get shift count, saturated at Bits
+      static size_t shift_count(const FixedUInt& bits)
+      {
+        return (word_length(bits.m_data) > 1 || bits.m_data[0] >= Bits ?
+            Bits : size_t(bits.m_data[0]));
+      }
+
+      //! Get k if x is 2^k, else Bits
+      static size_t exact_log2(const DataT& x)
+      {
+        size_t k = Bits;
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          if (x[i] == 0)
+            continue;
+          if (k != Bits || (x[i] & (x[i] - 1)) != 0)
+            return Bits;
+          k = 64 * i + __builtin_ctzll(x[i]);
+        }
+        return k;
+      }
+
+      //! Shift left in place (to zero at n >= Bits)
+      void shift_left(size_t n)
+      {
+        const size_t words = n / 64, bits = n % 64;
+        for (size_t i = s_WORDS; i-- > 0;) {
+          WordT word = (i >= words ? m_data[i - words] << bits : 0);
+          if (bits != 0 && i > words)
+            word |= m_data[i - words - 1] >> (64 - bits);
+          m_data[i] = word;
+        }
+      }
+
+      //! Shift right in place (to zero at n >= Bits)
+      void shift_right(size_t n)
+      {
+        const size_t words = n / 64, bits = n % 64;
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          WordT word = (i + words < s_WORDS ? m_data[i + words] >> bits : 0);
+          if (bits != 0 && i + words + 1 < s_WORDS)
+            word |= m_data[i + words + 1] << (64 - bits);
+          m_data[i] = word;
+        }
+      }
+
+      //! Halve in place
+      void shift_right()
+      {
+        for (size_t i = 0; i + 1 < s_WORDS; ++i)
+          m_data[i] = (m_data[i] >> 1) | (m_data[i + 1] << 63);
+        m_data[s_WORDS - 1] >>= 1;
+      }
+
+      //! x = x * m + a
+      // @return Word carried out of the most significant word
+      static WordT mul_word(DataT& x, WordT m, WordT a)
+      {
+        DWordT carry = a;
+        for (size_t i = 0; i < s_WORDS; ++i) {
+          carry += DWordT(x[i]) * m;
+          x[i] = WordT(carry);
+          carry >>= 64;
+        }
+        return WordT(carry);
+      }
+
+      //! x = x / d (d > 0)
+      // @return Remainder
+      static WordT div_word(DataT& x, WordT d)
+      {
+        DWordT r = 0;
+        for (size_t i = s_WORDS; i-- > 0;) {
+          r = (r << 64) | x[i];
+          x[i] = WordT(r / d);
+          r %= d;
+        }
+        return WordT(r);
+      }
+
+      //! Get if c^k > limit (also when c^k needs more than Bits bits)
+      static bool power_exceeds(const FixedUInt& c, size_t k,
+          const FixedUInt& limit)
+      {
+        FixedUInt p{1};
+        for (size_t i = 0; i < k; ++i) {
+          if (c > FixedUInt(-1) / p)
+            return true;
+          p *= c;
+          if (p > limit)
+            return true;
+        }
+        return false;
+      }
+
+      //! Long division over words (Knuth, Algorithm D)
+      // @param q Quotient output (may be null)
+      // @param r Remainder output (may be null)
+      // @throws std::invalid_argument Division by zero
+      static void divmod(const DataT& u, const DataT& v, DataT* q, DataT* r)
+      {
+        const size_t n = word_length(v), m = word_length(u);
+        if (n == 0)
+          throw std::invalid_argument("Division by zero");
+        DataT quotient{};
+        if (m < n) {
+          if (q) *q = quotient;
+          if (r) *r = u;
+          return;
+        }
+        if (n == 1) {
+          DataT x = u;
+          WordT rem = div_word(x, v[0]);
+          if (q) *q = x;
+          if (r) { *r = DataT{}; (*r)[0] = rem; }
+          return;
+        }
+        // Normalize so the top divisor word has its high bit set
+        const unsigned s = __builtin_clzll(v[n - 1]);
+        std::array<WordT, s_WORDS> vn{};
+        std::array<WordT, s_WORDS + 1> un{};
+        for (size_t i = n; i-- > 0;)
+          vn[i] = (v[i] << s) | (s && i ? v[i - 1] >> (64 - s) : 0);
+        un[m] = (s ? u[m - 1] >> (64 - s) : 0);
+        for (size_t i = m; i-- > 0;)
+          un[i] = (u[i] << s) | (s && i ? u[i - 1] >> (64 - s) : 0);
+        for (size_t j = m - n + 1; j-- > 0;) {
+          // Estimate the quotient word from the top two words
+          DWordT num = (DWordT(un[j + n]) << 64) | un[j + n - 1];
+          DWordT qhat = num / vn[n - 1];
+          DWordT rhat = num % vn[n - 1];
+          while ((qhat >> 64) != 0 ||
+              qhat * vn[n - 2] > ((rhat << 64) | un[j + n - 2])) {
+            --qhat;
+            rhat += vn[n - 1];
+            if ((rhat >> 64) != 0)
+              break;
+          }
+          // Multiply and subtract
+          WordT borrow = 0;
+          DWordT carry = 0;
+          for (size_t i = 0; i < n; ++i) {
+            carry += qhat * vn[i];
+            WordT p = WordT(carry);
+            carry >>= 64;
+            WordT d = un[i + j] - p;
+            WordT b = (un[i + j] < p);
+            un[i + j] = d - borrow;
+            borrow = b + (d < borrow);
+          }
+          WordT top = WordT(carry);
+          WordT d = un[j + n] - top;
+          WordT b = (un[j + n] < top) + (d < borrow);
+          un[j + n] = d - borrow;
+          // Estimate was one too large: add back
+          if (b != 0) {
+            --qhat;
+            DWordT c = 0;
+            for (size_t i = 0; i < n; ++i) {
+              c += DWordT(un[i + j]) + vn[i];
+              un[i + j] = WordT(c);
+              c >>= 64;
+            }
+            un[j + n] += WordT(c);
+          }
+          quotient[j] = WordT(qhat);
+        }
+        if (q) *q = quotient;
+        if (r) {
+          DataT rem{};
+          for (size_t i = 0; i < n; ++i)
+            rem[i] = (un[i] >> s) | (s ? un[i + 1] << (64 - s) : 0);
+          *r = rem;
+        }
+      }
+  };
+}
+
+// -----------------------------------------------------------------------------
@@ -0,0 +1,186 @@
+/** Self-checking tests for FixedUInt
+ *
+ * Seeded random values at 128, 256 and 512 bits are checked against BigInt
+ * reduced modulo 2^Bits, across operand word counts so that every shape of
+ * Knuth division and every power-of-two fast path is taken. See Test.h.
+ *
+ * ```
+ * make test
+ * ```
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "BigInt.h"
+#include "FixedUInt.h"
+#include "Test.h"
+
+using mesa::BigInt;
+using mesa::test::check;
+using mesa::test::check_throws;
+
+//! 2^Bits
+template<size_t Bits> BigInt modulus()
+{ return BigInt{1} << BigInt{Bits}; }
+
+//! Reduce modulo 2^Bits into [0, 2^Bits)
+template<size_t Bits> BigInt wrap(const BigInt& x)
+{
+  BigInt r = x % modulus<Bits>();
+  if (r.negative())
+    r += modulus<Bits>();
+  return r;
+}
+
+//! Value of a FixedUInt as a BigInt
+template<size_t Bits> BigInt value(const mesa::FixedUInt<Bits>& x)
+{ return BigInt{std::string{x}}; }
+
+//! Check a result against a BigInt reduced modulo 2^Bits
+template<size_t Bits> void check_wraps(const mesa::FixedUInt<Bits>& x,
+    const BigInt& expected, const std::string& what)
+{
+  const BigInt wrapped = wrap<Bits>(expected);
+  check(value(x) == wrapped, std::to_string(Bits) + " bits: " + what +
+      " is " + std::string{x} + ", expected " + std::string{wrapped});
+}
+
+//! Random value of 1 to 'words' words, the top one nonzero and of random
+// length
+template<size_t Bits> mesa::FixedUInt<Bits> random_fixed(
+    std::mt19937_64& rng, size_t words)
+{
+  const uint64_t top = rng();
+  std::ostringstream hex;
+  hex << "0x" << std::hex << std::max<uint64_t>(top >> rng() % 64, 1);
+  for (size_t i = 1; i < words; ++i)
+    hex << std::setw(16) << std::setfill('0') << rng();
+  return mesa::FixedUInt<Bits>{hex.str()};
+}
+
+// -----------------------------------------------------------------------------
+
+//! Literals: negatives wrap, wider ones are rejected, radixes round trip
+template<size_t Bits> void test_literals(std::mt19937_64& rng)
+{
+  using Fixed = mesa::FixedUInt<Bits>;
+  const std::string width = std::to_string(Bits) + " bits: ";
+  const BigInt max = modulus<Bits>() - BigInt{1};
+  check_wraps(Fixed{"-1"}, BigInt{-1}, "-1");
+  check_wraps(Fixed{-5}, BigInt{-5}, "Integer -5");
+  check_wraps(Fixed{std::string{max}}, max, "2^Bits - 1");
+  check_wraps(Fixed{"-" + std::string{max}}, BigInt{1}, "-(2^Bits - 1)");
+  check_wraps(Fixed{"0x" + std::string(Bits / 4 + 8, '0') + "1"}, BigInt{1},
+      "Hexadecimal with leading zeros");
+  for (int i = 0; i < 20; ++i) {
+    const Fixed x = random_fixed<Bits>(rng, 1 + rng() % Fixed::s_WORDS);
+    check_wraps(Fixed{"-" + std::string{x}}, BigInt{} - value(x),
+        "Negative literal");
+    check(Fixed{x.toString(16)} == x && Fixed{x.toString(2)} == x,
+        width + std::string{x} + " through hexadecimal and binary");
+    check(x.toString(16) == value(x).toString(16),
+        width + std::string{x} + " in hexadecimal as BigInt");
+  }
+  check_throws<std::out_of_range>(
+      [&]{ Fixed{std::string{modulus<Bits>()}}; }, width + "2^Bits");
+  check_throws<std::out_of_range>(
+      [&]{ Fixed{"-" + std::string{modulus<Bits>()}}; }, width + "-2^Bits");
+  check_throws<std::out_of_range>(
+      [&]{ Fixed{"0x1" + std::string(Bits / 4, '0')}; },
+      width + "Hexadecimal 2^Bits");
+  check_throws<std::out_of_range>(
+      [&]{ Fixed{"0b1" + std::string(Bits, '0')}; },
+      width + "Binary 2^Bits");
+  check_throws<std::invalid_argument>([]{ Fixed{"12a"}; }, width + "12a");
+}
+
+//! Arithmetic, and Knuth division for every pair of word counts
+template<size_t Bits> void test_arithmetic(std::mt19937_64& rng)
+{
+  using Fixed = mesa::FixedUInt<Bits>;
+  for (size_t m = 1; m <= Fixed::s_WORDS; ++m) {
+    for (size_t n = 1; n <= Fixed::s_WORDS; ++n) {
+      const std::string words = " of " + std::to_string(m) + " by " +
+        std::to_string(n) + " words";
+      for (int i = 0; i < 4; ++i) {
+        const Fixed a = random_fixed<Bits>(rng, m);
+        const Fixed b = random_fixed<Bits>(rng, n);
+        check_wraps(a + b, value(a) + value(b), "Sum" + words);
+        check_wraps(a - b, value(a) - value(b), "Difference" + words);
+        check_wraps(a * b, value(a) * value(b), "Product" + words);
+        check_wraps(a / b, value(a) / value(b), "Quotient" + words);
+        check_wraps(a % b, value(a) % value(b), "Remainder" + words);
+      }
+    }
+  }
+  check_throws<std::invalid_argument>([]{ Fixed{1} / Fixed{0}; },
+      std::to_string(Bits) + " bits: 1 / 0");
+}
+
+//! Floors of square and higher roots
+template<size_t Bits> void test_roots(std::mt19937_64& rng)
+{
+  using Fixed = mesa::FixedUInt<Bits>;
+  for (size_t words = 1; words <= Fixed::s_WORDS; ++words) {
+    for (int i = 0; i < 4; ++i) {
+      const Fixed a = random_fixed<Bits>(rng, words);
+      const BigInt r = value(a.isqrt());
+      check(r * r <= value(a) && value(a) < (r + BigInt{1}).square(),
+          std::to_string(Bits) + " bits: isqrt(" + std::string{a} + ")");
+      for (unsigned n: {2u, 3u, 5u, 64u}) {
+        check_wraps(a.iroot(n), value(a).iroot(n),
+            "Root " + std::to_string(n) + " of " + std::string{a});
+      }
+    }
+  }
+  check_wraps(Fixed{0}.isqrt(), BigInt{0}, "isqrt(0)");
+  check_wraps(Fixed{-1}.iroot(Bits), BigInt{1}, "Root Bits of 2^Bits - 1");
+  check_throws<std::domain_error>([]{ Fixed{8}.iroot(Fixed{0}); },
+      std::to_string(Bits) + " bits: Root 0");
+}
+
+//! Multiplication, division and modulus by 2^k, and powers of 2^k
+template<size_t Bits> void test_powers_of_two(std::mt19937_64& rng)
+{
+  using Fixed = mesa::FixedUInt<Bits>;
+  for (int i = 0; i < 20; ++i) {
+    const Fixed a = random_fixed<Bits>(rng, 1 + rng() % Fixed::s_WORDS);
+    const size_t k = (i == 0 ? 0 : i == 1 ? Bits - 1 : rng() % Bits);
+    const Fixed p = Fixed{1} << Fixed{k};
+    const BigInt q = BigInt{1} << BigInt{k};
+    const std::string by = " by 2^" + std::to_string(k);
+    check_wraps(a * p, value(a) * q, "Product" + by);
+    check_wraps(a / p, value(a) / q, "Quotient" + by);
+    check_wraps(a % p, value(a) % q, "Remainder" + by);
+    const size_t n = rng() % (Bits + 8);
+    check_wraps(p ^ Fixed{n}, q ^ BigInt{n},
+        "2^" + std::to_string(k) + " to the " + std::to_string(n));
+  }
+  check_throws<std::domain_error>([]{ Fixed{0} ^ Fixed{0}; },
+      std::to_string(Bits) + " bits: 0^0");
+}
+
+template<size_t Bits> void test_width(std::mt19937_64& rng)
+{
+  test_literals<Bits>(rng);
+  test_arithmetic<Bits>(rng);
+  test_roots<Bits>(rng);
+  test_powers_of_two<Bits>(rng);
+}
+
+// -----------------------------------------------------------------------------
+
+int main()
+{
+  std::mt19937_64 rng{1};
+  test_width<128>(rng);
+  test_width<256>(rng);
+  test_width<512>(rng);
+  return mesa::test::report();
+}
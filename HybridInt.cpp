@@ -0,0 +1,377 @@
+/* HybridInt.cpp
+ *
+ * Every operator tries the inline 64-bit path first and falls back to the
+ * equivalent BigInt operator ("slow" path) on overflow or when either operand
+ * is already promoted.
+ */
+
+#include "HybridInt.h"
+#include "util.h"
+
+using mesa::BigInt;
+using mesa::HybridInt;
+
+// -----------------------------------------------------------------------------
+// HybridInt
+// Private non-static member definitions
+// -----------------------------------------------------------------------------
+
+void HybridInt::assign(BigInt&& n)
+{
+  // At most 3 limbs (< 10^27) may still fit in 64 bits
+  const auto& limbs = n.data();
+  if (limbs.size() <= 3) {
+    __extension__ typedef unsigned __int128 Magnitude;
+    Magnitude magnitude = 0;
+    for (size_t i = limbs.size(); i-- > 0;)
+      magnitude = magnitude * BigInt::s_BASE + limbs[i];
+    const Magnitude limit = Magnitude(std::numeric_limits<SmallT>::max()) +
+      n.negative();
+    if (magnitude <= limit) {
+      reset();
+      m_small = (n.negative() ?
+          SmallT(0 - static_cast<uint64_t>(magnitude)) :
+          SmallT(magnitude));
+      return;
+    }
+  }
+  if (m_isBig) {
+    m_big = std::move(n);
+  } else {
+    new (&m_big) BigInt{std::move(n)};
+    m_isBig = true;
+  }
+}
+
+void HybridInt::promote()
+{
+  if (m_isBig)
+    return;
+  SmallT n = m_small;
+  new (&m_big) BigInt{n};
+  m_isBig = true;
+}
+
+template<class Op>
+HybridInt& HybridInt::slow(const HybridInt& other, Op op)
+{
+  // Promoting may change other too, if it aliases this
+  promote();
+  if (other.m_isBig) {
+    op(m_big, other.m_big);
+  } else {
+    op(m_big, BigInt{other.m_small});
+  }
+  BigInt result{std::move(m_big)};
+  assign(std::move(result));
+  return *this;
+}
+
+// -----------------------------------------------------------------------------
+// HybridInt
+// Public non-static member definitions
+// -----------------------------------------------------------------------------
+
+HybridInt::HybridInt(const BigInt& n):
+  m_isBig{false},
+  m_small{0}
+{
+  assign(BigInt{n});
+}
+
+HybridInt::HybridInt(BigInt&& n):
+  m_isBig{false},
+  m_small{0}
+{
+  assign(std::move(n));
+}
+
+HybridInt::HybridInt(const std::string& s):
+  m_isBig{false},
+  m_small{0}
+{
+  // Up to 18 digits always fit inline
+  const size_t digits = s.size() - (!s.empty() && s[0] == '-');
+  if (digits > 0 && digits <= 18 && mesa::is_numeric(s))
+    m_small = std::stoll(s);
+  else
+    assign(BigInt{s});
+}
+
+HybridInt::HybridInt(const HybridInt& other):
+  m_isBig{false},
+  m_small{other.m_isBig ? 0 : other.m_small}
+{
+  if (other.m_isBig) {
+    new (&m_big) BigInt{other.m_big};
+    m_isBig = true;
+  }
+}
+
+HybridInt::HybridInt(HybridInt&& other) noexcept:
+  m_isBig{false},
+  m_small{other.m_isBig ? 0 : other.m_small}
+{
+  if (other.m_isBig) {
+    new (&m_big) BigInt{std::move(other.m_big)};
+    m_isBig = true;
+  }
+}
+
+HybridInt& HybridInt::operator=(const HybridInt& other)
+{
+  if (this == &other)
+    return *this;
+  if (other.m_isBig) {
+    if (m_isBig) {
+      m_big = other.m_big;
+    } else {
+      new (&m_big) BigInt{other.m_big};
+      m_isBig = true;
+    }
+  } else {
+    reset();
+    m_small = other.m_small;
+  }
+  return *this;
+}
+
+HybridInt& HybridInt::operator=(HybridInt&& other) noexcept
+{
+  if (this == &other)
+    return *this;
+  if (other.m_isBig) {
+    if (m_isBig) {
+      m_big = std::move(other.m_big);
+    } else {
+      new (&m_big) BigInt{std::move(other.m_big)};
+      m_isBig = true;
+    }
+  } else {
+    reset();
+    m_small = other.m_small;
+  }
+  return *this;
+}
+
+size_t HybridInt::digits() const
+{
+  if (m_isBig)
+    return m_big.digits();
+  // Magnitude as unsigned, so INT64_MIN negates safely
+  uint64_t n = (m_small < 0 ? 0 - uint64_t(m_small) : uint64_t(m_small));
+  size_t count = 1;
+  for (; n >= 10; n /= 10)
+    ++count;
+  return count;
+}
+
+size_t HybridInt::hash() const
+{
+  return (m_isBig ? m_big.hash() :
+      size_t(mesa::hash_mix(static_cast<uint64_t>(m_small))));
+}
+
+int HybridInt::compare(const HybridInt& other) const
+{
+  if (!m_isBig && !other.m_isBig)
+    return (m_small < other.m_small ? -1 : m_small > other.m_small);
+  // A promoted value is always outside the inline range
+  if (!m_isBig)
+    return (other.m_big.negative() ? 1 : -1);
+  if (!other.m_isBig)
+    return (m_big.negative() ? -1 : 1);
+  return m_big.compare(other.m_big);
+}
+
+HybridInt& HybridInt::operator+=(const HybridInt& other)
+{
+  SmallT r;
+  if (!m_isBig && !other.m_isBig &&
+      !__builtin_add_overflow(m_small, other.m_small, &r)) {
+    m_small = r;
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs += rhs; });
+}
+
+HybridInt& HybridInt::operator-=(const HybridInt& other)
+{
+  SmallT r;
+  if (!m_isBig && !other.m_isBig &&
+      !__builtin_sub_overflow(m_small, other.m_small, &r)) {
+    m_small = r;
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs -= rhs; });
+}
+
+HybridInt& HybridInt::operator*=(const HybridInt& other)
+{
+  SmallT r;
+  if (!m_isBig && !other.m_isBig &&
+      !__builtin_mul_overflow(m_small, other.m_small, &r)) {
+    m_small = r;
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs *= rhs; });
+}
+
+HybridInt& HybridInt::operator/=(const HybridInt& other)
+{
+  // Only INT64_MIN / -1 overflows; division by zero throws from BigInt
+  if (!m_isBig && !other.m_isBig && other.m_small != 0 &&
+      !(other.m_small == -1 &&
+        m_small == std::numeric_limits<SmallT>::min())) {
+    m_small /= other.m_small;
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs /= rhs; });
+}
+
+HybridInt& HybridInt::operator%=(const HybridInt& other)
+{
+  if (!m_isBig && !other.m_isBig && other.m_small != 0) {
+    m_small = (other.m_small == -1 ? 0 : m_small % other.m_small);
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs %= rhs; });
+}
+
+HybridInt& HybridInt::operator^=(const HybridInt& other)
+{
+  // Exponentiation by squaring while nothing overflows; 0^0 and negative
+  // exponents are left to BigInt to report
+  if (!m_isBig && !other.m_isBig && other.m_small >= 0 &&
+      !(m_small == 0 && other.m_small == 0)) {
+    SmallT base = m_small, result = 1;
+    bool overflow = false;
+    for (SmallT n = other.m_small; n != 0 && !overflow; n /= 2) {
+      if (n % 2 == 1)
+        overflow = __builtin_mul_overflow(result, base, &result);
+      if (n > 1 && !overflow)
+        overflow = __builtin_mul_overflow(base, base, &base);
+    }
+    if (!overflow) {
+      m_small = result;
+      return *this;
+    }
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs ^= rhs; });
+}
+
+HybridInt& HybridInt::operator<<=(const HybridInt& other)
+{
+  // Inline while the product with 2^bits doesn't overflow; negative counts
+  // are left to BigInt to report
+  SmallT r;
+  if (!m_isBig && !other.m_isBig && other.m_small >= 0 &&
+      other.m_small < 63 &&
+      !__builtin_mul_overflow(m_small, SmallT(1) << other.m_small, &r)) {
+    m_small = r;
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs <<= rhs; });
+}
+
+HybridInt& HybridInt::operator>>=(const HybridInt& other)
+{
+  // Floor: negative values shift their (non-negative) complement
+  if (!m_isBig && !other.m_isBig && other.m_small >= 0) {
+    const SmallT n = std::min<SmallT>(other.m_small, 63);
+    m_small = (m_small < 0 ? ~(~m_small >> n) : m_small >> n);
+    return *this;
+  }
+  return slow(other, [](BigInt& lhs, const BigInt& rhs) { lhs >>= rhs; });
+}
+
+HybridInt HybridInt::square() const
+{
+  SmallT r;
+  if (!m_isBig && !__builtin_mul_overflow(m_small, m_small, &r))
+    return HybridInt{r};
+  return HybridInt{toBigInt().square()};
+}
+
+HybridInt& HybridInt::addmul(const HybridInt& a, const HybridInt& b)
+{
+  SmallT p, r;
+  if (!m_isBig && !a.m_isBig && !b.m_isBig &&
+      !__builtin_mul_overflow(a.m_small, b.m_small, &p) &&
+      !__builtin_add_overflow(m_small, p, &r)) {
+    m_small = r;
+    return *this;
+  }
+  // Copy the operands first (sharing limbs), as they may alias this
+  const BigInt x = a.toBigInt(), y = b.toBigInt();
+  promote();
+  m_big.addmul(x, y);
+  BigInt result{std::move(m_big)};
+  assign(std::move(result));
+  return *this;
+}
+
+HybridInt HybridInt::choose(const HybridInt& k) const
+{
+  // C(n - m + i, i) = C(n - m + i - 1, i - 1) (n - m + i) / i is exact, and
+  // the product of two values that fit takes at most 126 bits; negative n
+  // is left to BigInt to report
+  if (!m_isBig && !k.m_isBig && m_small >= 0) {
+    if (k.m_small < 0 || k.m_small > m_small)
+      return 0;
+    __extension__ typedef __int128 Wide;
+    const Wide max = std::numeric_limits<SmallT>::max();
+    const SmallT m = std::min(k.m_small, m_small - k.m_small);
+    Wide r = 1;
+    for (SmallT i = 1; i <= m && r <= max; ++i)
+      r = r * (m_small - m + i) / i;
+    if (r <= max)
+      return HybridInt{SmallT(r)};
+  }
+  return HybridInt{toBigInt().choose(k.toBigInt())};
+}
+
+HybridInt HybridInt::fibonacci() const
+{
+  if (!m_isBig && m_small >= -92 && m_small <= 92) {
+    // F(93) still fits unsigned
+    const SmallT n = (m_small < 0 ? -m_small : m_small);
+    uint64_t f = 0, g = 1;
+    for (SmallT i = 0; i < n; ++i) {
+      g += f;
+      std::swap(f, g);
+    }
+    // F(-n) = (-1)^(n + 1) F(n)
+    return HybridInt{(m_small < 0 && n % 2 == 0 ? -SmallT(f) : SmallT(f))};
+  }
+  return HybridInt{toBigInt().fibonacci()};
+}
+
+HybridInt HybridInt::invmod(const HybridInt& m) const
+{
+  // Cofactors stay within (-m, m); errors are left to BigInt to report
+  if (!m_isBig && !m.m_isBig && m.m_small > 0) {
+    SmallT r0 = m.m_small, r1 = m_small % m.m_small, t0 = 0, t1 = 1;
+    if (r1 < 0)
+      r1 += m.m_small;
+    while (r1 != 0) {
+      const SmallT q = r0 / r1;
+      r0 -= q * r1;
+      t0 -= q * t1;
+      std::swap(r0, r1);
+      std::swap(t0, t1);
+    }
+    if (r0 == 1)
+      return HybridInt{(t0 < 0 ? t0 + m.m_small : t0)};
+  }
+  return HybridInt{toBigInt().invmod(m.toBigInt())};
+}
+
+// -----------------------------------------------------------------------------
+// External definitions
+// -----------------------------------------------------------------------------
+
+std::ostream& operator<<(std::ostream& os, const HybridInt& rhs)
+{
+  return (os << std::string{rhs});
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+/** Hybrid small/big integer
+ *
+ * Operand type for Calc: values that fit in a 64-bit signed integer are
+ * stored inline and computed with native instructions (checked with the
+ * __builtin_*_overflow intrinsics). Only results that overflow are promoted to
+ * a heap-allocated BigInt, and BigInt results that fit are demoted again, so
+ * small numbers stay on the fast path even after a detour through a large
+ * intermediate.
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+#include "BigInt.h"
+
+// -----------------------------------------------------------------------------
+
+namespace mesa {
+
+  //! HybridInt class
+  class HybridInt
+  {
+    public:
+      // Type aliases
+      using SmallT = int64_t;
+
+      //! Default constructor (zero)
+      HybridInt() noexcept:
+        m_isBig{false},
+        m_small{0}
+      {}
+
+      //! Constructor (integer)
+      // @param n Integer of any built-in integral type
+      template<class IntT, typename std::enable_if<
+        std::is_integral<IntT>::value, int>::type = 0>
+      HybridInt(IntT n):
+        m_isBig{false},
+        m_small{0}
+      {
+        if (fits(n))
+          m_small = static_cast<SmallT>(n);
+        else
+          assign(BigInt{n});
+      }
+
+      //! Constructor (BigInt), demotes if possible
+      HybridInt(const BigInt& n);
+
+      //! Constructor (BigInt), demotes if possible
+      HybridInt(BigInt&& n);
+
+      //! Constructor (string)
+      // @param s String of decimal integer digits with an optional leading
+      // '-', or a '0x' or '0b' literal (see BigInt)
+      // @throws Invalid argument exception
+      HybridInt(const std::string& s);
+
+      //! Copy constructor
+      HybridInt(const HybridInt& other);
+
+      //! Move constructor
+      HybridInt(HybridInt&& other) noexcept;
+
+      //! Destructor
+      ~HybridInt()
+      { reset(); }
+
+      //! Copy assignment operator
+      HybridInt& operator=(const HybridInt& other);
+
+      //! Move assignment operator
+      HybridInt& operator=(HybridInt&& other) noexcept;
+
+      //! Get if stored inline
+      bool isSmall() const
+      { return !m_isBig; }
+
+      //! Get inline value (requires isSmall())
+      SmallT small() const
+      { return m_small; }
+
+      //! Get promoted value (requires !isSmall())
+      const BigInt& big() const
+      { return m_big; }
+
+      //! Get value as BigInt
+      BigInt toBigInt() const
+      { return (m_isBig ? m_big : BigInt{m_small}); }
+
+      //! Get if negative
+      bool negative() const
+      { return (m_isBig ? m_big.negative() : m_small < 0); }
+
+      //! Get size of the value in bytes
+      size_t bytes() const
+      { return (m_isBig ? m_big.bytes() : sizeof(SmallT)); }
+
+      //! Get number of decimal digits of the magnitude
+      size_t digits() const;
+
+      //! Largest number of decimal digits of any value (unbounded)
+      static constexpr size_t maxDigits()
+      { return BigInt::maxDigits(); }
+
+      //! Estimated size in bytes of a value with a number of decimal digits
+      static size_t bytesFor(size_t digits)
+      {
+        return (digits < std::numeric_limits<SmallT>::digits10 ?
+            sizeof(SmallT) : BigInt::bytesFor(digits));
+      }
+
+      //! Hash of the value
+      size_t hash() const;
+
+      //! Get in the binary format of BigInt
+      std::string serialize(bool checksum = false) const
+      { return toBigInt().serialize(checksum); }
+
+      //! Read the binary format of BigInt, demoting if possible
+      // @throws std::invalid_argument Malformed
+      static HybridInt deserialize(const std::string& s)
+      { return HybridInt{BigInt::deserialize(s)}; }
+
+      //! Three-way comparison
+      int compare(const HybridInt& other) const;
+
+      //! String conversion operator
+      explicit operator std::string() const
+      { return (m_isBig ? std::string{m_big} : std::to_string(m_small)); }
+
+      //! Get as a string in radix 10, 16 ('0x' prefix) or 2 ('0b' prefix)
+      // @throws std::invalid_argument Other radixes
+      std::string toString(unsigned radix) const
+      {
+        return (radix == 10 ? std::string{*this} :
+            toBigInt().toString(radix));
+      }
+
+      //! Addition assignment operator
+      HybridInt& operator+=(const HybridInt& other);
+
+      //! Prefix increment operator
+      HybridInt& operator++()
+      { return operator+=(1); }
+
+      //! Postfix increment operator
+      HybridInt operator++(int)
+      {
+        HybridInt temp{*this};
+        operator++();
+        return temp;
+      }
+
+      //! Subtraction assignment operator
+      HybridInt& operator-=(const HybridInt& other);
+
+      //! Prefix decrement operator
+      HybridInt& operator--()
+      { return operator-=(1); }
+
+      //! Postfix decrement operator
+      HybridInt operator--(int)
+      {
+        HybridInt temp{*this};
+        operator--();
+        return temp;
+      }
+
+      //! Multiplication assignment operator
+      HybridInt& operator*=(const HybridInt& other);
+
+      //! Division assignment operator
+      HybridInt& operator/=(const HybridInt& other);
+
+      //! Modulus assignment operator
+      HybridInt& operator%=(const HybridInt& other);
+
+      //! Exponentiation assignment operator
+      HybridInt& operator^=(const HybridInt& other);
+
+      //! Left shift assignment operator (multiplication by 2^bits)
+      HybridInt& operator<<=(const HybridInt& bits);
+
+      //! Right shift assignment operator (division by 2^bits, floored)
+      HybridInt& operator>>=(const HybridInt& bits);
+
+      //! Square
+      HybridInt square() const;
+
+      //! Multiply-accumulate (this += a * b)
+      // Inline while neither the product nor the sum overflows, else the
+      // BigInt kernel accumulates into the promoted value.
+      HybridInt& addmul(const HybridInt& a, const HybridInt& b);
+
+      //! Integer square root (floor)
+      HybridInt isqrt() const
+      { return HybridInt{toBigInt().isqrt()}; }
+
+      //! Integer nth root (truncated toward zero)
+      HybridInt iroot(const HybridInt& n) const
+      { return HybridInt{toBigInt().iroot(n.toBigInt())}; }
+
+      //! Primality test
+      bool isPrime() const
+      { return !negative() && toBigInt().isPrime(); }
+
+      //! Smallest prime greater than this
+      HybridInt nextPrime() const
+      { return HybridInt{toBigInt().nextPrime()}; }
+
+      //! Binomial coefficient C(this, k)
+      // Inline while the running product fits, else BigInt's
+      HybridInt choose(const HybridInt& k) const;
+
+      //! Fibonacci number F(this)
+      // Inline up to F(92), the largest that fits, else BigInt's
+      HybridInt fibonacci() const;
+
+      //! Modular inverse in [0, m)
+      // Inline extended Euclid while both fit, else BigInt's
+      HybridInt invmod(const HybridInt& m) const;
+
+    private:
+      bool m_isBig;
+      union
+      {
+        SmallT m_small;
+        BigInt m_big;
+      };
+
+      //! Get if an integer fits inline
+      template<class IntT>
+      static bool fits(IntT n)
+      {
+        // Built-in signed types are at most 64 bits wide
+        return std::is_signed<IntT>::value ||
+          static_cast<unsigned long long>(n) <= static_cast<unsigned long long>(
+              std::numeric_limits<SmallT>::max());
+      }
+
+      //! Destroy promoted value, if any
+      void reset()
+      {
+        if (m_isBig)
+          m_big.~BigInt();
+        m_isBig = false;
+      }
+
+      //! Store BigInt, demoting if it fits inline
+      void assign(BigInt&& n);
+
+      //! Promote inline value to BigInt in place
+      void promote();
+
+      //! Apply a BigInt compound operator (slow path)
+      template<class Op>
+      HybridInt& slow(const HybridInt& other, Op op);
+  };
+}
+
+// -----------------------------------------------------------------------------
+
+//! Equality operator
+inline bool operator==(
+    const mesa::HybridInt& lhs, const mesa::HybridInt& rhs)
+{ return lhs.compare(rhs) == 0; }
+
+//! Inequality operator
+inline bool operator!=(
+    const mesa::HybridInt& lhs, const mesa::HybridInt& rhs)
+{ return !operator==(lhs, rhs); }
+
+//! Less-than operator
+inline bool operator<(
+    const mesa::HybridInt& lhs, const mesa::HybridInt& rhs)
+{ return lhs.compare(rhs) < 0; }
+
+//! Greater-than operator
+inline bool operator>(
+    const mesa::HybridInt& lhs, const mesa::HybridInt& rhs)
+{ return operator<(rhs, lhs); }
+
+//! Less-than or equal-to operator
+inline bool operator<=(
+    const mesa::HybridInt& lhs, const mesa::HybridInt& rhs)
+{ return !operator>(lhs, rhs); }
+
+//! Greater-than or equal-to operator
+inline bool operator>=(
+    const mesa::HybridInt& lhs, const mesa::HybridInt& rhs)
+{ return !operator<(lhs, rhs); }
+
+//! HybridInt binary addition
+inline mesa::HybridInt operator+(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs += rhs; }
+
+//! HybridInt binary subtraction
+inline mesa::HybridInt operator-(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs -= rhs; }
+
+//! HybridInt binary multiplication
+inline mesa::HybridInt operator*(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs *= rhs; }
+
+//! HybridInt binary division
+inline mesa::HybridInt operator/(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs /= rhs; }
+
+//! HybridInt binary modulus
+inline mesa::HybridInt operator%(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs %= rhs; }
+
+//! HybridInt binary exponentiation
+inline mesa::HybridInt operator^(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs ^= rhs; }
+
+//! HybridInt left shift
+inline mesa::HybridInt operator<<(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs <<= rhs; }
+
+//! HybridInt right shift
+inline mesa::HybridInt operator>>(
+    mesa::HybridInt lhs, const mesa::HybridInt& rhs)
+{ return lhs >>= rhs; }
+
+//! HybridInt insertion operator
+std::ostream& operator<<(
+    std::ostream& os, const mesa::HybridInt& rhs);
+
+// -----------------------------------------------------------------------------
@@ -0,0 +1,132 @@
+/** Self-checking tests for HybridInt
+ *
+ * The edges of the inline 64-bit path: results that overflow are promoted
+ * to BigInt, with the right value, and results that fit are demoted again.
+ * See Test.h.
+ *
+ * ```
+ * make test
+ * ```
+ */
+
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "HybridInt.h"
+#include "Test.h"
+
+using mesa::HybridInt;
+using mesa::test::check;
+using mesa::test::check_throws;
+
+const int64_t s_MIN = std::numeric_limits<int64_t>::min();
+const int64_t s_MAX = std::numeric_limits<int64_t>::max();
+
+//! Check the value of a result and whether it is inline
+void check_value(const HybridInt& value, const std::string& expected,
+    bool small, const std::string& what)
+{
+  mesa::test::check_equal(value, expected, what);
+  check(value.isSmall() == small,
+      what + (small ? " is not inline" : " is inline"));
+}
+
+// -----------------------------------------------------------------------------
+
+//! Overflow of the arithmetic operators, and demotion after slow()
+void test_arithmetic()
+{
+  const HybridInt min{s_MIN}, max{s_MAX};
+  check_value(min / HybridInt{-1}, "9223372036854775808", false,
+      "INT64_MIN / -1");
+  check_value(min % HybridInt{-1}, "0", true, "INT64_MIN % -1");
+  check_value(min / HybridInt{1}, std::to_string(s_MIN), true,
+      "INT64_MIN / 1");
+  check_value(max + HybridInt{1}, "9223372036854775808", false,
+      "INT64_MAX + 1");
+  check_value(min - HybridInt{1}, "-9223372036854775809", false,
+      "INT64_MIN - 1");
+  check_value(max + HybridInt{1} - HybridInt{1}, std::to_string(s_MAX), true,
+      "INT64_MAX + 1 - 1");
+  check_value(min * HybridInt{-1} + HybridInt{-1}, std::to_string(s_MAX),
+      true, "INT64_MIN * -1 - 1");
+  const HybridInt big = HybridInt{2} ^ HybridInt{100};
+  check_value(big / (HybridInt{2} ^ HybridInt{99}), "2", true,
+      "2^100 / 2^99");
+  check_value(big % HybridInt{1000}, "376", true, "2^100 % 1000");
+  check_throws<std::invalid_argument>([]{ HybridInt{1} / HybridInt{0}; },
+      "1 / 0");
+}
+
+//! Powers and shifts past 64 bits
+void test_powers()
+{
+  check_value(HybridInt{3} ^ HybridInt{39}, "4052555153018976267", true,
+      "3^39");
+  check_value(HybridInt{3} ^ HybridInt{40}, "12157665459056928801", false,
+      "3^40");
+  check_value(HybridInt{-2} ^ HybridInt{63}, std::to_string(s_MIN), true,
+      "-2^63");
+  check_value(HybridInt{2} ^ HybridInt{63}, "9223372036854775808", false,
+      "2^63");
+  check_throws<std::domain_error>([]{ HybridInt{0} ^ HybridInt{0}; }, "0^0");
+  check_throws<std::domain_error>([]{ HybridInt{2} ^ HybridInt{-1}; },
+      "2^-1");
+  check_value(HybridInt{1} << HybridInt{62}, "4611686018427387904", true,
+      "1 << 62");
+  check_value(HybridInt{1} << HybridInt{63}, "9223372036854775808", false,
+      "1 << 63");
+  check_value(HybridInt{-1} << HybridInt{63}, std::to_string(s_MIN), true,
+      "-1 << 63");
+  check_value(HybridInt{3} << HybridInt{200}, "48208141327769708266258862770"
+      "23487807566608981348378505904128", false, "3 << 200");
+  check_value(HybridInt{s_MIN} >> HybridInt{1}, "-4611686018427387904", true,
+      "INT64_MIN >> 1");
+  check_value(HybridInt{-5} >> HybridInt{100}, "-1", true, "-5 >> 100");
+}
+
+//! Inline cutoffs of choose and fib, and inline invmod
+void test_functions()
+{
+  check_value(HybridInt{66}.choose(33), "7219428434016265740", true,
+      "C(66, 33)");
+  check_value(HybridInt{67}.choose(33), "14226520737620288370", false,
+      "C(67, 33)");
+  check_value(HybridInt{68}.choose(34), "28453041475240576740", false,
+      "C(68, 34)");
+  check_value(HybridInt{5}.choose(6), "0", true, "C(5, 6)");
+  check_value(HybridInt{5}.choose(-1), "0", true, "C(5, -1)");
+  check_value(HybridInt{92}.fibonacci(), "7540113804746346429", true,
+      "F(92)");
+  check_value(HybridInt{93}.fibonacci(), "12200160415121876738", false,
+      "F(93)");
+  check_value(HybridInt{-92}.fibonacci(), "-7540113804746346429", true,
+      "F(-92)");
+  check_value(HybridInt{-93}.fibonacci(), "12200160415121876738", false,
+      "F(-93)");
+  const HybridInt m = (HybridInt{2} ^ HybridInt{61}) - HybridInt{1};
+  check_value(HybridInt{3}.invmod(7), "5", true, "3 invmod 7");
+  check_value(HybridInt{-3}.invmod(7), "2", true, "-3 invmod 7");
+  check_value(HybridInt{123456789}.invmod(m), "2217090678635848435", true,
+      "123456789 invmod 2^61 - 1");
+  check_value(HybridInt{-987654321}.invmod(m), "158159952866308383", true,
+      "-987654321 invmod 2^61 - 1");
+  check_throws<std::domain_error>([]{ HybridInt{6}.invmod(9); },
+      "6 invmod 9");
+  check_throws<std::domain_error>([]{ HybridInt{3}.invmod(0); },
+      "3 invmod 0");
+  check_throws<std::domain_error>([]{ HybridInt{3}.invmod(-7); },
+      "3 invmod -7");
+}
+
+// -----------------------------------------------------------------------------
+
+int main()
+{
+  test_arithmetic();
+  test_powers();
+  test_functions();
+  return mesa::test::report();
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+/** Size-bounded least-recently-used cache
+ *
+ * Entries are charged a caller-supplied size in bytes, and the least recently
+ * used entries are evicted until the total fits the capacity. A capacity of
+ * zero disables the cache (every lookup misses, nothing is stored). Not
+ * thread-safe.
+ *
+ * Example usage:
+ * ```
+ * mesa::LruCache<std::string, BigInt> cache{1 << 20};
+ * if (const BigInt* hit = cache.find(key))
+ *   return *hit;
+ * BigInt value = compute();
+ * cache.insert(key, value, value.bytes());
+ * ```
+ */
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace mesa
+{
+  //! Cache counters
+  struct CacheStats
+  {
+    size_t hits      = 0;
+    size_t misses    = 0;
+    size_t evictions = 0;
+    size_t entries   = 0;
+    size_t bytes     = 0; // Currently charged
+    size_t capacity  = 0;
+  };
+
+  template<class Key, class Value, class Hash = std::hash<Key>>
+  class LruCache
+  {
+    public:
+      using Stats = CacheStats;
+
+      //! Constructor
+      // @param capacity Maximum total bytes of all entries (0 disables)
+      explicit LruCache(size_t capacity = 0):
+        m_capacity{capacity}
+      {}
+
+      //! Get maximum total bytes
+      size_t capacity() const
+      { return m_capacity; }
+
+      //! Set maximum total bytes, evicting as needed (0 disables and clears)
+      void capacity(size_t bytes)
+      {
+        m_capacity = bytes;
+        evict(0);
+      }
+
+      //! Get if enabled
+      bool enabled() const
+      { return m_capacity > 0; }
+
+      //! Look up and mark as most recently used
+      // @return Cached value, or nullptr on a miss
+      const Value* find(const Key& key)
+      {
+        const Value* value = touch(key);
+        record(value != nullptr);
+        return value;
+      }
+
+      //! Look up and mark as most recently used, without counting
+      // For callers that check the value further before it counts as a hit;
+      // they record() the outcome themselves.
+      // @return Cached value, or nullptr if absent
+      const Value* touch(const Key& key)
+      {
+        auto it = m_index.find(key);
+        if (it == m_index.end())
+          return nullptr;
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        return &it->second->value;
+      }
+
+      //! Count a hit or a miss
+      void record(bool hit)
+      { ++(hit ? m_hits : m_misses); }
+
+      //! Insert or replace as most recently used
+      // Entries larger than the whole capacity are not stored.
+      // @param bytes Size charged against the capacity
+      void insert(const Key& key, Value value, size_t bytes)
+      {
+        erase(key);
+        if (bytes > m_capacity)
+          return;
+        evict(bytes);
+        m_entries.push_front(Entry{key, std::move(value), bytes});
+        m_index.emplace(key, m_entries.begin());
+        m_bytes += bytes;
+      }
+
+      //! Remove an entry, if present
+      void erase(const Key& key)
+      {
+        auto it = m_index.find(key);
+        if (it == m_index.end())
+          return;
+        m_bytes -= it->second->bytes;
+        m_entries.erase(it->second);
+        m_index.erase(it);
+      }
+
+      //! Remove all entries (counters are kept)
+      void clear()
+      {
+        m_entries.clear();
+        m_index.clear();
+        m_bytes = 0;
+      }
+
+      //! Get counters
+      Stats stats() const
+      {
+        Stats stats;
+        stats.hits      = m_hits;
+        stats.misses    = m_misses;
+        stats.evictions = m_evictions;
+        stats.entries   = m_entries.size();
+        stats.bytes     = m_bytes;
+        stats.capacity  = m_capacity;
+        return stats;
+      }
+
+    private:
+      struct Entry
+      {
+        Key key;
+        Value value;
+        size_t bytes;
+      };
+
+      using Entries = std::list<Entry>;
+
+      //! Evict least recently used entries until bytes more would fit
+      void evict(size_t bytes)
+      {
+        while (!m_entries.empty() && m_bytes + bytes > m_capacity) {
+          const Entry& entry = m_entries.back();
+          m_bytes -= entry.bytes;
+          m_index.erase(entry.key);
+          m_entries.pop_back();
+          ++m_evictions;
+        }
+      }
+
+      Entries m_entries; // Most recently used first
+      std::unordered_map<Key, typename Entries::iterator, Hash> m_index;
+      size_t m_capacity;
+      size_t m_bytes = 0;
+      size_t m_hits = 0, m_misses = 0, m_evictions = 0;
+  };
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+/** Operation-level memoization cache
+ *
+ * Shared by the unary and binary operation commands so that a repeated
+ * (token, lhs, rhs) triple, within one expression or across expressions, is
+ * computed once. Lookups are keyed by the operands' hash() values, which
+ * costs one pass over the limbs at most (BigInt caches its hash); the stored
+ * operands are compared on a hit, so hash collisions cannot return a wrong
+ * result. Entries are charged the bytes of both operands and the result, and
+ * evicted least recently used first.
+ */
+
+#include <cstddef>
+#include <string>
+
+#include "LruCache.h"
+#include "util.h"
+
+namespace mesa
+{
+  template<class T> class OpCache
+  {
+    public:
+      struct Key
+      {
+        std::string token;
+        size_t lhs, rhs;
+
+        bool operator==(const Key& other) const
+        {
+          return lhs == other.lhs && rhs == other.rhs &&
+            token == other.token;
+        }
+      };
+
+      struct KeyHash
+      {
+        size_t operator()(const Key& key) const
+        {
+          return size_t(hash_mix(key.lhs ^ hash_mix(key.rhs)) ^
+              std::hash<std::string>{}(key.token));
+        }
+      };
+
+      struct Entry
+      {
+        T lhs, rhs, result;
+      };
+
+      using Cache = LruCache<Key, Entry, KeyHash>;
+      using Stats = typename Cache::Stats;
+
+      //! Constructor
+      // @param capacity Maximum total bytes of all entries (0 disables)
+      explicit OpCache(size_t capacity = 0):
+        m_cache{capacity}
+      {}
+
+      //! Get maximum total bytes
+      size_t capacity() const
+      { return m_cache.capacity(); }
+
+      //! Set maximum total bytes (0 disables and clears)
+      void capacity(size_t bytes)
+      { m_cache.capacity(bytes); }
+
+      //! Get if enabled
+      bool enabled() const
+      { return m_cache.enabled(); }
+
+      //! Get counters
+      Stats stats() const
+      { return m_cache.stats(); }
+
+      //! Look up the result of an operation (rhs is zero for unary ones)
+      // @return Cached result, or nullptr on a miss
+      const T* find(const std::string& token, const T& lhs, const T& rhs)
+      {
+        // Only matching operands count as a hit, not a colliding hash
+        const Entry* entry = m_cache.touch(Key{token, lhs.hash(), rhs.hash()});
+        const bool hit = (entry != nullptr && entry->lhs == lhs &&
+            entry->rhs == rhs);
+        m_cache.record(hit);
+        return (hit ? &entry->result : nullptr);
+      }
+
+      //! Store the result of an operation (rhs is zero for unary ones)
+      void insert(const std::string& token, const T& lhs, const T& rhs,
+          const T& result)
+      {
+        const size_t bytes = token.size() + sizeof(Entry) +
+          lhs.bytes() + rhs.bytes() + result.bytes();
+        m_cache.insert(Key{token, lhs.hash(), rhs.hash()},
+            Entry{lhs, rhs, result}, bytes);
+      }
+
+    private:
+      Cache m_cache;
+  };
+}
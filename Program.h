@@ -0,0 +1,74 @@
+#pragma once
+
+/** Compiled postfix program
+ *
+ * Calc compiles each line into a Program before running it. Compilation builds
+ * the expression DAG from the token stream, which gives four optimizations:
+ *  - Literal-only subexpressions are folded into constants once, at compile
+ *    time (only 'ans', names and other impure commands are left to run).
+ *  - Identical subtrees share one node, computed once into a slot and then
+ *    read by every instruction that references it.
+ *  - 'x x *' becomes 'x sq', which squares instead of multiplying.
+ *  - 'a b c * +' becomes 'a b c *+', which accumulates the product into a
+ *    (when the product is not used elsewhere).
+ *
+ * Programs only depend on their tokens, so they can be cached and re-run.
+ *
+ * Example: '2 3 ^ ans * 2 3 ^ ans * +' compiles to
+ * ```
+ * slot0 = 8             (Load, folded)
+ * slot1 = ans           (Apply)
+ * slot2 = slot0 slot1 * (Apply)
+ * slot3 = slot2 slot2 + (Apply, duplicate reference)
+ * ```
+ */
+
+#include <string>
+#include <vector>
+
+namespace mesa
+{
+  template<class T> class Command;
+
+  template<class T> struct Program
+  {
+    //! Reference to a slot
+    struct Operand
+    {
+      size_t slot;
+      bool last; // Last reference, so the value may be moved out
+    };
+
+    //! Instruction
+    // Load sets the slot to a constant; Apply pushes its operands, runs the
+    // command and stores the result in the slot.
+    struct Instruction
+    {
+      enum Op { Load, Apply };
+
+      Op op;
+      size_t slot;
+      T value;                      // Load
+      const Command<T>* command;    // Apply
+      std::string token;            // Apply
+      std::vector<Operand> operands; // Apply
+    };
+
+    std::vector<Instruction> code;
+    size_t slots = 0;
+    size_t result = 0; // Slot holding the result
+
+    //! Get approximate size in bytes
+    size_t bytes() const
+    {
+      size_t n = sizeof(*this);
+      for (const auto& instruction: code) {
+        n += sizeof(instruction) + instruction.token.size() +
+          instruction.operands.size() * sizeof(Operand);
+        if (instruction.op == Instruction::Load)
+          n += instruction.value.bytes();
+      }
+      return n;
+    }
+  };
+}
@@ -0,0 +1,540 @@
+#pragma once
+
+/** Unix domain socket server
+ *
+ * Serves many clients from one process: an epoll event loop accepts
+ * connections and reads newline-delimited expressions, which a pool of
+ * worker threads evaluates. Clients may pipeline, i.e. send any number of
+ * lines without waiting. Every line gets exactly one response line, in
+ * order: the result, or 'error: ' and the message.
+ *
+ * Each connection is a session with its own Calc, so 'ans', names and caches
+ * are per connection. A session evaluates one line at a time, which keeps
+ * its responses in order and its Calc on one thread at a time, while
+ * different sessions evaluate in parallel. Closing a connection cancels its
+ * evaluation in progress. SIGINT or SIGTERM stops the server, cancelling all
+ * evaluations and removing the socket. The constructor blocks both signals
+ * in the calling thread, so construct the server before starting other
+ * threads (e.g. the ThreadPool), which inherit the mask.
+ *
+ * Example usage:
+ * ```
+ * mesa::StreamLogger logger{&std::cout, mesa::LogLevel::Info};
+ * mesa::Server<mesa::BigInt> server{"/tmp/calc.sock", 4,
+ *     [&](mesa::Calc<mesa::BigInt>& calc)
+ *     {
+ *       calc.stdLogger(&logger);
+ *       calc.errLogger(&logger);
+ *     }};
+ * server.run(); // Until SIGINT or SIGTERM
+ * ```
+ * ```
+ * $ printf '2 64 ^\n1 0 /\nans 1 +\n' | nc -U /tmp/calc.sock
+ * 18446744073709551616
+ * error: Division by zero
+ * 18446744073709551617
+ * ```
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Calc.h"
+
+namespace mesa
+{
+  template<class T> class Server
+  {
+    public:
+      using Calc  = mesa::Calc<T>;
+      using Setup  = std::function<void(Calc&)>;
+      using Format = std::function<std::string(const T&)>;
+
+      //! Constructor (binds and listens on the socket)
+      // @param workers Number of evaluation threads (at least one)
+      // @param setup Configures the Calc of each new connection
+      // @param format Formats results (decimal if empty)
+      // @throws system_error Socket could not be set up, or is in use
+      Server(const std::string& path, size_t workers, Setup setup,
+          Format format = Format{}):
+        m_path{path},
+        m_setup{setup},
+        m_format{format}
+      {
+        try {
+          listen();
+          m_epoll = check(epoll_create1(EPOLL_CLOEXEC), "epoll_create1");
+          m_done = check(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd");
+          // Workers inherit the blocked signals, so only the loop sees them
+          sigset_t signals;
+          sigemptyset(&signals);
+          sigaddset(&signals, SIGINT);
+          sigaddset(&signals, SIGTERM);
+          pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+          m_signals = check(
+              signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC), "signalfd");
+          watch(m_listener, EPOLLIN);
+          watch(m_done, EPOLLIN);
+          watch(m_signals, EPOLLIN);
+        } catch (...) {
+          close_all();
+          throw;
+        }
+        for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i)
+          m_workers.emplace_back(&Server::work, this);
+      }
+
+      Server(const Server&) = delete;
+      void operator=(const Server&) = delete;
+
+      ~Server()
+      {
+        stop();
+        close_all();
+      }
+
+      //! Serve until SIGINT or SIGTERM
+      // @throws system_error The event loop failed
+      void run()
+      {
+        std::vector<epoll_event> events(64);
+        while (!m_stopping) {
+          const int n = epoll_wait(m_epoll, events.data(),
+              int(events.size()), -1);
+          if (n < 0 && errno == EINTR)
+            continue;
+          check(n, "epoll_wait");
+          for (int i = 0; i < n; ++i) {
+            const int fd = events[i].data.fd;
+            if (fd == m_listener)
+              accept_all();
+            else if (fd == m_done)
+              complete();
+            else if (fd == m_signals)
+              m_stopping = true;
+            else
+              ready(fd, events[i].events);
+          }
+        }
+        stop();
+      }
+
+      //! Get number of open connections
+      size_t connections() const
+      { return m_sessions.size(); }
+
+    private:
+      //! Longest line accepted, and most output buffered per connection
+      // before reading (and evaluating) is paused
+      static constexpr size_t s_MAX_LINE   = size_t{1} << 28;
+      static constexpr size_t s_MAX_OUTPUT = size_t{1} << 26;
+      //! Most lines queued per connection before reading is paused
+      static constexpr size_t s_MAX_QUEUED = 1024;
+
+      //! Queued line, or an error to respond with in its place
+      struct Line
+      {
+        std::string text;
+        std::string error; // Response line instead of evaluating, if set
+      };
+
+      //! Connection state; the loop thread owns all of it except calc,
+      // which the worker evaluating the session's line owns while busy
+      struct Session
+      {
+        int fd;
+        std::string in, out;
+        std::deque<Line> lines;        // Queued, not yet evaluated
+        bool busy = false;             // A line is being evaluated
+        bool eof = false;              // Client sent all of its lines
+        bool watched = false;          // Added to the epoll set
+        uint32_t events = 0;           // Watched events
+        std::atomic<bool> closed{false};
+        Calc calc;
+      };
+      using SessionPtr = std::shared_ptr<Session>;
+
+      //! Line to evaluate
+      struct Job
+      {
+        SessionPtr session;
+        std::string line;
+      };
+
+      //! Evaluated line
+      struct Result
+      {
+        SessionPtr session;
+        std::string response;
+      };
+
+      //! Throw for a failed system call
+      static int check(int result, const char* what)
+      {
+        if (result < 0)
+          throw std::system_error(errno, std::generic_category(), what);
+        return result;
+      }
+
+      void listen()
+      {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (m_path.empty() || m_path.size() >= sizeof(address.sun_path)) {
+          throw std::system_error(ENAMETOOLONG, std::generic_category(),
+              "Socket path '" + m_path + "'");
+        }
+        std::strcpy(address.sun_path, m_path.c_str());
+        m_listener = check(socket(AF_UNIX,
+              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket");
+        // Replace a stale socket, but not one that a server still answers on
+        struct stat status;
+        if (stat(m_path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+          const int probe = check(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+                0), "socket");
+          const bool alive = (connect(probe,
+                reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+          ::close(probe);
+          if (alive) {
+            throw std::system_error(EADDRINUSE, std::generic_category(),
+                "Socket '" + m_path + "'");
+          }
+          unlink(m_path.c_str());
+        }
+        if (bind(m_listener, reinterpret_cast<sockaddr*>(&address),
+              sizeof(address)) < 0) {
+          throw std::system_error(errno, std::generic_category(),
+              "Socket '" + m_path + "'");
+        }
+        m_bound = true;
+        check(::listen(m_listener, SOMAXCONN), "listen");
+      }
+
+      void watch(int fd, uint32_t events)
+      {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        check(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event), "epoll_ctl");
+      }
+
+      void accept_all()
+      {
+        while (true) {
+          const int fd = accept4(m_listener, nullptr, nullptr,
+              SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+              continue;
+            // Out of descriptors or memory is not fatal, but the connection
+            // stays pending and the listener ready, so stop watching it
+            // until a session closes rather than spin on it
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM) {
+              epoll_ctl(m_epoll, EPOLL_CTL_DEL, m_listener, nullptr);
+              m_accepting = false;
+            }
+            return;
+          }
+          auto session = std::make_shared<Session>();
+          session->fd = fd;
+          m_setup(session->calc);
+          m_sessions.emplace(fd, session);
+          update(*session);
+        }
+      }
+
+      //! Handle readiness of a connection
+      void ready(int fd, uint32_t events)
+      {
+        auto it = m_sessions.find(fd);
+        if (it == m_sessions.end())
+          return;
+        SessionPtr session = it->second;
+        // Hang-up means both directions are shut, so responses can't be sent
+        if (events & (EPOLLERR | EPOLLHUP)) {
+          close(session);
+          return;
+        }
+        if ((events & EPOLLIN) && !read(*session)) {
+          close(session);
+          return;
+        }
+        if ((events & EPOLLOUT) && !write(*session)) {
+          close(session);
+          return;
+        }
+        progress(session);
+      }
+
+      //! Read available input into queued lines
+      // @return false if the connection failed
+      bool read(Session& session)
+      {
+        char buffer[65536];
+        while (!session.eof) {
+          const ssize_t n = ::read(session.fd, buffer, sizeof(buffer));
+          if (n < 0) {
+            if (errno == EINTR)
+              continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+          }
+          if (n == 0) {
+            session.eof = true;
+            break;
+          }
+          // Only the new bytes can hold a newline
+          size_t start = 0, from = session.in.size();
+          session.in.append(buffer, size_t(n));
+          for (size_t end; (end = session.in.find('\n', from)) !=
+              std::string::npos; from = start = end + 1) {
+            size_t length = end - start;
+            if (length > 0 && session.in[end - 1] == '\r')
+              --length;
+            session.lines.push_back({session.in.substr(start, length), {}});
+          }
+          session.in.erase(0, start);
+          // Answered in turn, after the lines before it
+          if (session.in.size() > s_MAX_LINE) {
+            session.lines.push_back({{}, "error: Line too long\n"});
+            session.in.clear();
+            session.eof = true; // Stop reading, flush and close
+          }
+          if (session.lines.size() >= s_MAX_QUEUED)
+            break;
+        }
+        // A last line without a newline still counts
+        if (session.eof && !session.in.empty()) {
+          session.lines.push_back({std::move(session.in), {}});
+          session.in.clear();
+        }
+        return true;
+      }
+
+      //! Write buffered output
+      // @return false if the connection failed
+      bool write(Session& session)
+      {
+        size_t written = 0;
+        while (written < session.out.size()) {
+          const ssize_t n = send(session.fd, session.out.data() + written,
+              session.out.size() - written, MSG_NOSIGNAL);
+          if (n < 0) {
+            if (errno == EINTR)
+              continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+              break;
+            return false;
+          }
+          written += size_t(n);
+        }
+        session.out.erase(0, written);
+        return true;
+      }
+
+      //! Dispatch the next line, flush, and close or re-arm as needed
+      void progress(const SessionPtr& session)
+      {
+        if (!session->busy && !session->lines.empty() &&
+            session->out.size() < s_MAX_OUTPUT) {
+          Line line = std::move(session->lines.front());
+          session->lines.pop_front();
+          if (line.error.empty()) {
+            session->busy = true;
+            submit(session, std::move(line.text));
+          } else {
+            session->out += line.error;
+          }
+        }
+        if (!session->out.empty() && !write(*session)) {
+          close(session);
+          return;
+        }
+        if (session->eof && !session->busy && session->lines.empty() &&
+            session->out.empty()) {
+          close(session);
+          return;
+        }
+        update(*session);
+      }
+
+      //! Watch for what the session can make progress on
+      void update(Session& session)
+      {
+        uint32_t events = 0;
+        if (!session.eof && session.lines.size() < s_MAX_QUEUED &&
+            session.out.size() < s_MAX_OUTPUT)
+          events |= EPOLLIN;
+        if (!session.out.empty())
+          events |= EPOLLOUT;
+        if (session.watched && events == session.events)
+          return;
+        // Errors and hang-ups are reported even when no events are watched
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = session.fd;
+        check(epoll_ctl(m_epoll,
+              (session.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD),
+              session.fd, &event), "epoll_ctl");
+        session.watched = true;
+        session.events = events;
+      }
+
+      //! Close a connection, cancelling its evaluation in progress
+      void close(const SessionPtr& session)
+      {
+        session->closed = true;
+        if (session->busy)
+          session->calc.cancelToken().cancel();
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, session->fd, nullptr);
+        ::close(session->fd);
+        m_sessions.erase(session->fd);
+        // A descriptor is free again
+        if (!m_accepting && !m_stopping) {
+          watch(m_listener, EPOLLIN);
+          m_accepting = true;
+        }
+      }
+
+      //! Handle evaluated lines
+      void complete()
+      {
+        uint64_t count;
+        while (::read(m_done, &count, sizeof(count)) > 0)
+          {}
+        std::deque<Result> results;
+        {
+          std::lock_guard<std::mutex> lock{m_mutex};
+          results.swap(m_results);
+        }
+        for (auto& result: results) {
+          if (result.session->closed)
+            continue;
+          result.session->busy = false;
+          result.session->out += result.response;
+          progress(result.session);
+        }
+      }
+
+      //! Queue a line for evaluation
+      void submit(const SessionPtr& session, std::string line)
+      {
+        {
+          std::lock_guard<std::mutex> lock{m_mutex};
+          m_jobs.push_back({session, std::move(line)});
+        }
+        m_wake.notify_one();
+      }
+
+      //! Worker thread loop
+      void work()
+      {
+        while (true) {
+          Job job;
+          {
+            std::unique_lock<std::mutex> lock{m_mutex};
+            m_wake.wait(lock, [this]{ return m_stop || !m_jobs.empty(); });
+            if (m_stop)
+              return;
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+          }
+          Result result{job.session, {}};
+          if (!job.session->closed)
+            result.response = evaluate(job.session->calc, job.line);
+          {
+            std::lock_guard<std::mutex> lock{m_mutex};
+            m_results.push_back(std::move(result));
+          }
+          const uint64_t one = 1;
+          while (::write(m_done, &one, sizeof(one)) < 0 && errno == EINTR)
+            {}
+        }
+      }
+
+      //! Evaluate a line into its response line
+      std::string evaluate(Calc& calc, const std::string& line) const
+      {
+        std::ostringstream ss;
+        try {
+          const T result = calc.evaluate(line);
+          if (m_format)
+            ss << m_format(result) << '\n';
+          else
+            ss << result << '\n';
+        } catch (std::exception& e) {
+          // Only the message, not the stack dump
+          const std::string what = e.what();
+          ss.str("");
+          ss << "error: " << what.substr(0, what.find('\n')) << '\n';
+        }
+        return ss.str();
+      }
+
+      //! Stop and join the workers, cancelling their evaluations
+      void stop()
+      {
+        m_stopping = true;
+        {
+          std::lock_guard<std::mutex> lock{m_mutex};
+          m_stop = true;
+          m_jobs.clear();
+        }
+        m_wake.notify_all();
+        while (!m_sessions.empty())
+          close(m_sessions.begin()->second);
+        for (auto& worker: m_workers)
+          worker.join();
+        m_workers.clear();
+      }
+
+      void close_all()
+      {
+        for (int* fd: {&m_listener, &m_epoll, &m_done, &m_signals}) {
+          if (*fd >= 0)
+            ::close(*fd);
+          *fd = -1;
+        }
+        if (m_bound)
+          unlink(m_path.c_str());
+        m_bound = false;
+      }
+
+      const std::string m_path;
+      Setup m_setup;
+      Format m_format;
+      int m_listener = -1, m_epoll = -1, m_done = -1, m_signals = -1;
+      bool m_bound = false;
+      bool m_accepting = true; // The listener is in the epoll set
+      bool m_stopping = false;
+      std::unordered_map<int, SessionPtr> m_sessions; // By descriptor
+      std::vector<std::thread> m_workers;
+      std::mutex m_mutex; // Guards the rest
+      std::condition_variable m_wake;
+      std::deque<Job> m_jobs;
+      std::deque<Result> m_results;
+      bool m_stop = false;
+  };
+}
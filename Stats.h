@@ -0,0 +1,255 @@
+#pragma once
+
+/** Per-command counters and latency histograms
+ *
+ * Calc records every command it executes (when folding at compile time and
+ * when running compiled programs) under the command's token, and every
+ * evaluation as a whole, with the limb allocations (see Allocator.h) made
+ * meanwhile. Recording costs two clock reads and a hash lookup, so it is
+ * always on. Latencies go into power-of-two nanosecond buckets, from which
+ * percentiles are read to within a factor of two.
+ *
+ * Example usage:
+ * ```
+ * mesa::Stats stats;
+ * stats.record("*", 1200, 128, 64, 128, {}); // ns, bytes, allocations
+ * stats.print(std::cout); // Table
+ * stats.json(std::cout);  // Machine-readable
+ * ```
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Allocator.h"
+
+namespace mesa
+{
+  //! Latency histogram with power-of-two nanosecond buckets
+  class Histogram
+  {
+    public:
+      //! Add a sample
+      void add(uint64_t ns)
+      { ++m_counts[bucket(ns)]; }
+
+      //! Get number of samples
+      uint64_t count() const
+      {
+        uint64_t n = 0;
+        for (auto count: m_counts)
+          n += count;
+        return n;
+      }
+
+      //! Get upper bound of a percentile in nanoseconds (0 if empty)
+      // @param p Percentile in [0, 100]
+      uint64_t percentile(double p) const
+      {
+        const uint64_t total = count();
+        if (total == 0)
+          return 0;
+        const uint64_t rank = std::max<uint64_t>(1,
+            static_cast<uint64_t>(p / 100 * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < s_BUCKETS; ++i) {
+          seen += m_counts[i];
+          if (seen >= rank)
+            return (i < 64 ? (uint64_t{1} << i) - 1 : UINT64_MAX);
+        }
+        return UINT64_MAX;
+      }
+
+      //! Merge in another histogram
+      Histogram& operator+=(const Histogram& other)
+      {
+        for (size_t i = 0; i < s_BUCKETS; ++i)
+          m_counts[i] += other.m_counts[i];
+        return *this;
+      }
+
+    private:
+      static constexpr size_t s_BUCKETS = 65;
+
+      //! Bucket i holds [2^(i-1), 2^i), bucket 0 holds 0
+      static size_t bucket(uint64_t ns)
+      { return (ns == 0 ? 0 : 64 - __builtin_clzll(ns)); }
+
+      std::array<uint64_t, s_BUCKETS> m_counts{};
+  };
+
+  //! Counters of one command token
+  struct CommandStats
+  {
+    uint64_t calls        = 0;
+    uint64_t ns           = 0; // Total time spent
+    uint64_t operandBytes = 0; // Total size of the operands
+    uint64_t maxOperand   = 0; // Largest operand in bytes
+    uint64_t resultBytes  = 0; // Total size of the results
+    uint64_t allocBytes   = 0; // Total bytes allocated
+    uint64_t allocations  = 0; // Total number of allocations
+    uint64_t peakBytes    = 0; // Largest peak of one call, over its start
+    Histogram latency;
+  };
+
+  class Stats
+  {
+    public:
+      using Table = std::unordered_map<std::string, CommandStats>;
+
+      //! Record a command execution
+      // @param memory Allocations made by the command (peak over its start)
+      void record(const std::string& token, uint64_t ns,
+          uint64_t operandBytes, uint64_t maxOperand, uint64_t resultBytes,
+          const AllocStats& memory)
+      {
+        CommandStats& stats = m_commands[token];
+        ++stats.calls;
+        stats.ns += ns;
+        stats.operandBytes += operandBytes;
+        stats.maxOperand = std::max(stats.maxOperand, maxOperand);
+        stats.resultBytes += resultBytes;
+        add(stats, memory);
+        stats.latency.add(ns);
+      }
+
+      //! Record a whole evaluation
+      // @param memory Allocations made by the evaluation (peak over its
+      // start)
+      void evaluation(uint64_t ns, bool failed, const AllocStats& memory)
+      {
+        ++m_evaluations.calls;
+        m_evaluations.ns += ns;
+        add(m_evaluations, memory);
+        m_evaluations.latency.add(ns);
+        m_failures += failed;
+      }
+
+      //! Get counters per command token
+      const Table& commands() const
+      { return m_commands; }
+
+      //! Get counters of whole evaluations
+      const CommandStats& evaluations() const
+      { return m_evaluations; }
+
+      //! Get number of evaluations that threw
+      uint64_t failures() const
+      { return m_failures; }
+
+      //! Reset all counters
+      void clear()
+      {
+        m_commands.clear();
+        m_evaluations = CommandStats{};
+        m_failures = 0;
+      }
+
+      //! Print as a table, most expensive command first
+      void print(std::ostream& os) const
+      {
+        std::multimap<uint64_t, const Table::value_type*,
+          std::greater<uint64_t>> byTime;
+        for (const auto& entry: m_commands)
+          byTime.emplace(entry.second.ns, &entry);
+        const AllocStats memory = Allocations::stats();
+        os << "(" << m_evaluations.calls << " evaluations, " << m_failures
+          << " failed, " << m_evaluations.ns / 1000 << " us total, p50 "
+          << m_evaluations.latency.percentile(50) << " ns, p99 "
+          << m_evaluations.latency.percentile(99) << " ns)\n"
+          << "(Memory: " << memory.current << " bytes now, " << memory.peak
+          << " peak, " << memory.total << " allocated in "
+          << memory.allocations << " allocations; evaluation peak "
+          << m_evaluations.peakBytes << ")\n";
+        // Columns are at least as wide as their header and widest value,
+        // plus a space between
+        std::vector<std::vector<std::string>> rows{{"token", "calls",
+          "total us", "p50 ns", "p99 ns", "operand B", "max B", "result B",
+          "alloc B"}};
+        for (const auto& entry: byTime) {
+          const CommandStats& stats = entry.second->second;
+          rows.push_back({entry.second->first, std::to_string(stats.calls),
+              std::to_string(stats.ns / 1000),
+              std::to_string(stats.latency.percentile(50)),
+              std::to_string(stats.latency.percentile(99)),
+              std::to_string(stats.operandBytes),
+              std::to_string(stats.maxOperand),
+              std::to_string(stats.resultBytes),
+              std::to_string(stats.allocBytes)});
+        }
+        std::vector<size_t> widths(rows[0].size());
+        for (const auto& row: rows)
+          for (size_t i = 0; i < row.size(); ++i)
+            widths[i] = std::max(widths[i], row[i].size() + (i > 0));
+        for (const auto& row: rows) {
+          os << std::left << std::setw(int(widths[0] + 1)) << row[0]
+            << std::right;
+          for (size_t i = 1; i < row.size(); ++i)
+            os << std::setw(int(widths[i])) << row[i];
+          os << "\n";
+        }
+      }
+
+      //! Write as a JSON object (tokens in sorted order)
+      void json(std::ostream& os) const
+      {
+        std::map<std::string, const CommandStats*> sorted;
+        for (const auto& entry: m_commands)
+          sorted.emplace(entry.first, &entry.second);
+        const AllocStats memory = Allocations::stats();
+        os << "{\n  \"evaluations\": ";
+        json(os, m_evaluations);
+        os << ",\n  \"failures\": " << m_failures
+          << ",\n  \"memory\": {\"current_bytes\": " << memory.current
+          << ", \"peak_bytes\": " << memory.peak
+          << ", \"total_bytes\": " << memory.total
+          << ", \"allocations\": " << memory.allocations << "}"
+          << ",\n  \"commands\": {";
+        for (auto it = sorted.begin(); it != sorted.end(); ++it) {
+          os << (it == sorted.begin() ? "\n" : ",\n") << "    \"";
+          // Tokens are printable and contain no spaces, but may contain
+          // quotes or backslashes
+          for (char c: it->first)
+            os << (c == '"' || c == '\\' ? "\\" : "") << c;
+          os << "\": ";
+          json(os, *it->second);
+        }
+        os << "\n  }\n}\n";
+      }
+
+    private:
+      static void add(CommandStats& stats, const AllocStats& memory)
+      {
+        stats.allocBytes += memory.total;
+        stats.allocations += memory.allocations;
+        stats.peakBytes = std::max<uint64_t>(stats.peakBytes, memory.peak);
+      }
+
+      static void json(std::ostream& os, const CommandStats& stats)
+      {
+        os << "{\"calls\": " << stats.calls << ", \"ns\": " << stats.ns
+          << ", \"operand_bytes\": " << stats.operandBytes
+          << ", \"max_operand_bytes\": " << stats.maxOperand
+          << ", \"result_bytes\": " << stats.resultBytes
+          << ", \"alloc_bytes\": " << stats.allocBytes
+          << ", \"allocations\": " << stats.allocations
+          << ", \"peak_bytes\": " << stats.peakBytes
+          << ", \"p50_ns\": " << stats.latency.percentile(50)
+          << ", \"p90_ns\": " << stats.latency.percentile(90)
+          << ", \"p99_ns\": " << stats.latency.percentile(99)
+          << ", \"max_ns\": " << stats.latency.percentile(100) << "}";
+      }
+
+      Table m_commands;
+      CommandStats m_evaluations;
+      uint64_t m_failures = 0;
+  };
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+/** Checks shared by the self-checking test drivers
+ *
+ * Each *_test.cpp is a plain program: it runs its checks, every failed one
+ * is printed, and main() returns report(), which is 0 when all passed.
+ * Random inputs come from generators with fixed seeds, so every run checks
+ * the same values.
+ *
+ * Example usage:
+ * ```
+ * mesa::test::check(2 + 2 == 4, "2 + 2");
+ * mesa::test::check_equal(mesa::BigInt{7} / 2, "3", "7 / 2");
+ * mesa::test::check_throws<std::invalid_argument>(
+ *     []{ mesa::BigInt{"x"}; }, "Parsing 'x'");
+ * return mesa::test::report();
+ * ```
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+
+namespace mesa
+{
+  namespace test
+  {
+    //! Numbers of checks and failed checks so far
+    struct Tally
+    {
+      size_t checks   = 0;
+      size_t failures = 0;
+    };
+
+    inline Tally& tally()
+    {
+      static Tally t;
+      return t;
+    }
+
+    //! Count a check, printing it if it failed
+    inline void check(bool passed, const std::string& what)
+    {
+      ++tally().checks;
+      if (!passed) {
+        ++tally().failures;
+        std::cerr << "FAILED: " << what << "\n";
+      }
+    }
+
+    //! Check that a value has the expected decimal representation
+    template<class T> void check_equal(const T& value,
+        const std::string& expected, const std::string& what)
+    {
+      const std::string actual{value};
+      check(actual == expected,
+          what + " is " + actual + ", expected " + expected);
+    }
+
+    //! Check that a function throws an exception of a type
+    template<class E> void check_throws(const std::function<void()>& f,
+        const std::string& what)
+    {
+      bool thrown = false;
+      try {
+        f();
+      } catch (const E&) {
+        thrown = true;
+      } catch (...) {
+      }
+      check(thrown, what + " did not throw as expected");
+    }
+
+    //! Random decimal digits, without a leading zero, negative if asked
+    inline std::string random_digits(std::mt19937_64& rng, size_t digits,
+        bool negative = false)
+    {
+      std::string s(digits, '0');
+      for (auto& c: s)
+        c = char('0' + rng() % 10);
+      s[0] = char('1' + rng() % 9);
+      return (negative ? "-" : "") + s;
+    }
+
+    //! Print the tally
+    // @return Exit status: the number of failures (at most 100)
+    inline int report()
+    {
+      std::cout << tally().checks << " checks, " << tally().failures
+        << " failed\n";
+      return int(std::min<size_t>(tally().failures, 100));
+    }
+  }
+}
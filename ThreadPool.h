@@ -0,0 +1,260 @@
+#pragma once
+
+/** Work-stealing thread pool
+ *
+ * Fork-join pool used to evaluate independent subproblems (reduction subtrees,
+ * multiplication halves) in parallel. Every worker owns a deque: it pushes and
+ * pops forked jobs at the back while idle workers steal from the front of
+ * other deques. A thread waiting on a forked job never blocks while work is
+ * available; it helps by running queued jobs, so nested forks cannot deadlock.
+ *
+ * Example usage:
+ * ```
+ * T lhs, rhs;
+ * mesa::ThreadPool::instance().invoke(
+ *     [&]{ lhs = reduce(lo, mid); },
+ *     [&]{ rhs = reduce(mid, hi); });
+ * ```
+ *
+ * With zero workers (single core machines, or disabled) invoke() runs both
+ * callables serially on the calling thread. Forked jobs run under the forking
+ * thread's current CancelToken and allocation account, wherever they are
+ * run.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Allocator.h"
+#include "CancelToken.h"
+
+namespace mesa
+{
+  class ThreadPool
+  {
+    public:
+      //! Constructor
+      // @param workers Number of worker threads (in addition to the calling
+      // thread, which always takes part in its own forks)
+      explicit ThreadPool(size_t workers = defaultWorkers())
+      { start(workers); }
+
+      ThreadPool(const ThreadPool&) = delete;
+      void operator=(const ThreadPool&) = delete;
+
+      ~ThreadPool()
+      { stop(); }
+
+      //! Return shared instance (one worker per extra hardware thread)
+      static ThreadPool& instance()
+      {
+        static ThreadPool pool;
+        return pool;
+      }
+
+      //! Default number of workers
+      static size_t defaultWorkers()
+      {
+        size_t n = std::thread::hardware_concurrency();
+        return (n > 1 ? n - 1 : 0);
+      }
+
+      //! Get number of worker threads
+      size_t workers() const
+      { return m_threads.size(); }
+
+      //! Set number of worker threads (0 runs everything serially)
+      // Must not be called while jobs are in flight.
+      void workers(size_t n)
+      {
+        stop();
+        start(n);
+      }
+
+      //! Run two callables, possibly in parallel, and wait for both
+      // Exceptions thrown by either callable are rethrown on the calling
+      // thread (the first callable's exception takes precedence).
+      template<class F, class G>
+      void invoke(F&& f, G&& g)
+      {
+        if (m_threads.empty()) {
+          f();
+          g();
+          return;
+        }
+        Job job{std::function<void()>{std::forward<G>(g)}};
+        size_t index = queueIndex();
+        push(index, &job);
+        std::exception_ptr error;
+        try {
+          f();
+        } catch (...) {
+          error = std::current_exception();
+        }
+        // Take the forked job back if nobody stole it, otherwise help out
+        if (take(index, &job))
+          job.run();
+        while (!job.done.load(std::memory_order_acquire)) {
+          Job* other = steal(index);
+          if (other)
+            other->run();
+          else
+            std::this_thread::yield();
+        }
+        if (error)
+          std::rethrow_exception(error);
+        if (job.error)
+          std::rethrow_exception(job.error);
+      }
+
+    private:
+      struct Job
+      {
+        explicit Job(std::function<void()> function):
+          fn{std::move(function)},
+          token{CancelToken::current()},
+          account{Allocations::Account::current()}
+        {}
+
+        void run()
+        {
+          try {
+            CancelToken::Scope scope{token};
+            Allocations::Account::Scope accounting{account};
+            fn();
+          } catch (...) {
+            error = std::current_exception();
+          }
+          done.store(true, std::memory_order_release);
+        }
+
+        std::function<void()> fn;
+        CancelToken* token; // Of the forking thread
+        Allocations::Account* account; // Of the forking thread
+        std::atomic<bool> done{false};
+        std::exception_ptr error;
+      };
+
+      struct Queue
+      {
+        std::mutex mutex;
+        std::deque<Job*> jobs;
+      };
+
+      //! Start worker threads
+      void start(size_t workers)
+      {
+        std::vector<Queue>(workers + 1).swap(m_queues);
+        m_stop = false;
+        for (size_t i = 0; i < workers; ++i)
+          m_threads.emplace_back(&ThreadPool::work, this, i + 1);
+      }
+
+      //! Stop and join worker threads
+      void stop()
+      {
+        {
+          std::lock_guard<std::mutex> lock{m_sleepMutex};
+          m_stop = true;
+        }
+        m_sleep.notify_all();
+        for (auto& thread: m_threads)
+          thread.join();
+        m_threads.clear();
+      }
+
+      //! Push job to the back of a queue
+      void push(size_t index, Job* job)
+      {
+        {
+          std::lock_guard<std::mutex> lock{m_queues[index].mutex};
+          m_queues[index].jobs.push_back(job);
+        }
+        {
+          std::lock_guard<std::mutex> lock{m_sleepMutex};
+          ++m_pending;
+        }
+        m_sleep.notify_one();
+      }
+
+      //! Remove a specific job from the back of a queue
+      // @return false if the job was stolen in the meantime
+      bool take(size_t index, Job* job)
+      {
+        std::lock_guard<std::mutex> lock{m_queues[index].mutex};
+        auto& jobs = m_queues[index].jobs;
+        // Queue 0 is shared by all non-worker threads, so search it
+        for (auto it = jobs.rbegin(); it != jobs.rend(); ++it) {
+          if (*it == job) {
+            jobs.erase(std::next(it).base());
+            --m_pending;
+            return true;
+          }
+        }
+        return false;
+      }
+
+      //! Pop from own queue (back), else steal from others (front)
+      Job* steal(size_t index)
+      {
+        {
+          std::lock_guard<std::mutex> lock{m_queues[index].mutex};
+          auto& jobs = m_queues[index].jobs;
+          if (index != 0 && !jobs.empty()) {
+            Job* job = jobs.back();
+            jobs.pop_back();
+            --m_pending;
+            return job;
+          }
+        }
+        for (size_t i = 1; i <= m_queues.size(); ++i) {
+          auto& queue = m_queues[(index + i) % m_queues.size()];
+          std::lock_guard<std::mutex> lock{queue.mutex};
+          if (!queue.jobs.empty()) {
+            Job* job = queue.jobs.front();
+            queue.jobs.pop_front();
+            --m_pending;
+            return job;
+          }
+        }
+        return nullptr;
+      }
+
+      //! Worker thread loop
+      void work(size_t index)
+      {
+        queueIndex() = index;
+        while (true) {
+          Job* job = steal(index);
+          if (job) {
+            job->run();
+            continue;
+          }
+          std::unique_lock<std::mutex> lock{m_sleepMutex};
+          m_sleep.wait(lock, [this]{ return m_stop || m_pending > 0; });
+          if (m_stop)
+            return;
+        }
+      }
+
+      //! Index of the calling thread's queue (0 for non-worker threads)
+      static size_t& queueIndex()
+      {
+        static thread_local size_t index = 0;
+        return index;
+      }
+
+      std::vector<Queue> m_queues;
+      std::vector<std::thread> m_threads;
+      std::atomic<size_t> m_pending{0};
+      std::mutex m_sleepMutex;
+      std::condition_variable m_sleep;
+      bool m_stop = false;
+  };
+}
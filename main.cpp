@@ -11,24 +11,29 @@
 #include <readline/readline.h>
 #include <readline/history.h>
 //#include "cpp-readline/src/Console.hpp"
+#include <csignal>
+#include <fstream>
 #include <iostream>
 #include <string>
 
 #include "BigInt.h"
+#include "HybridInt.h"
+#include "FixedUInt.h"
 #include "Logger.h"
 #include "Command.h"
 #include "Calc.h"
+#include "Server.h"
+#include "ThreadPool.h"
 
 // Logger aliases
 using LogLevel     = mesa::LogLevel;
 using StreamLogger = mesa::StreamLogger;
 using FileLogger   = mesa::FileLogger;
 
-// Data type alias
-using Data = mesa::BigInt;
-
-// Calculator aliases
-using Calc = mesa::Calc<Data>;
+// Data type aliases (arbitrary precision by default, or fixed with -w)
+using Data = mesa::HybridInt;
+template<size_t Bits>
+using FixedData = mesa::FixedUInt<Bits>;
 
 const std::string HELP =
 "Help\n"
@@ -37,6 +42,10 @@ const std::string HELP =
 "Commands:\n"
 "  q [ quit ]     Quit the program\n"
 "  h [ help, ? ]  Print this message\n"
+"  cache          Print result and operation cache counters\n"
+"  stats          Print per-command counters and latencies\n"
+"  vars           Print stored names and their sizes\n"
+"  radix [n]      Print results in radix n (10, 16 or 2), or print the radix\n"
 "\n"
 "Instructions:\n"
 "  Calculates the result of a single-line compound post-fix mathematical "
@@ -44,7 +53,10 @@ const std::string HELP =
 "while unary operations consume only one one. Additionally, consumer commands "
 "will consume all operands on the stack by applying the equivalent binary "
 "operation until only a single result is left on the stack. And lastly, arbitrary "
-"commands provide special functionality while requiring no operands.\n"
+"commands provide special functionality while requiring no operands. Operands "
+"are decimal integers and may be negative (e.g. '-12 5 +'), hexadecimal after "
+"'0x' or binary after '0b' (e.g. '-0xff 0b101 +'), or 'bin:' and the binary "
+"format in hexadecimal (as printed with -o bin).\n"
 "\n"
 "Binary operations:\n"
 "  +    Addition\n"
@@ -53,13 +65,26 @@ const std::string HELP =
 "  /    Division\n"
 "  %    Modulus\n"
 "  ^    Exponentiation\n"
+"  <<   Shift left, multiplying by 2^n ('x n <<')\n"
+"  >>   Shift right, dividing by 2^n and rounding down ('x n >>')\n"
 "  min  Minimum of two values\n"
 "  max  Maximum of two values\n"
 "  lcm  Least common multiple\n"
 "  gcf  Greatest common factor\n"
+"  root Integer nth root ('x n root')\n"
+"  choose Binomial coefficient ('n k choose')\n"
+"  invmod Modular inverse ('a m invmod', a x = 1 mod m)\n"
+"\n"
+"Ternary operations:\n"
+"  *+   Multiply-accumulate ('a b c *+' is 'a b c * +')\n"
 "\n"
 "Unary operations:\n"
 "  !    Factorial\n"
+"  sq   Square\n"
+"  sqrt Integer square root\n"
+"  isprime    1 if prime, otherwise 0\n"
+"  nextprime  Smallest prime greater than operand\n"
+"  fib  Fibonacci number ('n fib')\n"
 "\n"
 "Consumer binary operations:\n"
 "  +.    Addition\n"
@@ -74,41 +99,104 @@ const std::string HELP =
 "  gcf.  Greatest common factor\n"
 "\n"
 "Arbitrary operations:\n"
-"  ans  Answer of last expression\n";
+"  ans  Answer of last expression\n"
+"\n"
+"Names:\n"
+"  store <name>  Bind the top operand to a name, leaving it on the stack\n"
+"  <name>        Value bound to the name (e.g. '2 64 ^ store w' then\n"
+"                'w 1 -'), kept until the program exits\n";
 
 // -----------------------------------------------------------------------------
 
-int main(int argc, char* argv[])
+//! Output format of results
+enum class Format { Decimal, Binary };
+
+//! Format a result ('bin:' and the hexadecimal binary format, with checksum,
+// or digits in a radix, either of which reads back as a literal)
+template<class DataT>
+std::string format(const DataT& value, Format format, unsigned radix)
 {
-  bool is_interactive = (isatty(0) && isatty(1));
-  bool is_verbose = false;
-  bool is_debug = false;
-  bool is_running = true;
+  if (format == Format::Binary)
+    return "bin:" + mesa::to_hex(value.serialize(true));
+  return value.toString(radix);
+}
 
-  // Process program options
-  for (char c; (c = getopt(argc, argv, "hvd")) != -1;) {
-    switch (c) {
-      case 'h':
-        std::cout <<
-          "Project 3: PostFixCalculator\n"
-          "Program options:\n"
-          "  -h  Show this message\n"
-          "  -v  Start in verbose mode\n"
-          "  -d  Start in debug mode\n";
-        return 0;
-        break;
-      case 'v':
-        is_verbose = true;
-        break;
-      case 'd':
-        is_debug = true;
-        break;
-      default:
-        std::cout
-          << "Error: Invalid program option '" << c << "'\n";
-        return 1;
-    }
+//! Parse an output radix
+// @return 0 unless 10, 16 or 2
+unsigned parse_radix(const std::string& s)
+{
+  return (s == "10" || s == "16" || s == "2" ? std::stoul(s) : 0);
+}
+
+//! Parse a count given in units (e.g. 1024 for KiB) into a size
+// Unlike strtoul, a sign, trailing characters or overflow are errors rather
+// than wrapping around to a huge count.
+// @return If s is decimal digits whose count in units fits
+bool parse_count(const char* s, size_t& n, size_t unit = 1)
+{
+  n = 0;
+  if (*s == '\0')
+    return false;
+  for (; *s != '\0'; ++s) {
+    if (*s < '0' || *s > '9')
+      return false;
+    const size_t digit = size_t(*s - '0');
+    if (n > (SIZE_MAX - digit) / 10)
+      return false;
+    n = n * 10 + digit;
+  }
+  if (n > SIZE_MAX / unit)
+    return false;
+  n *= unit;
+  return true;
+}
+
+// Token of the evaluation in progress, which SIGINT cancels
+mesa::CancelToken* g_evaluation = nullptr;
+volatile std::sig_atomic_t g_is_evaluating = 0;
+
+//! Cancel the evaluation in progress, or quit as usual between evaluations
+void on_interrupt(int signal)
+{
+  if (g_is_evaluating && g_evaluation) {
+    g_evaluation->cancel();
+    return;
   }
+  std::signal(signal, SIG_DFL);
+  std::raise(signal);
+}
+
+//! Print cache counters
+void print_cache_stats(const std::string& name, const mesa::CacheStats& stats)
+{
+  std::cout
+    << "(" << name << ": " << stats.entries << " entries, "
+    << stats.bytes << "/" << stats.capacity << " bytes, "
+    << stats.hits << " hits, " << stats.misses << " misses, "
+    << stats.evictions << " evictions)\n";
+}
+
+//! Print allocations of an evaluation
+void print_alloc_stats(const mesa::AllocStats& stats)
+{
+  const mesa::AllocStats total = mesa::Allocations::stats();
+  std::cout
+    << "(Allocated " << stats.total << " bytes in " << stats.allocations
+    << " allocations, peak " << stats.peak << " bytes; process "
+    << total.current << " bytes, peak " << total.peak;
+  if (mesa::MappedStorage::mapped() != 0)
+    std::cout << ", mapped " << mesa::MappedStorage::mapped();
+  std::cout << ")\n";
+}
+
+//! Read-evaluate-print loop
+template<class DataT>
+int run(bool is_interactive, bool is_verbose, bool is_debug,
+    size_t cache_bytes, size_t op_cache_bytes, const mesa::Limits& limits,
+    const std::string& stats_path, Format output, unsigned radix)
+{
+  using Calc = mesa::Calc<DataT>;
+  bool is_running = true;
 
   // Logger
   size_t logLevel =
@@ -119,11 +207,16 @@ int main(int argc, char* argv[])
   Calc* calc = Calc::instance();
   calc->stdLogger(&logger);
   calc->errLogger(&logger);
+  calc->cacheCapacity(cache_bytes);
+  calc->opCacheCapacity(op_cache_bytes);
+  calc->limits(limits);
+  g_evaluation = &calc->cancelToken();
+  std::signal(SIGINT, on_interrupt);
 
   // Input containers
   std::string token, prompt;
   char* line;
-  Data result;
+  DataT result;
 
   // Interactive mode message and line prompt
   if (is_interactive) {
@@ -171,20 +264,294 @@ int main(int argc, char* argv[])
     } else if (token == "h" || token == "help" || token == "?") {
       std::cout << HELP;
       continue;
+    } else if (token == "cache") {
+      print_cache_stats("Cache", calc->cacheStats());
+      print_cache_stats("Operation cache", calc->opCacheStats());
+      continue;
+    } else if (token == "stats") {
+      calc->stats().print(std::cout);
+      continue;
+    } else if (token == "vars") {
+      for (const auto& variable: calc->variables())
+        std::cout << "(" << variable.first << ": "
+          << variable.second.digits() << " digits)\n";
+      continue;
+    } else if (token == "radix") {
+      std::string arg;
+      if (std::istringstream{line} >> token >> arg) {
+        if (parse_radix(arg) == 0) {
+          std::cout << "(Invalid radix '" << arg << "', use 10, 16 or 2)\n";
+          continue;
+        }
+        radix = parse_radix(arg);
+      }
+      std::cout << "(Output radix " << radix << ")\n";
+      continue;
     }
 
     // Execute and output
     try {
+      g_is_evaluating = 1;
       result = calc->evaluate(line);
+      g_is_evaluating = 0;
       if (is_verbose)
         std::cout << '"' << line << "\" = ";
-      std::cout << result << "\n";
+      std::cout << format(result, output, radix) << "\n";
+      if (is_verbose)
+        print_alloc_stats(calc->allocations());
     } catch (std::exception& e) {
+      g_is_evaluating = 0;
       std::cout << "Exception!\n  what():  " << e.what() << "\n";
     }
   }
 
   delete line;
 
+  if (!stats_path.empty()) {
+    std::ofstream file{stats_path};
+    calc->stats().json(file);
+    if (!file) {
+      std::cout << "Error: Could not write '" << stats_path << "'\n";
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+//! Serve expressions over a Unix domain socket until SIGINT or SIGTERM
+template<class DataT>
+int serve(const std::string& path, size_t workers, size_t threads,
+    bool is_debug, size_t cache_bytes, size_t op_cache_bytes,
+    const mesa::Limits& limits, Format output, unsigned radix)
+{
+  using Calc = mesa::Calc<DataT>;
+
+  // Only errors of the server itself (and debugging) are printed
+  size_t logLevel = (is_debug * LogLevel::Debug);
+  StreamLogger logger{&std::cerr, logLevel};
+
+  try {
+    // Before any other thread starts, as it blocks SIGINT and SIGTERM
+    mesa::Server<DataT> server{path, workers, [&](Calc& calc)
+      {
+        calc.stdLogger(&logger);
+        calc.errLogger(&logger);
+        calc.cacheCapacity(cache_bytes);
+        calc.opCacheCapacity(op_cache_bytes);
+        calc.limits(limits);
+      },
+      [output, radix](const DataT& result)
+      { return format(result, output, radix); }};
+    if (threads != 0)
+      mesa::ThreadPool::instance().workers(threads - 1);
+    std::cerr << "(Serving on '" << path << "' with " << workers
+      << " workers)\n";
+    server.run();
+  } catch (std::exception& e) {
+    std::cerr << "Error: " << e.what() << "\n";
+    return 1;
+  }
+  std::cerr << "(Stopped serving)\n";
   return 0;
 }
+
+int main(int argc, char* argv[])
+{
+  bool is_interactive = (isatty(0) && isatty(1));
+  bool is_verbose = false;
+  bool is_debug = false;
+  size_t threads = 0;
+  size_t width = 0;
+  size_t cache_bytes = 0;
+  size_t op_cache_bytes = 0;
+  mesa::Limits limits;
+  std::string stats_path;
+  std::string serve_path;
+  Format output = Format::Decimal;
+  unsigned radix = 10;
+  size_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+  // Process program options
+  const option long_options[] = {
+    {"serve",   required_argument, nullptr, 'S'},
+    {"workers", required_argument, nullptr, 'W'},
+    {nullptr,   0,                 nullptr, 0},
+  };
+  for (int c; (c = getopt_long(argc, argv, "hvdj:w:c:m:n:b:t:s:o:r:M:",
+          long_options, nullptr)) != -1;) {
+    switch (c) {
+      case 'h':
+        std::cout <<
+          "Project 3: PostFixCalculator\n"
+          "Program options:\n"
+          "  -h  Show this message\n"
+          "  -v  Start in verbose mode\n"
+          "  -d  Start in debug mode\n"
+          "  -j  Number of threads for parallel arithmetic (-j 1 disables)\n"
+          "  -w  Fixed operand width in bits (128, 256 or 512), wrapping\n"
+          "      modulo 2^w instead of arbitrary precision\n"
+          "  -c  Result cache size in KiB for repeated expressions\n"
+          "      (default 0, disabled)\n"
+          "  -m  Operation cache size in KiB for repeated operand pairs\n"
+          "      (default 0, disabled)\n"
+          "  -n  Maximum digits of any result (default 100000000, 0 for no\n"
+          "      limit)\n"
+          "  -b  Maximum memory in MiB held by an evaluation (default 1024,\n"
+          "      0 for no limit)\n"
+          "  -t  Time limit in milliseconds per evaluation (default 0, none)\n"
+          "  -s  Write per-command statistics as JSON to this file on exit\n"
+          "  -o  Output format: 'dec' (default) or 'bin', the binary format\n"
+          "      in hexadecimal with a checksum, which reads back as a\n"
+          "      'bin:' literal\n"
+          "  -r  Output radix of results: 10 (default), 16 ('0x' prefix) or 2\n"
+          "      ('0b' prefix), which read back as literals\n"
+          "  -M  Keep limb buffers of at least this many MiB in memory-mapped\n"
+          "      temporary files in $TMPDIR (default 0, never), so values\n"
+          "      larger than RAM page to disk; raise -b to match\n"
+          "  --serve <path>  Serve expressions on a Unix domain socket, one\n"
+          "      response line per line, until SIGINT or SIGTERM (-c and -m\n"
+          "      apply per connection)\n"
+          "  --workers <n>  Evaluation threads when serving (default one\n"
+          "      per hardware thread)\n";
+        return 0;
+        break;
+      case 'v':
+        is_verbose = true;
+        break;
+      case 'd':
+        is_debug = true;
+        break;
+      case 'j':
+        if (!parse_count(optarg, threads) || threads == 0) {
+          std::cout << "Error: Invalid thread count '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 'w':
+        if (!parse_count(optarg, width) ||
+            (width != 128 && width != 256 && width != 512)) {
+          std::cout << "Error: Invalid operand width '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 'c':
+        if (!parse_count(optarg, cache_bytes, 1024)) {
+          std::cout << "Error: Invalid cache size '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 'm':
+        if (!parse_count(optarg, op_cache_bytes, 1024)) {
+          std::cout << "Error: Invalid operation cache size '" << optarg
+            << "'\n";
+          return 1;
+        }
+        break;
+      case 'n':
+        if (!parse_count(optarg, limits.digits)) {
+          std::cout << "Error: Invalid digit limit '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 'b':
+        if (!parse_count(optarg, limits.bytes, size_t{1} << 20)) {
+          std::cout << "Error: Invalid memory limit '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 't': {
+        size_t ms = 0;
+        if (!parse_count(optarg, ms) ||
+            ms > size_t(std::chrono::milliseconds::max().count())) {
+          std::cout << "Error: Invalid time limit '" << optarg << "'\n";
+          return 1;
+        }
+        limits.time = std::chrono::milliseconds{
+          static_cast<std::chrono::milliseconds::rep>(ms)};
+        break;
+      }
+      case 's':
+        stats_path = optarg;
+        break;
+      case 'o':
+        if (std::string{optarg} == "dec") {
+          output = Format::Decimal;
+        } else if (std::string{optarg} == "bin") {
+          output = Format::Binary;
+        } else {
+          std::cout << "Error: Invalid output format '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 'r':
+        radix = parse_radix(optarg);
+        if (radix == 0) {
+          std::cout << "Error: Invalid output radix '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      case 'M': {
+        size_t bytes = 0;
+        if (!parse_count(optarg, bytes, size_t{1} << 20)) {
+          std::cout << "Error: Invalid mapping threshold '" << optarg
+            << "'\n";
+          return 1;
+        }
+        mesa::MappedStorage::threshold(bytes);
+        break;
+      }
+      case 'S':
+        serve_path = optarg;
+        break;
+      case 'W':
+        if (!parse_count(optarg, workers) || workers == 0) {
+          std::cout << "Error: Invalid worker count '" << optarg << "'\n";
+          return 1;
+        }
+        break;
+      default:
+        std::cout
+          << "Error: Invalid program option '" << c << "'\n";
+        return 1;
+    }
+  }
+
+  if (!serve_path.empty()) {
+    switch (width) {
+      case 128:
+        return serve<FixedData<128>>(serve_path, workers, threads, is_debug,
+            cache_bytes, op_cache_bytes, limits, output, radix);
+      case 256:
+        return serve<FixedData<256>>(serve_path, workers, threads, is_debug,
+            cache_bytes, op_cache_bytes, limits, output, radix);
+      case 512:
+        return serve<FixedData<512>>(serve_path, workers, threads, is_debug,
+            cache_bytes, op_cache_bytes, limits, output, radix);
+      default:
+        return serve<Data>(serve_path, workers, threads, is_debug,
+            cache_bytes, op_cache_bytes, limits, output, radix);
+    }
+  }
+  if (threads != 0)
+    mesa::ThreadPool::instance().workers(threads - 1);
+
+  switch (width) {
+    case 128:
+      return run<FixedData<128>>(
+          is_interactive, is_verbose, is_debug,
+          cache_bytes, op_cache_bytes, limits, stats_path, output, radix);
+    case 256:
+      return run<FixedData<256>>(
+          is_interactive, is_verbose, is_debug,
+          cache_bytes, op_cache_bytes, limits, stats_path, output, radix);
+    case 512:
+      return run<FixedData<512>>(
+          is_interactive, is_verbose, is_debug,
+          cache_bytes, op_cache_bytes, limits, stats_path, output, radix);
+    default:
+      return run<Data>(
+          is_interactive, is_verbose, is_debug,
+          cache_bytes, op_cache_bytes, limits, stats_path, output, radix);
+  }
+}
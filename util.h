@@ -1,21 +1,101 @@
 #pragma once
 
 #include <string>
+#include <cctype>
+#include <cstdint>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <stack>
 #include <queue>
 
 namespace mesa
 {
+  // @return If string is decimal digits with an optional leading '-'
   inline bool is_numeric(const std::string& s)
   {
-    for (auto c: s)
-      if (c < '0' || c > '9')
+    size_t i = (!s.empty() && s[0] == '-');
+    if (i == 1 && s.size() == 1)
+      return false;
+    for (; i < s.size(); ++i)
+      if (s[i] < '0' || s[i] > '9')
         return false;
     return true;
   }
 
+  // @return Bits per digit of a '0x' hexadecimal (4) or '0b' binary (1)
+  // literal with an optional leading '-' and at least one digit, else 0
+  inline unsigned radix_bits(const std::string& s)
+  {
+    const size_t i = (!s.empty() && s[0] == '-');
+    if (s.size() < i + 3 || s[i] != '0')
+      return 0;
+    const char prefix = s[i + 1];
+    if (prefix != 'x' && prefix != 'b')
+      return 0;
+    for (size_t j = i + 2; j < s.size(); ++j) {
+      const char c = s[j];
+      if (prefix == 'x' ? !std::isxdigit(uint8_t(c)) :
+          (c != '0' && c != '1'))
+        return 0;
+    }
+    return (prefix == 'x' ? 4 : 1);
+  }
+
+  // @return If string is a letter or '_' followed by letters, digits or '_'
+  inline bool is_name(const std::string& s)
+  {
+    if (s.empty() || !(std::isalpha(s[0]) || s[0] == '_'))
+      return false;
+    for (char c: s)
+      if (!(std::isalnum(c) || c == '_'))
+        return false;
+    return true;
+  }
+
+  // @return Bytes as lowercase hexadecimal digits, two per byte
+  inline std::string to_hex(const std::string& bytes)
+  {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(2 * bytes.size(), '0');
+    for (size_t i = 0; i < bytes.size(); ++i) {
+      s[2 * i]     = digits[uint8_t(bytes[i]) >> 4];
+      s[2 * i + 1] = digits[uint8_t(bytes[i]) & 15];
+    }
+    return s;
+  }
+
+  // @return Bytes of hexadecimal digits (either case) from an offset on
+  // @throws std::invalid_argument Odd number of digits or a non-digit
+  inline std::string from_hex(const std::string& s, size_t first = 0)
+  {
+    auto nibble = [&s](char c) -> uint8_t
+    {
+      if (c >= '0' && c <= '9') return uint8_t(c - '0');
+      if (c >= 'a' && c <= 'f') return uint8_t(c - 'a' + 10);
+      if (c >= 'A' && c <= 'F') return uint8_t(c - 'A' + 10);
+      throw std::invalid_argument("Invalid hexadecimal in '" +
+          s.substr(0, 32) + (s.size() > 32 ? "...'" : "'"));
+    };
+    if (first > s.size() || (s.size() - first) % 2 != 0) {
+      throw std::invalid_argument("Odd number of hexadecimal digits in '" +
+          s.substr(0, 32) + (s.size() > 32 ? "...'" : "'"));
+    }
+    std::string bytes((s.size() - first) / 2, '\0');
+    for (size_t i = 0; i < bytes.size(); ++i)
+      bytes[i] = char(nibble(s[first + 2 * i]) << 4 |
+          nibble(s[first + 2 * i + 1]));
+    return bytes;
+  }
+
+  // @return Well-mixed 64-bit hash of a 64-bit integer (splitmix64 finalizer)
+  inline uint64_t hash_mix(uint64_t x)
+  {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+  }
+
   // @return Vector of space delimited token strings from an input string
   inline std::vector<std::string> vectorify(const std::string& s)
   {
@@ -39,6 +119,19 @@ namespace mesa
     return tokens;
   }
 
+  // @return Space delimited tokens of a string, joined by single spaces
+  inline std::string normalize(const std::string& s)
+  {
+    std::istringstream iss{s};
+    std::string token, result;
+    while (iss >> token) {
+      if (!result.empty())
+        result += ' ';
+      result += token;
+    }
+    return result;
+  }
+
   // @return Queue of space delimited token strings from an input string
   inline std::queue<std::string> queuify(const std::string& s)
   {